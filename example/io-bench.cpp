@@ -0,0 +1,131 @@
+/**
+ * Loopback throughput for the socket I/O backend.
+ *
+ * Runs keep-alive HTTP requests through net::http::client against a minimal
+ * in-process server, then fires statsd packets at a local UDP socket, and
+ * reports the rate for each. Build twice to compare backends:
+ *
+ *     g++ -std=c++14 -O2 -Iinclude io-bench.cpp ...                   # epoll
+ *     g++ -std=c++14 -O2 -Iinclude -DBOOST_ASIO_HAS_IO_URING \
+ *         -DBOOST_ASIO_DISABLE_EPOLL io-bench.cpp ... -luring         # io_uring
+ *
+ * Usage: io-bench [connections] [requests] [packets]
+ */
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+
+#include <net/asio/io_backend.h>
+#include <net/asio/http.h>
+#include <net/asio/statsd.h>
+
+namespace {
+
+const std::string reply = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok";
+
+/** Answers every request with the same small response, keeping the connection open */
+class responder : public std::enable_shared_from_this<responder> {
+public:
+	responder(boost::asio::ip::tcp::socket &&sock):sock_(std::move(sock)) { }
+
+	void read() {
+		auto self = shared_from_this();
+		boost::asio::async_read_until(sock_, in_, "\r\n\r\n", [self](const boost::system::error_code &ec, size_t n) {
+			if(ec)
+				return;
+			self->in_.consume(n);
+			boost::asio::async_write(self->sock_, boost::asio::buffer(reply), [self](const boost::system::error_code &ec, size_t) {
+				if(!ec)
+					self->read();
+			});
+		});
+	}
+
+private:
+	boost::asio::ip::tcp::socket sock_;
+	boost::asio::streambuf in_;
+};
+
+void accept(boost::asio::ip::tcp::acceptor &acc) {
+	acc.async_accept([&acc](const boost::system::error_code &ec, boost::asio::ip::tcp::socket sock) {
+		if(ec)
+			return;
+		std::make_shared<responder>(std::move(sock))->read();
+		accept(acc);
+	});
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+};
+
+int main(int argc, char **argv) {
+	size_t connections = argc > 1 ? std::stoul(argv[1]) : 64;
+	size_t requests = argc > 2 ? std::stoul(argv[2]) : 100000;
+	size_t packets = argc > 3 ? std::stoul(argv[3]) : 500000;
+	std::cout << "backend: " << net::asio::io_backend() << "\n";
+
+	{
+		boost::asio::io_service service;
+		boost::asio::ip::tcp::acceptor acc { service, { boost::asio::ip::address_v4::loopback(), 0 } };
+		accept(acc);
+		auto target = "http://127.0.0.1:" + std::to_string(acc.local_endpoint().port()) + "/";
+
+		net::http::client c { service };
+		c.max_connections(connections);
+		size_t started = 0, finished = 0;
+		std::function<void()> next = [&]() {
+			if(started == requests)
+				return;
+			++started;
+			auto res = c.GET(net::http::request { net::http::uri { target } });
+			res->completion()->on_ready([&](cps::future<uint16_t> &) {
+				if(++finished == requests) {
+					acc.close();
+					service.stop();
+				} else {
+					next();
+				}
+			});
+		};
+		auto start = std::chrono::steady_clock::now();
+		for(size_t i = 0; i < connections; ++i)
+			next();
+		service.run();
+		auto elapsed = seconds_since(start);
+		std::cout << "http: " << finished << " requests over " << connections << " connections in "
+			<< elapsed << "s, " << static_cast<uint64_t>(finished / elapsed) << " req/s\n";
+	}
+
+	{
+		boost::asio::io_service service;
+		boost::asio::ip::udp::socket sink { service, { boost::asio::ip::address_v4::loopback(), 0 } };
+		auto port = sink.local_endpoint().port();
+		auto stats = net::statsd::client::create(service);
+		size_t sent = 0, failed = 0;
+		auto start = std::chrono::steady_clock::now();
+		stats->connect(net::statsd::connection_details { "127.0.0.1", port })->on_done([&](int) {
+			start = std::chrono::steady_clock::now();
+			for(size_t i = 0; i < packets; ++i) {
+				stats->inc("bench.counter")->on_ready([&](cps::future<int> &f) {
+					if(f.is_done())
+						++sent;
+					else
+						++failed;
+					if(sent + failed == packets)
+						service.stop();
+				});
+			}
+		});
+		service.run();
+		auto elapsed = seconds_since(start);
+		std::cout << "statsd: " << sent << " packets (" << failed << " failed) in "
+			<< elapsed << "s, " << static_cast<uint64_t>(sent / elapsed) << " packets/s\n";
+	}
+	return 0;
+}
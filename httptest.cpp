@@ -23,7 +23,7 @@ class http_details {
 public:
 	http_details(
 		const net::http::uri &u
-	):host_{ u.host() },
+	):host_{ u.host().to_string() },
 	  port_{ u.port() }
 	{
 		// std::cout << " hd => " << string() << "\n";
@@ -7,6 +7,8 @@
 #include <boost/asio/ip/address.hpp>
 #include <cps/future.h>
 
+#include <net/asio/socket_options.h>
+
 namespace net {
 namespace amqp {
 
@@ -61,6 +63,11 @@ virtual ~client() { }
 								if(ec) {
 									f->fail(ec.message());
 								} else {
+									/* async_connect reopens the socket for each address, so
+									 * options go on afterwards - too late for fast open or
+									 * for buffer sizes to affect window scaling.
+									 */
+									self->socket_options_.apply_or_warn(*socket_);
 									tcp::socket::non_blocking_io nb(true);
 									socket_->io_control(nb);
 									auto mc = std::make_shared<net::amqp::connection>(socket_, self->service_, cd);
@@ -82,8 +89,12 @@ virtual ~client() { }
 		return f;
 	}
 
+	/** Options for the sockets {@link connect} opens */
+	void socket_options(const net::asio::socket_options &opt) { socket_options_ = opt; }
+
 private:
 	boost::asio::io_service &service_;
+	net::asio::socket_options socket_options_;
 };
 
 };
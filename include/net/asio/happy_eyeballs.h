@@ -0,0 +1,311 @@
+#pragma once
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/asio/high_resolution_timer.hpp>
+
+#include <cps/future.h>
+
+namespace net {
+namespace asio {
+
+/**
+ * Races TCP connection attempts across a set of addresses, as described
+ * in RFC 8305 (Happy Eyeballs v2).
+ *
+ * Addresses are tried in the order given, except that IPv6 and IPv4 are
+ * interleaved so that a broken family can't hold everything up. Each new
+ * attempt starts after attempt_delay, or straight away if the previous
+ * one failed. Every attempt has its own timeout, so a black-holed address
+ * costs us attempt_timeout rather than however long the kernel takes to
+ * give up. The first connection to succeed wins and the rest are dropped.
+ *
+ * Must be held in a std::shared_ptr.
+ */
+class happy_eyeballs : public std::enable_shared_from_this<happy_eyeballs> {
+public:
+	using endpoint = boost::asio::ip::tcp::endpoint;
+	using socket = boost::asio::ip::tcp::socket;
+
+	struct options {
+		options(
+		):attempt_delay{ std::chrono::milliseconds(250) },
+		  attempt_timeout{ std::chrono::seconds(5) }
+		{
+		}
+
+		/** How long to give each attempt before starting the next one */
+		std::chrono::milliseconds attempt_delay;
+		/** How long before we give up on a single attempt */
+		std::chrono::milliseconds attempt_timeout;
+		/** Called on each socket after it's opened and before it connects, to set options */
+		std::function<void(socket &)> prepare;
+	};
+
+	/**
+	 * Puts the addresses in the order we'll try them: keeping the first
+	 * where it is, then alternating between address families.
+	 */
+	static
+	std::vector<endpoint>
+	interleave(const std::vector<endpoint> &in)
+	{
+		if(in.empty())
+			return in;
+		std::vector<endpoint> first, second;
+		auto v6 = in.front().address().is_v6();
+		for(const auto &ep : in)
+			(ep.address().is_v6() == v6 ? first : second).push_back(ep);
+		std::vector<endpoint> out;
+		out.reserve(in.size());
+		for(size_t i = 0; i < first.size() || i < second.size(); ++i) {
+			if(i < first.size())
+				out.push_back(first[i]);
+			if(i < second.size())
+				out.push_back(second[i]);
+		}
+		return out;
+	}
+
+	happy_eyeballs(
+		boost::asio::io_service &service,
+		const std::vector<endpoint> &endpoints,
+		const options &opt = options { }
+	):service_(service),
+	  endpoints_(interleave(endpoints)),
+	  options_(opt),
+	  delay_(service),
+	  next_{ 0 },
+	  failed_{ 0 },
+	  finished_{ false },
+	  result_(cps::future<std::shared_ptr<socket>>::create_shared("connect race"))
+	{
+	}
+
+	happy_eyeballs(const happy_eyeballs &) = delete;
+	happy_eyeballs(happy_eyeballs &&) = delete;
+	virtual ~happy_eyeballs() = default;
+
+	/**
+	 * Starts connecting. Resolves with the first socket to connect,
+	 * or fails once every address has failed.
+	 */
+	std::shared_ptr<cps::future<std::shared_ptr<socket>>>
+	start()
+	{
+		if(endpoints_.empty())
+			return result_->fail("No addresses to connect to");
+		std::lock_guard<std::mutex> guard { mutex_ };
+		start_next_locked();
+		return result_;
+	}
+
+	/** Abandons all attempts */
+	void
+	cancel()
+	{
+		std::vector<std::shared_ptr<attempt>> dropped;
+		{
+			std::lock_guard<std::mutex> guard { mutex_ };
+			if(finished_)
+				return;
+			finished_ = true;
+			dropped = stop_locked(nullptr);
+		}
+		report_abandoned(dropped);
+		result_->cancel();
+	}
+
+	/** Called as each attempt starts */
+	std::function<void(const endpoint &)> on_attempt;
+	/**
+	 * Called as each attempt finishes: with no error for the winner, with
+	 * operation_aborted for those we dropped, and the reason otherwise.
+	 */
+	std::function<void(const endpoint &, const boost::system::error_code &)> on_result;
+
+private:
+	struct attempt {
+		attempt(
+			boost::asio::io_service &service,
+			const endpoint &ep
+		):ep(ep),
+		  sock(std::make_shared<socket>(service)),
+		  timer(service),
+		  done{ false }
+		{
+		}
+
+		endpoint ep;
+		std::shared_ptr<socket> sock;
+		boost::asio::high_resolution_timer timer;
+		/** Set once we've had an outcome for this attempt */
+		bool done;
+	};
+
+	void
+	start_next_locked()
+	{
+		if(finished_ || next_ >= endpoints_.size())
+			return;
+		auto self = shared_from_this();
+		auto a = std::make_shared<attempt>(service_, endpoints_[next_++]);
+		attempts_.push_back(a);
+		if(on_attempt)
+			on_attempt(a->ep);
+
+		boost::system::error_code err;
+		a->sock->open(a->ep.protocol(), err);
+		if(!err && options_.prepare)
+			options_.prepare(*a->sock);
+		if(err) {
+			service_.post([self, a, err]() {
+				self->attempt_failed(a, err);
+			});
+			return;
+		}
+
+		a->timer.expires_from_now(options_.attempt_timeout);
+		a->timer.async_wait([self, a](const boost::system::error_code &ec) {
+			if(ec)
+				return;
+			self->attempt_failed(a, boost::asio::error::timed_out);
+		});
+		a->sock->async_connect(a->ep, [self, a](const boost::system::error_code &ec) {
+			if(ec)
+				self->attempt_failed(a, ec);
+			else
+				self->attempt_succeeded(a);
+		});
+
+		/* Give this one a head start before trying the next */
+		if(next_ < endpoints_.size()) {
+			delay_.expires_from_now(options_.attempt_delay);
+			delay_.async_wait([self](const boost::system::error_code &ec) {
+				if(ec)
+					return;
+				std::lock_guard<std::mutex> guard { self->mutex_ };
+				self->start_next_locked();
+			});
+		}
+	}
+
+	void
+	attempt_succeeded(const std::shared_ptr<attempt> &a)
+	{
+		bool won = false;
+		std::vector<std::shared_ptr<attempt>> dropped;
+		{
+			std::lock_guard<std::mutex> guard { mutex_ };
+			if(a->done)
+				return;
+			a->done = true;
+			boost::system::error_code ec;
+			a->timer.cancel(ec);
+			if(finished_) {
+				/* Lost the race by a whisker */
+				a->sock->close(ec);
+			} else {
+				finished_ = true;
+				won = true;
+				dropped = stop_locked(a);
+			}
+		}
+		if(!won) {
+			if(on_result)
+				on_result(a->ep, boost::asio::error::operation_aborted);
+			return;
+		}
+		if(on_result)
+			on_result(a->ep, boost::system::error_code { });
+		report_abandoned(dropped);
+		result_->done(a->sock);
+	}
+
+	void
+	attempt_failed(const std::shared_ptr<attempt> &a, const boost::system::error_code &ec)
+	{
+		bool all_failed = false;
+		{
+			std::lock_guard<std::mutex> guard { mutex_ };
+			if(a->done)
+				return;
+			a->done = true;
+			boost::system::error_code ignored;
+			a->timer.cancel(ignored);
+			a->sock->close(ignored);
+			if(finished_)
+				return;
+			last_error_ = ec;
+			++failed_;
+			if(failed_ == endpoints_.size()) {
+				finished_ = true;
+				all_failed = true;
+				delay_.cancel(ignored);
+			} else if(failed_ == next_) {
+				/* Nothing else in progress, so don't wait for the delay */
+				delay_.cancel(ignored);
+				start_next_locked();
+			}
+		}
+		if(on_result)
+			on_result(a->ep, ec);
+		if(all_failed)
+			result_->fail("Connect failed: " + last_error_.message());
+	}
+
+	/**
+	 * Drops every attempt other than the winner, returning the ones which
+	 * were still in progress.
+	 */
+	std::vector<std::shared_ptr<attempt>>
+	stop_locked(const std::shared_ptr<attempt> &winner)
+	{
+		std::vector<std::shared_ptr<attempt>> dropped;
+		boost::system::error_code ec;
+		delay_.cancel(ec);
+		for(auto &a : attempts_) {
+			if(a == winner || a->done)
+				continue;
+			a->done = true;
+			a->timer.cancel(ec);
+			a->sock->close(ec);
+			dropped.push_back(a);
+		}
+		attempts_.clear();
+		return dropped;
+	}
+
+	void
+	report_abandoned(const std::vector<std::shared_ptr<attempt>> &dropped)
+	{
+		if(!on_result)
+			return;
+		for(auto &a : dropped)
+			on_result(a->ep, boost::asio::error::operation_aborted);
+	}
+
+	boost::asio::io_service &service_;
+	std::vector<endpoint> endpoints_;
+	options options_;
+	/** Staggers the start of each attempt */
+	boost::asio::high_resolution_timer delay_;
+
+	std::mutex mutex_;
+	std::vector<std::shared_ptr<attempt>> attempts_;
+	/** Index of the next address to try */
+	size_t next_;
+	/** Attempts which have failed so far */
+	size_t failed_;
+	/** Set once we have a winner, or have run out of addresses */
+	bool finished_;
+	boost::system::error_code last_error_;
+	std::shared_ptr<cps::future<std::shared_ptr<socket>>> result_;
+};
+
+};
+};
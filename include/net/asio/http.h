@@ -10,13 +10,20 @@
 
 #include <net/asio/http/uri.h>
 #include <net/asio/http/message.h>
+#include <net/asio/http/file_body.h>
+#include <net/asio/http/chunked_decoder.h>
 #include <net/asio/http/request.h>
 #include <net/asio/http/response.h>
+#include <net/asio/http/batch.h>
+#include <net/asio/http/address_balancer.h>
 #include <net/asio/http/connection.h>
 #include <net/asio/http/connection/tcp.h>
+#include <net/asio/http/connection/unix_socket.h>
 #include <net/asio/http/connection/tls.h>
 #include <net/asio/http/connection_pool.h>
 #include <net/asio/http/client.h>
+#include <net/asio/http/websocket.h>
+#include <net/asio/http/event_stream.h>
 
 namespace net {
 namespace http {
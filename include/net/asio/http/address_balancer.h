@@ -0,0 +1,494 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+
+#include <cps/future.h>
+
+namespace net {
+namespace http {
+
+/**
+ * Spreads connections for one endpoint across every address its hostname
+ * resolves to.
+ *
+ * Each new connection picks an address by power-of-two-choices: two healthy
+ * addresses are sampled at random and the one with less work outstanding
+ * wins, with latency as the tie-breaker. Addresses which fail repeatedly, or
+ * whose latency is well out of line with the rest, are ejected for a while
+ * and then re-admitted - the next connection after the ejection period
+ * serves as the probe, and failing that doubles the ejection time.
+ *
+ * The resolved list is refreshed periodically, keeping the statistics for
+ * any addresses which are still present.
+ *
+ * Must be held in a std::shared_ptr.
+ */
+class address_balancer : public std::enable_shared_from_this<address_balancer> {
+public:
+	using endpoint = boost::asio::ip::tcp::endpoint;
+	using clock = std::chrono::steady_clock;
+
+	struct options {
+		options(
+		):failure_threshold{ 3 },
+		  base_ejection{ std::chrono::seconds(5) },
+		  max_ejection{ std::chrono::seconds(60) },
+		  latency_factor{ 3.0 },
+		  min_latency_samples{ 5 },
+		  refresh_interval{ std::chrono::seconds(60) }
+		{
+		}
+
+		/** Consecutive failures before an address is ejected */
+		size_t failure_threshold;
+		/** First ejection lasts this long, doubling on each repeat */
+		clock::duration base_ejection;
+		clock::duration max_ejection;
+		/** Eject when average latency exceeds this multiple of the median */
+		double latency_factor;
+		/** Latency samples needed before an address can be judged */
+		size_t min_latency_samples;
+		/** How often we resolve the hostname again */
+		clock::duration refresh_interval;
+	};
+
+	/** What we know about each address */
+	struct address {
+		address(
+			const endpoint &ep
+		):ep(ep),
+		  pending{ 0 },
+		  in_flight{ 0 },
+		  latency{ 0.0 },
+		  samples{ 0 },
+		  failures{ 0 },
+		  ejections{ 0 },
+		  ejected_until{ }
+		{
+		}
+
+		endpoint ep;
+		/** Connections being established */
+		size_t pending;
+		/** Requests waiting on a response */
+		size_t in_flight;
+		/** Moving average of response latency, in milliseconds */
+		double latency;
+		size_t samples;
+		/** Consecutive failures */
+		size_t failures;
+		/** Number of times we've been ejected without a healthy request since */
+		size_t ejections;
+		clock::time_point ejected_until;
+	};
+
+	address_balancer(
+		boost::asio::io_service &service,
+		const std::string &host,
+		uint16_t port,
+		const options &opt = options { }
+	):service_(service),
+	  host_(host),
+	  port_(port),
+	  options_(opt),
+	  rng_(std::random_device { }()),
+	  resolving_{ false }
+	{
+	}
+
+	address_balancer(const address_balancer &) = delete;
+	address_balancer(address_balancer &&) = delete;
+	virtual ~address_balancer() = default;
+
+	/**
+	 * Picks the address for a new connection, resolving the hostname first
+	 * if we have nothing yet. The caller must report the outcome through
+	 * {@link connected} or {@link failed}.
+	 */
+	std::shared_ptr<cps::future<endpoint>>
+	pick()
+	{
+		auto f = cps::future<endpoint>::create_shared("address for " + host_ + ":" + std::to_string(port_));
+		endpoint ep;
+		{
+			std::lock_guard<std::mutex> guard { mutex_ };
+			if(addresses_.empty()) {
+				waiting_.push_back(f);
+				refresh_locked();
+				return f;
+			}
+			if(clock::now() - resolved_at_ > options_.refresh_interval)
+				refresh_locked();
+			ep = pick_locked();
+		}
+		return f->done(ep);
+	}
+
+	/**
+	 * Replaces the address list. Statistics carry over for addresses we
+	 * already knew about.
+	 */
+	void
+	update(const std::vector<endpoint> &eps)
+	{
+		std::vector<std::shared_ptr<cps::future<endpoint>>> waiting;
+		std::vector<endpoint> picked;
+		{
+			std::lock_guard<std::mutex> guard { mutex_ };
+			std::vector<address> next;
+			next.reserve(eps.size());
+			for(const auto &ep : eps) {
+				auto it = find_locked(ep);
+				next.push_back(it == addresses_.end() ? address { ep } : *it);
+			}
+			addresses_ = std::move(next);
+			resolved_at_ = clock::now();
+			if(!addresses_.empty()) {
+				waiting.swap(waiting_);
+				for(size_t i = 0; i < waiting.size(); ++i)
+					picked.push_back(pick_locked());
+			}
+		}
+		for(size_t i = 0; i < waiting.size(); ++i)
+			waiting[i]->done(picked[i]);
+	}
+
+	/**
+	 * The other healthy addresses, least loaded first, for racing
+	 * alongside the one {@link pick} gave us. These don't count as
+	 * pending until reported through {@link attempting}.
+	 */
+	std::vector<endpoint>
+	alternatives(const endpoint &picked) const
+	{
+		std::lock_guard<std::mutex> guard { mutex_ };
+		auto now = clock::now();
+		std::vector<const address *> others;
+		for(const auto &a : addresses_) {
+			if(a.ep != picked && !is_ejected_locked(a, now))
+				others.push_back(&a);
+		}
+		std::stable_sort(
+			others.begin(),
+			others.end(),
+			[](const address *a, const address *b) { return better(*a, *b) && !better(*b, *a); }
+		);
+		std::vector<endpoint> out;
+		out.reserve(others.size());
+		for(auto a : others)
+			out.push_back(a->ep);
+		return out;
+	}
+
+	/** We've started connecting to an address we didn't get from {@link pick} */
+	void
+	attempting(const endpoint &ep)
+	{
+		std::lock_guard<std::mutex> guard { mutex_ };
+		auto it = find_locked(ep);
+		if(it != addresses_.end())
+			++it->pending;
+	}
+
+	/** We gave up on a connection attempt before it finished, which says nothing about the address */
+	void
+	abandoned(const endpoint &ep)
+	{
+		std::lock_guard<std::mutex> guard { mutex_ };
+		auto it = find_locked(ep);
+		if(it != addresses_.end() && it->pending > 0)
+			--it->pending;
+	}
+
+	/** A connection to this address succeeded */
+	void
+	connected(const endpoint &ep)
+	{
+		std::lock_guard<std::mutex> guard { mutex_ };
+		auto it = find_locked(ep);
+		if(it == addresses_.end())
+			return;
+		if(it->pending > 0)
+			--it->pending;
+		it->failures = 0;
+	}
+
+	/** A connection or request on this address failed */
+	void
+	failed(const endpoint &ep)
+	{
+		std::lock_guard<std::mutex> guard { mutex_ };
+		auto it = find_locked(ep);
+		if(it == addresses_.end())
+			return;
+		if(it->pending > 0)
+			--it->pending;
+		fail_locked(*it);
+	}
+
+	/** A request has been sent on a connection to this address */
+	void
+	request_started(const endpoint &ep)
+	{
+		std::lock_guard<std::mutex> guard { mutex_ };
+		auto it = find_locked(ep);
+		if(it != addresses_.end())
+			++it->in_flight;
+	}
+
+	/**
+	 * The response to a request has arrived, after the given time.
+	 * Addresses which are consistently much slower than their peers
+	 * are ejected.
+	 */
+	void
+	request_finished(const endpoint &ep, clock::duration elapsed)
+	{
+		std::lock_guard<std::mutex> guard { mutex_ };
+		auto it = find_locked(ep);
+		if(it == addresses_.end())
+			return;
+		if(it->in_flight > 0)
+			--it->in_flight;
+		it->failures = 0;
+
+		auto ms = std::chrono::duration<double, std::milli>(elapsed).count();
+		it->latency = it->samples == 0 ? ms : it->latency * 0.8 + ms * 0.2;
+		++it->samples;
+
+		if(is_latency_outlier_locked(*it))
+			eject_locked(*it);
+		else
+			it->ejections = 0;
+	}
+
+	/** A request was abandoned before its response arrived */
+	void
+	request_failed(const endpoint &ep)
+	{
+		std::lock_guard<std::mutex> guard { mutex_ };
+		auto it = find_locked(ep);
+		if(it == addresses_.end())
+			return;
+		if(it->in_flight > 0)
+			--it->in_flight;
+		fail_locked(*it);
+	}
+
+	/** True if the address is currently ejected */
+	bool
+	is_ejected(const endpoint &ep) const
+	{
+		std::lock_guard<std::mutex> guard { mutex_ };
+		auto it = std::find_if(
+			addresses_.begin(),
+			addresses_.end(),
+			[&ep](const address &a) { return a.ep == ep; }
+		);
+		return it != addresses_.end() && is_ejected_locked(*it, clock::now());
+	}
+
+	/** Snapshot of the current state, for monitoring */
+	std::vector<address>
+	addresses() const
+	{
+		std::lock_guard<std::mutex> guard { mutex_ };
+		return addresses_;
+	}
+
+	const std::string &host() const { return host_; }
+	uint16_t port() const { return port_; }
+
+private:
+	std::vector<address>::iterator
+	find_locked(const endpoint &ep)
+	{
+		return std::find_if(
+			addresses_.begin(),
+			addresses_.end(),
+			[&ep](const address &a) { return a.ep == ep; }
+		);
+	}
+
+	static bool
+	is_ejected_locked(const address &a, clock::time_point now)
+	{
+		return a.ejected_until > now;
+	}
+
+	/**
+	 * Counts a failure. A failed probe of an address which was due back
+	 * from ejection sends it straight back out for longer.
+	 */
+	void
+	fail_locked(address &a)
+	{
+		++a.failures;
+		if(a.failures >= options_.failure_threshold || a.ejections > 0)
+			eject_locked(a);
+	}
+
+	void
+	eject_locked(address &a)
+	{
+		auto shift = std::min<size_t>(a.ejections, 16);
+		auto duration = options_.base_ejection * (1 << shift);
+		if(duration > options_.max_ejection)
+			duration = options_.max_ejection;
+		a.ejected_until = clock::now() + duration;
+		++a.ejections;
+		a.failures = 0;
+		/* Whatever made it slow may be fixed by the time it's back, so the probe starts a new average */
+		a.latency = 0.0;
+		a.samples = 0;
+	}
+
+	/**
+	 * Compares against the median latency of the other healthy addresses.
+	 * We never eject the last healthy address on latency alone.
+	 */
+	bool
+	is_latency_outlier_locked(const address &a)
+	{
+		if(a.samples < options_.min_latency_samples)
+			return false;
+		auto now = clock::now();
+		std::vector<double> others;
+		for(const auto &o : addresses_) {
+			if(&o == &a || o.samples < options_.min_latency_samples || is_ejected_locked(o, now))
+				continue;
+			others.push_back(o.latency);
+		}
+		if(others.empty())
+			return false;
+		auto mid = others.begin() + static_cast<std::ptrdiff_t>(others.size() / 2);
+		std::nth_element(others.begin(), mid, others.end());
+		return a.latency > *mid * options_.latency_factor;
+	}
+
+	/** Power of two choices over the healthy addresses */
+	endpoint
+	pick_locked()
+	{
+		auto now = clock::now();
+		std::vector<size_t> healthy;
+		healthy.reserve(addresses_.size());
+		for(size_t i = 0; i < addresses_.size(); ++i) {
+			if(!is_ejected_locked(addresses_[i], now))
+				healthy.push_back(i);
+		}
+
+		size_t chosen;
+		if(healthy.empty()) {
+			/* Everything is ejected - probe whichever is due back first */
+			chosen = 0;
+			for(size_t i = 1; i < addresses_.size(); ++i) {
+				if(addresses_[i].ejected_until < addresses_[chosen].ejected_until)
+					chosen = i;
+			}
+		} else if(healthy.size() == 1) {
+			chosen = healthy[0];
+		} else {
+			std::uniform_int_distribution<size_t> dist { 0, healthy.size() - 1 };
+			auto a = dist(rng_);
+			auto b = dist(rng_);
+			while(b == a)
+				b = dist(rng_);
+			chosen = better(addresses_[healthy[a]], addresses_[healthy[b]]) ? healthy[a] : healthy[b];
+		}
+		++addresses_[chosen].pending;
+		return addresses_[chosen].ep;
+	}
+
+	/** True if we'd rather send the next connection to a than to b */
+	static bool
+	better(const address &a, const address &b)
+	{
+		auto load_a = a.pending + a.in_flight;
+		auto load_b = b.pending + b.in_flight;
+		if(load_a != load_b)
+			return load_a < load_b;
+		return a.latency <= b.latency;
+	}
+
+	/** Kicks off a resolve if there isn't one running already */
+	void
+	refresh_locked()
+	{
+		using boost::asio::ip::tcp;
+		if(resolving_)
+			return;
+		resolving_ = true;
+		auto resolver = std::make_shared<tcp::resolver>(service_);
+		auto query = std::make_shared<tcp::resolver::query>(
+			host_,
+			std::to_string(port_)
+		);
+		std::weak_ptr<address_balancer> weak = shared_from_this();
+		resolver->async_resolve(
+			*query,
+			[weak, resolver, query](
+				const boost::system::error_code &ec,
+				tcp::resolver::iterator it
+			) {
+				auto self = weak.lock();
+				if(!self)
+					return;
+				self->resolved(ec, it);
+			}
+		);
+	}
+
+	void
+	resolved(
+		const boost::system::error_code &ec,
+		boost::asio::ip::tcp::resolver::iterator it
+	)
+	{
+		using boost::asio::ip::tcp;
+		std::vector<endpoint> eps;
+		if(!ec) {
+			for(; it != tcp::resolver::iterator { }; ++it)
+				eps.push_back(it->endpoint());
+		}
+		{
+			std::lock_guard<std::mutex> guard { mutex_ };
+			resolving_ = false;
+		}
+		if(!eps.empty()) {
+			update(eps);
+			return;
+		}
+
+		/* Keep what we had, but anyone waiting for a first result has to fail */
+		std::vector<std::shared_ptr<cps::future<endpoint>>> waiting;
+		{
+			std::lock_guard<std::mutex> guard { mutex_ };
+			waiting.swap(waiting_);
+		}
+		for(auto &f : waiting)
+			f->fail("Resolve failed for " + host_ + ": " + (ec ? ec.message() : std::string { "no addresses" }));
+	}
+
+	boost::asio::io_service &service_;
+	std::string host_;
+	uint16_t port_;
+	options options_;
+
+	mutable std::mutex mutex_;
+	std::vector<address> addresses_;
+	clock::time_point resolved_at_;
+	std::mt19937 rng_;
+	bool resolving_;
+	/** Callers waiting for the first resolve */
+	std::vector<std::shared_ptr<cps::future<endpoint>>> waiting_;
+};
+
+};
+};
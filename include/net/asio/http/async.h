@@ -0,0 +1,202 @@
+#pragma once
+#include <deque>
+#include <memory>
+#include <string>
+#include <exception>
+#include <functional>
+#include <stdexcept>
+#include <boost/version.hpp>
+#include <boost/asio.hpp>
+
+#include <net/asio/http/response.h>
+
+#if BOOST_VERSION < 107000
+#error "net/asio/http/async.h needs boost::asio::async_initiate (Boost 1.70 or later)"
+#endif
+
+namespace net {
+namespace http {
+
+/**
+ * Asio completion-token interface for HTTP responses.
+ *
+ * These wrap the cps::future completions in the usual Asio async operation
+ * shape, so they can be used with whatever token the caller prefers:
+ *
+ *     auto res = co_await async_response(service, c.GET(req), boost::asio::use_awaitable);
+ *
+ * or a yield_context, use_future, or a plain callback. Handlers are called
+ * as void(std::exception_ptr, T) and always via their associated executor -
+ * never inline from the initiating call.
+ */
+namespace detail {
+
+/**
+ * Invokes the handler with the given result on its associated executor,
+ * falling back to the io_service.
+ */
+template<typename Handler, typename T>
+void
+complete_on_executor(
+	boost::asio::io_service &service,
+	std::shared_ptr<Handler> handler,
+	std::exception_ptr err,
+	T value
+)
+{
+	auto ex = boost::asio::get_associated_executor(*handler, service.get_executor());
+	boost::asio::post(
+		ex,
+		[handler, err, value]() mutable {
+			std::move(*handler)(err, std::move(value));
+		}
+	);
+}
+
+};
+
+/**
+ * Waits for the response to complete. The handler receives the response
+ * itself, or an exception if the request failed or was cancelled.
+ */
+template<typename CompletionToken>
+auto
+async_response(
+	boost::asio::io_service &service,
+	std::shared_ptr<response> res,
+	CompletionToken &&token
+)
+{
+	return boost::asio::async_initiate<
+		CompletionToken,
+		void(std::exception_ptr, std::shared_ptr<response>)
+	>(
+		[&service, res](auto handler) {
+			/* The futures want copyable callbacks, handlers are move-only */
+			auto h = std::make_shared<decltype(handler)>(std::move(handler));
+			res->completion()->on_done([&service, res, h](uint16_t) {
+				detail::complete_on_executor(service, h, nullptr, res);
+			})->on_fail([&service, res, h](const std::string &err) {
+				detail::complete_on_executor(service, h, std::make_exception_ptr(std::runtime_error(err)), res);
+			})->on_cancel([&service, res, h]() {
+				detail::complete_on_executor(service, h, std::make_exception_ptr(std::runtime_error("request cancelled")), res);
+			});
+		},
+		token
+	);
+}
+
+/**
+ * Pulls a response body a piece at a time as it arrives, rather than
+ * waiting for the whole thing.
+ *
+ * Must be attached before the body starts arriving - immediately after
+ * issuing the request is fine. This installs a {@link response::body_sink},
+ * so the response body itself stays empty.
+ *
+ *     body_reader reader { service, c.GET(req) };
+ *     for(;;) {
+ *         auto chunk = co_await reader.async_next_chunk(boost::asio::use_awaitable);
+ *         if(chunk.empty()) break;
+ *         ...
+ *     }
+ *
+ * Data the caller hasn't asked for yet is queued; there is no backpressure
+ * on the connection.
+ */
+class body_reader {
+public:
+	body_reader(
+		boost::asio::io_service &service,
+		std::shared_ptr<response> res
+	):service_(service),
+	  res_(res),
+	  state_(std::make_shared<state>())
+	{
+		auto st = state_;
+		res_->body_sink([st](const char *data, size_t len) {
+			if(len == 0)
+				return;
+			st->chunks.emplace_back(data, len);
+			st->wake();
+		});
+		res_->completion()->on_done([st](uint16_t) {
+			st->finished = true;
+			st->wake();
+		})->on_fail([st](const std::string &err) {
+			st->finished = true;
+			st->error = std::make_exception_ptr(std::runtime_error(err));
+			st->wake();
+		})->on_cancel([st]() {
+			st->finished = true;
+			st->error = std::make_exception_ptr(std::runtime_error("request cancelled"));
+			st->wake();
+		});
+	}
+
+	const std::shared_ptr<response> &res() const { return res_; }
+
+	/**
+	 * Waits for the next piece of the body. Completes with an empty string
+	 * once the body is finished, or with an exception if the request failed.
+	 * Only one call may be outstanding at a time.
+	 */
+	template<typename CompletionToken>
+	auto
+	async_next_chunk(CompletionToken &&token)
+	{
+		auto &service = service_;
+		auto st = state_;
+		return boost::asio::async_initiate<
+			CompletionToken,
+			void(std::exception_ptr, std::string)
+		>(
+			[&service, st](auto handler) {
+				auto h = std::make_shared<decltype(handler)>(std::move(handler));
+				if(st->waiter)
+					throw std::logic_error("async_next_chunk already pending");
+				st->waiter = [&service, st, h]() {
+					std::string chunk;
+					std::exception_ptr err;
+					if(!st->chunks.empty()) {
+						chunk = std::move(st->chunks.front());
+						st->chunks.pop_front();
+					} else {
+						err = st->error;
+					}
+					detail::complete_on_executor(service, h, err, std::move(chunk));
+				};
+				st->wake();
+			},
+			token
+		);
+	}
+
+private:
+	struct state {
+		/** Data received but not yet handed out */
+		std::deque<std::string> chunks;
+		/** True once the response has completed, one way or another */
+		bool finished = false;
+		/** Set if the response failed */
+		std::exception_ptr error;
+		/** Pending async_next_chunk, if any */
+		std::function<void()> waiter;
+
+		/** Completes the pending call if we have anything to give it */
+		void wake() {
+			if(!waiter || (chunks.empty() && !finished))
+				return;
+			auto w = std::move(waiter);
+			waiter = nullptr;
+			w();
+		}
+	};
+
+	boost::asio::io_service &service_;
+	std::shared_ptr<response> res_;
+	std::shared_ptr<state> state_;
+};
+
+};
+};
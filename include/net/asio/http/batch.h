@@ -0,0 +1,105 @@
+#pragma once
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <cps/future.h>
+
+#include <net/asio/http/response.h>
+
+namespace net {
+namespace http {
+
+class connection_pool;
+
+/**
+ * A group of independent requests submitted together via
+ * {@link client::request_batch}.
+ *
+ * Each request still has its own response, in the same order as the
+ * requests were given, and each of those has the usual completion future.
+ * The batch adds a single completion which resolves once every request
+ * has finished, successfully or otherwise.
+ */
+class batch {
+public:
+	batch(
+		size_t count,
+		size_t max_in_flight
+	):responses_(count),
+	  pools_(count),
+	  max_in_flight_{ max_in_flight == 0 ? count : max_in_flight },
+	  started_{ 0 },
+	  finished_{ 0 },
+	  succeeded_{ 0 },
+	  completion_(cps::future<size_t>::create_shared("batch of " + std::to_string(count)))
+	{
+	}
+
+	batch(const batch &) = delete;
+	batch(batch &&) = delete;
+	virtual ~batch() = default;
+
+	/** One response per request, in submission order */
+	const std::vector<std::shared_ptr<response>> &responses() const { return responses_; }
+	const std::shared_ptr<response> &operator[](size_t idx) const { return responses_[idx]; }
+	size_t size() const { return responses_.size(); }
+
+	/**
+	 * Resolves once all requests have finished, with the number which
+	 * succeeded. Individual failures are available from each response.
+	 */
+	std::shared_ptr<cps::future<size_t>> completion() const { return completion_; }
+
+	size_t succeeded() const {
+		std::lock_guard<std::mutex> guard { mutex_ };
+		return succeeded_;
+	}
+	size_t failed() const {
+		std::lock_guard<std::mutex> guard { mutex_ };
+		return finished_ - succeeded_;
+	}
+
+private:
+	friend class client;
+
+	/**
+	 * Hands out the indices of requests which may start now: up to
+	 * the in-flight limit initially, then one per finished request.
+	 */
+	std::vector<size_t>
+	take(size_t wanted)
+	{
+		std::lock_guard<std::mutex> guard { mutex_ };
+		std::vector<size_t> out;
+		while(out.size() < wanted && started_ < responses_.size())
+			out.push_back(started_++);
+		return out;
+	}
+
+	/** Records the outcome of a request, returning true if that was the last one */
+	bool
+	finish(bool ok)
+	{
+		std::lock_guard<std::mutex> guard { mutex_ };
+		++finished_;
+		if(ok)
+			++succeeded_;
+		return finished_ == responses_.size();
+	}
+
+	std::vector<std::shared_ptr<response>> responses_;
+	/** Pool for each request, resolved up front */
+	std::vector<std::shared_ptr<connection_pool>> pools_;
+	size_t max_in_flight_;
+
+	mutable std::mutex mutex_;
+	/** Requests handed to their pool so far - these start in order */
+	size_t started_;
+	size_t finished_;
+	size_t succeeded_;
+	std::shared_ptr<cps::future<size_t>> completion_;
+};
+
+};
+};
@@ -0,0 +1,266 @@
+#pragma once
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <boost/utility/string_view.hpp>
+
+namespace net {
+namespace http {
+
+/**
+ * Accumulates a message body without ever holding more than a set amount
+ * of it in memory.
+ *
+ * Below the threshold the body is kept as a list of chunks, so growing it
+ * never copies what we already have. Once it goes over, everything moves
+ * to an unlinked temporary file and later data is appended there; the
+ * file disappears when the store is destroyed, even if we crash. Either
+ * way {@link view} gives the whole body as one contiguous range - by
+ * joining the chunks once, or by mapping the file.
+ *
+ * When the final size is known up front, {@link storage} hands out
+ * memory for it to be read into directly, which for a spilled body is a
+ * writable mapping of the file.
+ */
+class body_store {
+public:
+	body_store(
+		size_t threshold,
+		const std::string &directory = default_directory()
+	):threshold_{ threshold },
+	  directory_(directory),
+	  size_{ 0 },
+	  fd_{ -1 },
+	  map_{ nullptr },
+	  map_size_{ 0 }
+	{
+	}
+
+	body_store(const body_store &) = delete;
+	body_store(body_store &&) = delete;
+
+	virtual ~body_store() {
+		clear();
+	}
+
+	/** $TMPDIR if set, /tmp otherwise */
+	static
+	std::string
+	default_directory()
+	{
+		auto dir = std::getenv("TMPDIR");
+		return dir && *dir ? std::string { dir } : std::string { "/tmp" };
+	}
+
+	/** Bytes held, in memory or on disk */
+	size_t size() const { return size_; }
+	bool empty() const { return size_ == 0; }
+	/** True once we've moved to a file */
+	bool spilled() const { return fd_ >= 0; }
+	size_t threshold() const { return threshold_; }
+
+	void
+	append(const char *in, size_t len)
+	{
+		if(len == 0)
+			return;
+		if(!spilled() && size_ + len > threshold_)
+			spill();
+		if(spilled()) {
+			unmap();
+			write_fully(in, len, size_);
+		} else {
+			/* Top up the last chunk if it has room, so small appends don't each get
+			 * one. New chunks grow with the body, so a large one needs few of them.
+			 */
+			if(chunks_.empty() || chunks_.back().capacity() - chunks_.back().size() < len) {
+				chunks_.emplace_back();
+				chunks_.back().reserve(std::max(len, std::min(std::max(size_, min_chunk()), max_chunk())));
+			}
+			chunks_.back().append(in, len);
+		}
+		size_ += len;
+	}
+
+	/**
+	 * Replaces the content with len bytes of uninitialised storage and
+	 * returns it, for the caller to fill.
+	 */
+	char *
+	storage(size_t len)
+	{
+		clear();
+		if(len == 0)
+			return nullptr;
+		if(len <= threshold_) {
+			chunks_.emplace_back(len, '\0');
+			size_ = len;
+			return &chunks_.back()[0];
+		}
+		open_file();
+		if(::ftruncate(fd_, static_cast<off_t>(len)) != 0)
+			throw std::runtime_error(std::string { "Failed to size body file: " } + std::strerror(errno));
+		size_ = len;
+		map(PROT_READ | PROT_WRITE);
+		return static_cast<char *>(map_);
+	}
+
+	/**
+	 * The whole body as a single range. Valid until the next change to
+	 * the store.
+	 */
+	boost::string_view
+	view()
+	{
+		if(size_ == 0)
+			return boost::string_view { };
+		if(spilled()) {
+			if(!map_)
+				map(PROT_READ);
+			return boost::string_view { static_cast<const char *>(map_), size_ };
+		}
+		coalesce();
+		return boost::string_view { chunks_.front() };
+	}
+
+	/**
+	 * Hands over the content as a string, leaving the store empty.
+	 * Costs nothing if everything fits in one chunk, otherwise this is
+	 * a single copy into a string of the right size.
+	 */
+	std::string
+	take()
+	{
+		std::string out;
+		if(!spilled()) {
+			coalesce();
+			if(!chunks_.empty())
+				out = std::move(chunks_.front());
+		} else {
+			auto v = view();
+			out.assign(v.data(), v.size());
+		}
+		clear();
+		return out;
+	}
+
+	void
+	clear()
+	{
+		unmap();
+		if(fd_ >= 0)
+			::close(fd_);
+		fd_ = -1;
+		chunks_.clear();
+		size_ = 0;
+	}
+
+private:
+	/** Bounds on the allocation size for new chunks */
+	static size_t min_chunk() { return 4 * 1024; }
+	static size_t max_chunk() { return 1024 * 1024; }
+
+	/** Joins the chunks so the body is contiguous */
+	void
+	coalesce()
+	{
+		if(chunks_.size() <= 1)
+			return;
+		std::string all;
+		all.reserve(size_);
+		for(const auto &c : chunks_)
+			all += c;
+		chunks_.clear();
+		chunks_.push_back(std::move(all));
+	}
+
+	/** Moves everything we have so far out to a file */
+	void
+	spill()
+	{
+		open_file();
+		size_t offset = 0;
+		for(const auto &c : chunks_) {
+			write_fully(c.data(), c.size(), offset);
+			offset += c.size();
+		}
+		chunks_.clear();
+		chunks_.shrink_to_fit();
+	}
+
+	void
+	open_file()
+	{
+#if defined(O_TMPFILE)
+		/* Never has a name, so there's nothing to clean up */
+		fd_ = ::open(directory_.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+		if(fd_ >= 0)
+			return;
+#endif
+		std::string path = directory_ + "/asio-protocols-body-XXXXXX";
+		fd_ = ::mkstemp(&path[0]);
+		if(fd_ < 0)
+			throw std::runtime_error("Failed to create body file in " + directory_ + ": " + std::strerror(errno));
+		::unlink(path.c_str());
+		::fcntl(fd_, F_SETFD, FD_CLOEXEC);
+	}
+
+	void
+	write_fully(const char *in, size_t len, size_t offset)
+	{
+		while(len > 0) {
+			auto n = ::pwrite(fd_, in, len, static_cast<off_t>(offset));
+			if(n < 0) {
+				if(errno == EINTR)
+					continue;
+				throw std::runtime_error(std::string { "Failed to write body file: " } + std::strerror(errno));
+			}
+			in += n;
+			len -= static_cast<size_t>(n);
+			offset += static_cast<size_t>(n);
+		}
+	}
+
+	void
+	map(int prot)
+	{
+		auto p = ::mmap(nullptr, size_, prot, MAP_SHARED, fd_, 0);
+		if(p == MAP_FAILED)
+			throw std::runtime_error(std::string { "Failed to map body file: " } + std::strerror(errno));
+		::madvise(p, size_, MADV_SEQUENTIAL);
+		map_ = p;
+		map_size_ = size_;
+	}
+
+	void
+	unmap()
+	{
+		if(map_)
+			::munmap(map_, map_size_);
+		map_ = nullptr;
+		map_size_ = 0;
+	}
+
+	size_t threshold_;
+	std::string directory_;
+	/** Content while we're under the threshold */
+	std::vector<std::string> chunks_;
+	size_t size_;
+	/** Backing file once spilled, -1 before that */
+	int fd_;
+	void *map_;
+	size_t map_size_;
+};
+
+};
+};
@@ -0,0 +1,179 @@
+#pragma once
+#include <string>
+#include <cstdint>
+#include <stdexcept>
+
+namespace net {
+namespace http {
+
+/**
+ * Incremental decoder for Transfer-Encoding: chunked.
+ *
+ * Runs directly over whatever is in the receive buffer, and can stop and
+ * resume at any byte boundary. Chunk payload is handed to the caller as
+ * ranges within that buffer, so the only copy is whatever the caller does
+ * with it. Chunk extensions are skipped, trailer lines are handed back
+ * as-is for header parsing.
+ *
+ * Bare LF line endings are accepted in place of CRLF. Trailer lines are
+ * capped at max_trailer_line bytes and the whole trailer section at
+ * max_trailers, so a server can't make us buffer without bound.
+ */
+class chunked_decoder {
+public:
+	chunked_decoder(
+		size_t max_trailer_line = 8192,
+		size_t max_trailers = 64 * 1024
+	):max_trailer_line_{ max_trailer_line },
+	  max_trailers_{ max_trailers }
+	{
+		reset();
+	}
+
+	/** Prepare for a new response body */
+	void reset() {
+		state_ = state::size;
+		remaining_ = 0;
+		have_digits_ = false;
+		trailer_.clear();
+		trailer_total_ = 0;
+	}
+
+	/** True once we've seen the last chunk and any trailers */
+	bool done() const { return state_ == state::done; }
+
+	/**
+	 * Decodes as much of the given data as possible.
+	 *
+	 * on_data is called as on_data(const char *, size_t) for each run of payload,
+	 * on_trailer as on_trailer(const std::string &) for each trailer line.
+	 *
+	 * Returns the number of bytes consumed - this will be the full length unless
+	 * we reached the end of the body, in which case anything after that belongs
+	 * to the next response. Throws std::runtime_error on invalid input.
+	 */
+	template<typename Data, typename Trailer>
+	size_t
+	parse(
+		const char *in,
+		size_t len,
+		Data &&on_data,
+		Trailer &&on_trailer
+	)
+	{
+		const char *p = in;
+		const char *end = in + len;
+		while(p != end && state_ != state::done) {
+			switch(state_) {
+			case state::size: {
+				auto ch = *p;
+				int v = (ch >= '0' && ch <= '9') ? ch - '0'
+					: (ch >= 'a' && ch <= 'f') ? ch - 'a' + 10
+					: (ch >= 'A' && ch <= 'F') ? ch - 'A' + 10
+					: -1;
+				if(v >= 0) {
+					if(remaining_ > (SIZE_MAX >> 4))
+						throw std::runtime_error("chunk size too large");
+					remaining_ = (remaining_ << 4) | static_cast<size_t>(v);
+					have_digits_ = true;
+					++p;
+				} else {
+					if(!have_digits_)
+						throw std::runtime_error("invalid chunk size");
+					state_ = state::extension;
+				}
+				break;
+			}
+			case state::extension:
+				/* Skip any ;name=value extensions up to the end of the line */
+				while(p != end && *p != '\x0A')
+					++p;
+				if(p != end) {
+					++p;
+					state_ = remaining_ > 0 ? state::data : state::trailer;
+				}
+				break;
+			case state::data: {
+				size_t available = static_cast<size_t>(end - p);
+				size_t n = available < remaining_ ? available : remaining_;
+				on_data(p, n);
+				p += n;
+				remaining_ -= n;
+				if(remaining_ == 0)
+					state_ = state::data_end;
+				break;
+			}
+			case state::data_end:
+				if(*p == '\x0D') {
+					++p;
+				} else if(*p == '\x0A') {
+					++p;
+					have_digits_ = false;
+					state_ = state::size;
+				} else {
+					throw std::runtime_error("missing CRLF after chunk data");
+				}
+				break;
+			case state::trailer: {
+				const char *start = p;
+				while(p != end && *p != '\x0A')
+					++p;
+				auto n = static_cast<size_t>(p - start);
+				if(trailer_.size() + n > max_trailer_line_)
+					throw std::runtime_error("trailer line too long");
+				trailer_total_ += n + (p != end ? 1 : 0);
+				if(trailer_total_ > max_trailers_)
+					throw std::runtime_error("trailers too large");
+				trailer_.append(start, n);
+				if(p != end) {
+					++p;
+					if(!trailer_.empty() && trailer_.back() == '\x0D')
+						trailer_.pop_back();
+					if(trailer_.empty()) {
+						state_ = state::done;
+					} else {
+						on_trailer(trailer_);
+						trailer_.clear();
+					}
+				}
+				break;
+			}
+			case state::done:
+				break;
+			}
+		}
+		return static_cast<size_t>(p - in);
+	}
+
+private:
+	enum class state {
+		/** Hex digits of the chunk size */
+		size,
+		/** Extensions and line ending after the chunk size */
+		extension,
+		/** Chunk payload */
+		data,
+		/** CRLF after chunk payload */
+		data_end,
+		/** Trailer lines after the last chunk */
+		trailer,
+		/** Finished */
+		done
+	};
+
+	size_t max_trailer_line_;
+	size_t max_trailers_;
+	state state_;
+	/** Bytes remaining in the current chunk, or chunk size while parsing it */
+	size_t remaining_;
+	/** Whether we've seen at least one digit of the chunk size */
+	bool have_digits_;
+	/** Partial trailer line */
+	std::string trailer_;
+	/** Trailer bytes seen so far, including line endings */
+	size_t trailer_total_;
+};
+
+};
+};
+
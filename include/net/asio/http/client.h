@@ -1,13 +1,18 @@
 #pragma once
 #include <string>
+#include <vector>
+#include <algorithm>
 #include <memory>
 #include <mutex>
 #include <unordered_map>
 #include <functional>
 #include <boost/asio.hpp>
+#include <boost/algorithm/string/predicate.hpp>
 
 #include <net/asio/http/response.h>
+#include <net/asio/http/batch.h>
 #include <net/asio/http/connection_pool.h>
+#include <net/asio/http/websocket.h>
 
 namespace net {
 namespace http {
@@ -41,7 +46,8 @@ public:
 	 :service_(service),
 	  limit_connections_{ true },
 	  max_connections_{ 8 },
-	  stall_timeout_{ stall_timeout }
+	  stall_timeout_{ stall_timeout },
+	  spill_threshold_{ 0 }
 	{
 	}
 
@@ -73,6 +79,10 @@ public:
 				endpoint->next()->on_done([res](std::shared_ptr<connection> conn) {
 					// std::cout << "Have endpoint";
 					conn->write_request(res);
+				})->on_fail([res](const std::string &err) {
+					auto f = res->current_completion();
+					if(!f->is_ready())
+						f->fail(err);
 				});
 			} else {
 				if(f.is_done())
@@ -97,16 +107,71 @@ public:
 			std::move(req),
 			stall_timeout_
 		);
+		if(spill_threshold_ > 0)
+			res->spill_threshold(spill_threshold_);
 
 		res->current_completion()->on_ready(completion_handler(endpoint, res, 0));
 
 		endpoint->next()->on_done([res](std::shared_ptr<connection> conn) {
 			// std::cout << "Have endpoint";
 			conn->write_request(res);
+		})->on_fail([res](const std::string &err) {
+			auto f = res->current_completion();
+			if(!f->is_ready())
+				f->fail(err);
 		});
 		return res;
 	}
 
+	/**
+	 * Submits a group of independent requests. Each request needs a valid method.
+	 *
+	 * Requests are grouped by endpoint, so the client lock is taken once for
+	 * the whole batch and each pool's lock once per group rather than once
+	 * per request. If max_in_flight is nonzero, at most that many requests
+	 * will be outstanding at a time, with the rest started in order as
+	 * earlier ones finish.
+	 */
+	std::shared_ptr<net::http::batch>
+	request_batch(
+		std::vector<net::http::request> &&reqs,
+		size_t max_in_flight = 0
+	)
+	{
+		auto b = std::make_shared<net::http::batch>(reqs.size(), max_in_flight);
+		if(reqs.empty()) {
+			b->completion_->done(0);
+			return b;
+		}
+
+		{
+			std::lock_guard<std::mutex> guard { mutex_ };
+			for(size_t i = 0; i < reqs.size(); ++i)
+				b->pools_[i] = endpoint_for_locked(reqs[i]);
+		}
+
+		auto self = this;
+		for(size_t i = 0; i < reqs.size(); ++i) {
+			auto res = std::make_shared<net::http::response>(
+				std::move(reqs[i]),
+				stall_timeout_
+			);
+			if(spill_threshold_ > 0)
+				res->spill_threshold(spill_threshold_);
+			b->responses_[i] = res;
+			res->current_completion()->on_ready(completion_handler(b->pools_[i], res, 0));
+			res->completion()->on_ready([self, b](const cps::future<uint16_t> &f) {
+				if(b->finish(f.is_done())) {
+					b->completion_->done(b->succeeded());
+				} else {
+					self->start_batch(b, b->take(1));
+				}
+			});
+		}
+		start_batch(b, b->take(b->max_in_flight_));
+		return b;
+	}
+
 	/**
 	 * GET request.
 	 */
@@ -167,33 +232,69 @@ public:
 		return request(std::move(req));
 	}
 
+	/**
+	 * Upgrades to a WebSocket session. The request is sent as a GET with the
+	 * relevant Upgrade headers added; if deflate is true, we offer
+	 * permessage-deflate and use it if the server agrees.
+	 */
+	std::shared_ptr<
+		cps::future<
+			std::shared_ptr<websocket>
+		>
+	>
+	connect_websocket(net::http::request &&req, bool deflate = true)
+	{
+		auto f = cps::future<std::shared_ptr<websocket>>::create_shared("websocket for " + req.uri().string());
+		auto key = websocket::generate_key();
+		req.method("GET");
+		req.set_header("Upgrade", "websocket");
+		req.set_header("Connection", "Upgrade");
+		req.set_header("Sec-WebSocket-Key", key);
+		req.set_header("Sec-WebSocket-Version", "13");
+		if(deflate)
+			req.set_header("Sec-WebSocket-Extensions", websocket::deflate_options::offer());
+
+		auto res = request(std::move(req));
+		res->completion()->on_done([res, key, deflate, f](uint16_t code) {
+			auto conn = res->upgraded_connection();
+			try {
+				if(code != 101 || !conn)
+					throw std::runtime_error("Expected 101 Switching Protocols, had " + std::to_string(code));
+				if(!res->have_header("Upgrade") || !boost::algorithm::iequals(res->header_value("Upgrade"), "websocket"))
+					throw std::runtime_error("Expected Upgrade: websocket");
+				if(!res->have_header("Sec-WebSocket-Accept") || res->header_value("Sec-WebSocket-Accept") != websocket::accept_for(key))
+					throw std::runtime_error("Invalid Sec-WebSocket-Accept");
+				/* An extension we didn't offer means we can't trust the framing (RFC6455 9.1) */
+				websocket::deflate_options opt;
+				if(res->have_header("Sec-WebSocket-Extensions")) {
+					if(!deflate)
+						throw std::runtime_error("Server accepted an extension we didn't offer: " + res->header_value("Sec-WebSocket-Extensions"));
+					opt = websocket::deflate_options::parse(res->header_value("Sec-WebSocket-Extensions"));
+				}
+				auto ws = std::make_shared<websocket>(conn, opt);
+				f->done(ws);
+				ws->start();
+			} catch(const std::exception &e) {
+				if(conn)
+					conn->close();
+				f->fail(e.what());
+			}
+		})->on_fail([f](const std::string &err) {
+			f->fail(err);
+		});
+		return f;
+	}
+
 	/**
 	 * Returns the connection pool for the given request.
+	 * Existing pools are found from the request URI directly,
+	 * so the common case does not allocate.
 	 */
 	std::shared_ptr<connection_pool>
 	endpoint_for(const net::http::request &req)
 	{
 		std::lock_guard<std::mutex> guard { mutex_ };
-		auto details = details_for(req);
-		if(endpoints_.count(details) == 0) {
-			// std::cout << "Create new pool\n";
-			auto pool = std::make_shared<connection_pool>(
-				service_,
-				details
-			);
-			pool->max_connections(max_connections_);
-			pool->limit_connections(limit_connections_);
-			endpoints_.emplace(
-				std::make_pair(
-					details,
-					pool
-				)
-			);
-			return pool;
-		} else {
-			// std::cout << "Use existing pool\n";
-		}
-		return endpoints_.at(details);
+		return endpoint_for_locked(req);
 	}
 
 	/**
@@ -226,6 +327,46 @@ public:
 		}
 	}
 
+	/**
+	 * Staggering and per-attempt timeout for racing connections
+	 * across an endpoint's addresses.
+	 */
+	virtual void
+	connect_options(const net::asio::happy_eyeballs::options &opt)
+	{
+		std::lock_guard<std::mutex> guard { mutex_ };
+		connect_options_ = opt;
+		for(auto &entry : endpoints_) {
+			entry.second->connect_options(opt);
+		}
+	}
+
+	/**
+	 * Response bodies larger than this many bytes go to a temporary file
+	 * rather than memory - see {@link response::spill_threshold}. Zero,
+	 * the default, keeps everything in memory.
+	 */
+	virtual void
+	spill_threshold(size_t bytes)
+	{
+		std::lock_guard<std::mutex> guard { mutex_ };
+		spill_threshold_ = bytes;
+	}
+
+	/**
+	 * Options for each new TCP socket. Takes effect for connections
+	 * opened after this call.
+	 */
+	virtual void
+	socket_options(const net::asio::socket_options &opt)
+	{
+		std::lock_guard<std::mutex> guard { mutex_ };
+		socket_options_ = opt;
+		for(auto &entry : endpoints_) {
+			entry.second->socket_options(opt);
+		}
+	}
+
 	virtual void
 	stall_timeout(float sec)
 	{
@@ -240,20 +381,94 @@ public:
 	> on_completion;
 
 private:
+	/** As {@link endpoint_for}, with the mutex already held */
+	std::shared_ptr<connection_pool>
+	endpoint_for_locked(const net::http::request &req)
+	{
+		const auto &u = req.uri();
+		auto h = details::hash_for(u);
+		auto range = endpoints_.equal_range(h);
+		for(auto it = range.first; it != range.second; ++it) {
+			if(it->second->endpoint().matches(u)) {
+				// std::cout << "Use existing pool\n";
+				return it->second;
+			}
+		}
+
+		// std::cout << "Create new pool\n";
+		auto pool = std::make_shared<connection_pool>(
+			service_,
+			details_for(req)
+		);
+		pool->max_connections(max_connections_);
+		pool->limit_connections(limit_connections_);
+		pool->connect_options(connect_options_);
+		pool->socket_options(socket_options_);
+		endpoints_.emplace(
+			h,
+			pool
+		);
+		return pool;
+	}
+
+	/**
+	 * Hands the given batch entries to their pools, taking each pool's
+	 * lock once for all of the entries which share it.
+	 */
+	void
+	start_batch(
+		const std::shared_ptr<net::http::batch> &b,
+		const std::vector<size_t> &items
+	)
+	{
+		std::vector<
+			std::pair<
+				connection_pool *,
+				std::vector<size_t>
+			>
+		> groups;
+		for(auto idx : items) {
+			auto pool = b->pools_[idx].get();
+			auto it = std::find_if(
+				begin(groups),
+				end(groups),
+				[pool](const std::pair<connection_pool *, std::vector<size_t>> &g) { return g.first == pool; }
+			);
+			if(it == end(groups)) {
+				groups.emplace_back(pool, std::vector<size_t> { idx });
+			} else {
+				it->second.push_back(idx);
+			}
+		}
+		for(auto &g : groups) {
+			auto conns = g.first->next(g.second.size());
+			for(size_t i = 0; i < conns.size(); ++i) {
+				auto res = b->responses_[g.second[i]];
+				conns[i]->on_done([res](std::shared_ptr<connection> conn) {
+					conn->write_request(res);
+				})->on_fail([res](const std::string &err) {
+					auto f = res->current_completion();
+					if(!f->is_ready())
+						f->fail(err);
+				});
+			}
+		}
+	}
+
 	boost::asio::io_service &service_;
 	std::mutex mutex_;
 	bool limit_connections_;
 	size_t max_connections_;
-	/** Represents all connection pools */
-	std::unordered_map<
-		// std::reference_wrapper<
-			details, // const
-		// >,
-		std::shared_ptr<connection_pool>,
-		details::hash,
-		details::equal
+	net::asio::happy_eyeballs::options connect_options_;
+	net::asio::socket_options socket_options_;
+	/** Represents all connection pools, keyed by {@link details::hash_value} */
+	std::unordered_multimap<
+		std::size_t,
+		std::shared_ptr<connection_pool>
 	> endpoints_;
 	float stall_timeout_;
+	/** Bodies bigger than this go to disk, 0 for never */
+	size_t spill_threshold_;
 };
 
 };
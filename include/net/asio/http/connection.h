@@ -1,5 +1,10 @@
 #pragma once
+/* Boost's own config sets this if an earlier header has already pulled in Asio */
+#if !defined(BOOST_ASIO_HAS_STD_CHRONO)
 #define BOOST_ASIO_HAS_STD_CHRONO
+#endif
+#include <algorithm>
+#include <chrono>
 #include <memory>
 #include <string>
 #include <vector>
@@ -9,6 +14,12 @@
 #include <boost/asio/read_until.hpp>
 #include <boost/asio/high_resolution_timer.hpp>
 
+#include <net/asio/io_backend.h>
+#include <net/asio/happy_eyeballs.h>
+#include <net/asio/socket_options.h>
+#include <net/asio/http/file_body.h>
+#include <net/asio/http/chunked_decoder.h>
+
 namespace net {
 namespace http {
 
@@ -18,7 +29,9 @@ class connection : virtual public std::enable_shared_from_this<connection> {
 public:
 	enum class transfer {
 		chunked = 0,
-		length = 1
+		length = 1,
+		/** No framing, the body runs until the server closes the connection */
+		until_close = 2
 	};
 	connection(
 		boost::asio::io_service &service,
@@ -32,8 +45,12 @@ public:
 	  closed_{ false },
 	  valid_{ true },
 	  already_active_{ false },
+	  upgraded_{ false },
+	  at_eof_{ false },
 	  in_(std::make_shared<boost::asio::streambuf>()),
-	  expected_bytes_{ 0 }
+	  expected_bytes_{ 0 },
+	  balanced_{ false },
+	  request_outstanding_{ false }
 	{
 	}
 
@@ -41,56 +58,67 @@ public:
 	connection(const connection &src) = delete;
 	connection(connection &&src) = delete;
 
+	/**
+	 * Opens the connection, calling code once it's ready for requests,
+	 * or fail with the reason if we couldn't connect.
+	 */
 	void request(
-		std::function<void()> code
+		std::function<void()> code,
+		std::function<void(const std::string &)> fail = nullptr
 	)
 	{
-		using boost::asio::ip::tcp;
 		if(already_active_) {
 			// std::cerr << "Request called but we think we are currently active\n";
 		}
 		already_active_ = true;
 		auto self = shared_from_this();
-		auto resolver = std::make_shared<tcp::resolver>(service_);
-		auto query = std::make_shared<tcp::resolver::query>(
-			hostname_,
-			std::to_string(port_)
-		);
-		// std::cout << "resolving " << hostname_ << ":" << std::to_string(port_) << "\n";
-		resolver->async_resolve(
-			*query,
-			[self, query, resolver, code](
-				const boost::system::error_code &ec,
-				const tcp::resolver::iterator ei
-			) {
-				if(ec) {
-					// std::cerr << "Resolve failed: " << ec.message() << "\n";
-					self->close();
-				} else {
-					// std::cout << "Connecting\n";
-					self->connect(ei)->then([self](bool) {
-						return self->post_connect();
-					})->on_done([code](bool) {
-						code();
-					});
-				}
-			}
-		);
+		open()->then([self](bool) {
+			return self->post_connect();
+		})->on_done([code](bool) {
+			code();
+		})->on_fail([fail](const std::string &err) {
+			if(fail)
+				fail(err);
+		});
 	}
 
 	virtual ~connection() {
 		// std::cerr << "~connection " << (void *)this << "\n";
 	}
 
+	/**
+	 * Establishes the underlying transport. The default asks the pool's
+	 * {@link address_balancer} which of the resolved addresses to use,
+	 * races that against the other healthy addresses as per RFC 8305,
+	 * and hands the winner to {@link adopt}. The pool's socket options
+	 * are set on each socket before it connects. Transports which don't go
+	 * through the resolver override this.
+	 */
 	virtual
 	std::shared_ptr<
 		cps::future<
 			bool
 		>
 	>
-	connect(
-		const boost::asio::ip::tcp::resolver::iterator &ei
-	) = 0;
+	open();
+
+	/**
+	 * Takes over a socket which has already connected to one of the
+	 * endpoint's addresses. Only meaningful for transports which use
+	 * the default {@link open}.
+	 */
+	virtual
+	std::shared_ptr<
+		cps::future<
+			bool
+		>
+	>
+	adopt(
+		std::shared_ptr<boost::asio::ip::tcp::socket>
+	)
+	{
+		return cps::future<bool>::create_shared("adopt")->fail("transport does not connect via the resolver");
+	}
 
 	/**
 	 * Attempts to write data to the underlying connection.
@@ -103,26 +131,46 @@ public:
 	>
 	write(std::shared_ptr<std::vector<char>> data) = 0;
 
+	/**
+	 * Writes the full content of a file-backed body to the underlying connection.
+	 */
+	virtual
+	std::shared_ptr<
+		cps::future<
+			size_t
+		>
+	>
+	write_file(std::shared_ptr<file_body> body) = 0;
+
 	void
 	write_request(std::shared_ptr<net::http::response> res)
 	{
 		auto self = shared_from_this();
-		auto s = res->request().bytes();
+		auto body = res->request().body_file();
+		auto s = body ? res->request().head_bytes() : res->request().bytes();
 		auto out = std::make_shared<std::vector<char>>(
 			s.cbegin(), s.cend()
 		);
 		res_.swap(res);
+		res_->active_connection(self);
+		request_started();
 		self->extend_timer();
 		auto expected = out->size();
-		write(out)->on_done([self, expected](const size_t) {
-			self->extend_timer();
-			// std::cout << "wrote " << bytes << " bytes, expected to write " << expected << " bytes\n";
-		})->on_fail([self](const std::string &err) {
+		auto fail = [self](const std::string &err) {
 			// std::cerr << "Error writing: " << err << "\n";
 			auto f = self->res_->current_completion();
 			if(f->is_ready()) return;
 			f->fail(err);
-		});
+		};
+		write(out)->on_done([self, expected, body, fail](const size_t) {
+			self->extend_timer();
+			// std::cout << "wrote " << bytes << " bytes, expected to write " << expected << " bytes\n";
+			if(body) {
+				self->write_file(body)->on_done([self](const size_t) {
+					self->extend_timer();
+				})->on_fail(fail);
+			}
+		})->on_fail(fail);
 		/**
 		 * Immediately start the response handler: it's quite possible that we have an invalid
 		 * request so the server could return a 400 (or any other status) before we've finished
@@ -147,6 +195,32 @@ public:
 	>
 	read(size_t wanted) = 0;
 
+	/**
+	 * Reads exactly the given number of bytes into caller-provided storage.
+	 * Anything already in the input buffer is used first, the remainder is
+	 * read from the connection directly into the target.
+	 */
+	virtual
+	std::shared_ptr<
+		cps::future<
+			size_t
+		>
+	>
+	read_into(char *data, size_t wanted) = 0;
+
+	/**
+	 * Reads whatever is available from the connection into the
+	 * input buffer, waiting for at least one byte. Implementations
+	 * set {@link at_eof_} if that failed because the peer closed.
+	 */
+	virtual
+	std::shared_ptr<
+		cps::future<
+			size_t
+		>
+	>
+	fill() = 0;
+
 	void handle_response()
 	{
 		auto self = shared_from_this();
@@ -154,6 +228,7 @@ public:
 			// std::cout << "Initial line: " << line << "\n";
 			if(self->res_) {
 				self->extend_timer();
+				self->request_finished();
 				self->res_->parse_initial_line(line);
 				self->read_next_header();
 			} else {
@@ -177,32 +252,41 @@ public:
 				self->res_->parse_header_line(line);
 				// std::cout << "header count now " << self->res_->header_count() << "\n";
 				self->read_next_header();
+			} else if(self->res_->status_code() == 101) {
+				if(self->end_headers())
+					self->upgrade();
+			} else if(!self->res_->may_have_body()) {
+				/* Whatever the headers say, there's nothing more to read */
+				if(self->end_headers())
+					self->finish_response();
 			} else {
 				try {
 					self->expected_bytes_ = static_cast<size_t>(
-						std::stoi(
+						std::stoull(
 							self->res_->header_value("Content-Length")
 						)
 					);
 					self->transfer_mode_ = transfer::length;
 					// std::cout << "Content length should be " << std::to_string(self->expected_bytes_) << " bytes\n";
-					self->res_->on_header_end();
-					self->read_next_body_chunk();
+					if(self->end_headers())
+						self->read_next_body_chunk();
 				} catch(const std::runtime_error &ex) {
 					try {
 						/* Might not have Content-Length, try TE instead */
-						if(std::string::npos != self->res_->header_value("Transfer-Encoding").find("chunked")) {
-							self->res_->on_header_end();
+						if(self->res_->have_header("Transfer-Encoding") && std::string::npos != self->res_->header_value("Transfer-Encoding").find("chunked")) {
+							if(!self->end_headers())
+								return;
 							self->transfer_mode_ = transfer::chunked;
 							self->expected_bytes_ = 0;
+							self->chunked_.reset();
 							self->read_next_body_chunk();
 						} else {
-							self->close();
-							if(self->res_) {
-								auto f = self->res_->current_completion();
-								if(!f->is_ready())
-									f->fail("no content-length or TE");
-							}
+							/* Neither, so the body is delimited by the connection closing */
+							if(!self->end_headers())
+								return;
+							self->transfer_mode_ = transfer::until_close;
+							self->expected_bytes_ = 0;
+							self->read_next_body_chunk();
 						}
 					} catch(const std::runtime_error &ex) {
 						self->close();
@@ -224,44 +308,43 @@ public:
 		});
 	}
 
+	/**
+	 * Tells the response its headers are done. Handlers may abandon the
+	 * response, in which case we return false and leave it alone.
+	 */
+	bool end_headers() {
+		auto r = res_;
+		r->on_header_end();
+		return res_ == r;
+	}
+
+	/** Largest Content-Length body we'll allocate in memory before it arrives */
+	static size_t max_presized_body() { return 1024 * 1024; }
+
 	void read_next_body_chunk() {
 		auto self = shared_from_this();
 		if(transfer_mode_ == transfer::chunked) {
-			read_delimited("\x0D\x0A")->on_done([self](const std::string &line) {
-				self->extend_timer();
-				auto chunk_size = static_cast<size_t>(
-					std::stoi(
-						line,
-						0,
-						16
-					)
-				);
-				if(chunk_size > 0) {
-					self->expected_bytes_ = chunk_size;
-					self->read(chunk_size + 2)->on_done([self](const std::string &data) {
-						self->res_->append_body(data.substr(0, data.size() - 2));
-						self->extend_timer();
-						self->read_next_body_chunk();
-					})->on_fail([self](const std::string &err) {
-						// std::cerr << "Error reading body data: " << err << "\n";
-						if(self->res_) {
-							auto f = self->res_->current_completion();
-							if(!f->is_ready())
-								f->fail(err);
-						}
-					});
-				} else {
-					self->read_delimited("\x0D\x0A")->on_done([self](const std::string &line) {
-						self->extend_timer();
-						self->extract_next_body_chunk("");
-					});
-				}
-			});
+			decode_chunked();
+		} else if(transfer_mode_ == transfer::until_close) {
+			read_until_close();
+		} else if(res_->have_body_sink() || (expected_bytes_ > max_presized_body() && !res_->has_body_storage(expected_bytes_))) {
+			/* Content-Length is the server's word, so a large body grows as it arrives */
+			stream_length_body();
 		} else {
-			// std::cout << "Streambuf already has " << in_->size() << " bytes, expected " << expected_bytes_ << "\n";
-			read(expected_bytes_)->on_done([self](const std::string &data) {
+			/* Read straight into the response body, which we size up front */
+			char *storage = nullptr;
+			try {
+				storage = res_->body_storage(expected_bytes_);
+			} catch(const std::exception &ex) {
+				auto r = res_;
+				close();
+				if(r && !r->current_completion()->is_ready())
+					r->current_completion()->fail(ex.what());
+				return;
+			}
+			read_into(storage, expected_bytes_)->on_done([self](size_t) {
 				self->extend_timer();
-				self->extract_next_body_chunk(data);
+				self->finish_response();
 			})->on_fail([self](const std::string &err) {
 				// std::cerr << "Error reading body data: " << err << "\n";
 				if(self->res_) {
@@ -273,18 +356,148 @@ public:
 		}
 	}
 
-	void extract_next_body_chunk(const std::string &data) {
-		if(expected_bytes_ != data.size()) {
-			// std::cerr << "Size mismatch: expected " << expected_bytes_ << ", actual content was " << data.size() << " bytes\n";
+	/**
+	 * Passes a Content-Length body to the response's sink, or appends it
+	 * to the body, as it arrives.
+	 */
+	void stream_length_body() {
+		auto self = shared_from_this();
+		auto b = in_->data();
+		auto n = std::min(boost::asio::buffer_size(b), expected_bytes_);
+		if(n > 0) {
+			if(!deliver_body(boost::asio::buffer_cast<const char *>(b), n))
+				return;
+			in_->consume(n);
+			expected_bytes_ -= n;
+		}
+		if(expected_bytes_ == 0) {
+			finish_response();
+			return;
 		}
-		// std::cout << "all good - body is " << data.size() << " bytes\n";
+		fill()->on_done([self](size_t) {
+			self->extend_timer();
+			self->stream_length_body();
+		})->on_fail([self](const std::string &err) {
+			if(self->res_) {
+				auto f = self->res_->current_completion();
+				if(!f->is_ready())
+					f->fail(err);
+			}
+		});
+	}
+
+	/**
+	 * Reads a body with no length or chunking, which ends when the server
+	 * closes the connection. The connection can't be reused afterwards.
+	 */
+	void read_until_close() {
+		auto self = shared_from_this();
+		auto b = in_->data();
+		auto n = boost::asio::buffer_size(b);
+		if(n > 0) {
+			if(!deliver_body(boost::asio::buffer_cast<const char *>(b), n))
+				return;
+			in_->consume(n);
+		}
+		fill()->on_done([self](size_t) {
+			self->extend_timer();
+			self->read_until_close();
+		})->on_fail([self](const std::string &err) {
+			/* fill() has already closed us. Only a clean close ends the
+			 * body - a reset or a truncated TLS stream means we lost some.
+			 */
+			auto r = self->res_;
+			self->already_active_ = false;
+			self->res_.reset();
+			if(!r || r->current_completion()->is_ready())
+				return;
+			if(self->at_eof_)
+				r->current_completion()->done(r->status_code());
+			else
+				r->current_completion()->fail(err);
+		});
+	}
+
+	/**
+	 * Hands body data to the response. A body sink may throw to abandon the
+	 * response, in which case we close the connection, fail the response
+	 * and return false. We also return false if the sink abandoned it.
+	 */
+	bool deliver_body(const char *data, size_t len) {
+		auto r = res_;
+		try {
+			r->append_body(data, len);
+			return res_ == r;
+		} catch(const std::exception &ex) {
+			close();
+			if(r && !r->current_completion()->is_ready())
+				r->current_completion()->fail(ex.what());
+			return false;
+		}
+	}
+
+	/**
+	 * Runs the chunked decoder over whatever we have buffered, reading
+	 * more from the connection until we reach the end of the body.
+	 */
+	void decode_chunked() {
+		auto self = shared_from_this();
+		try {
+			auto b = in_->data();
+			auto used = chunked_.parse(
+				boost::asio::buffer_cast<const char *>(b),
+				boost::asio::buffer_size(b),
+				[self](const char *data, size_t len) {
+					auto r = self->res_;
+					r->append_body(data, len);
+					if(self->res_ != r)
+						throw std::runtime_error("Response abandoned");
+				},
+				[self](const std::string &line) {
+					self->res_->parse_header_line(line);
+				}
+			);
+			in_->consume(used);
+		} catch(const std::exception &ex) {
+			/* Either a framing error, or the body sink abandoning the response */
+			close();
+			if(res_) {
+				auto f = res_->current_completion();
+				if(!f->is_ready())
+					f->fail(ex.what());
+			}
+			return;
+		}
+
+		if(chunked_.done()) {
+			extend_timer();
+			finish_response();
+			return;
+		}
+
+		fill()->on_done([self](size_t) {
+			self->extend_timer();
+			self->decode_chunked();
+		})->on_fail([self](const std::string &err) {
+			// std::cerr << "Error reading body data: " << err << "\n";
+			if(self->res_) {
+				auto f = self->res_->current_completion();
+				if(!f->is_ready())
+					f->fail(err);
+			}
+		});
+	}
+
+	/**
+	 * Called once we have the full body: hands the connection back to the
+	 * pool (or closes it) and marks the response as complete.
+	 */
+	void finish_response() {
 		auto self = shared_from_this();
-		if(transfer_mode_ == transfer::length)
-			res_->body(data);
 		already_active_ = false;
 		auto r = res_;
 		res_.reset();
-		if(r->have_header("Connection") && r->header_value("Connection") == "close") {
+		if((r->have_header("Connection") && r->header_value("Connection") == "close") || address_ejected()) {
 			if(!r->current_completion()->is_ready())
 				r->current_completion()->done(r->status_code());
 			close();
@@ -298,6 +511,50 @@ public:
 		}
 	}
 
+	/**
+	 * The server has switched protocols, so this connection no longer speaks
+	 * HTTP. We take it out of the pool and hand it to the response for
+	 * whoever asked for the upgrade. From here on we don't touch the pool,
+	 * which may well go away before we do.
+	 */
+	void upgrade() {
+		auto self = shared_from_this();
+		cancel_timer();
+		remove();
+		upgraded_ = true;
+		already_active_ = false;
+		auto r = res_;
+		res_.reset();
+		r->upgraded_connection(self);
+		if(!r->current_completion()->is_ready())
+			r->current_completion()->done(r->status_code());
+	}
+
+	bool is_upgraded() const { return upgraded_; }
+
+	/**
+	 * Gives up on the given response if we're still reading it: the
+	 * connection is closed, since we can't tell where the rest of the
+	 * response would end, and the response fails. Does nothing once
+	 * we've moved on to another response.
+	 */
+	void abandon(const net::http::response &r) {
+		if(res_.get() != &r)
+			return;
+		auto held = res_;
+		already_active_ = false;
+		res_.reset();
+		close();
+		if(!held->current_completion()->is_ready())
+			held->current_completion()->fail("Response abandoned");
+	}
+
+	/**
+	 * Input buffer. Anything the server sent after the response headers will be
+	 * waiting here, which matters once the connection has been upgraded.
+	 */
+	std::shared_ptr<boost::asio::streambuf> input_buffer() { return in_; }
+
 	virtual std::shared_ptr<cps::future<bool>> post_connect() {
 		auto f = cps::future<bool>::create_shared("http post-connect");
 		extend_timer();
@@ -318,6 +575,9 @@ public:
 	void
 	extend_timer()
 	{
+		/* Upgraded connections manage their own lifetime */
+		if(upgraded_)
+			return;
 		auto self = shared_from_this();
 		auto target = std::chrono::milliseconds(
 			static_cast<long>((res_ ? res_->stall_timeout() : 5.0f) * 1000.0f)
@@ -357,6 +617,11 @@ public:
 
 	bool is_valid() const { return valid_ && !closed_; }
 
+	/** True if we were connected through the pool's address balancer */
+	bool is_balanced() const { return balanced_; }
+	/** The address we connected to, if {@link is_balanced} */
+	const boost::asio::ip::tcp::endpoint &remote_endpoint() const { return endpoint_; }
+
 	virtual bool already_closing() {
 		// std::cerr << "close() for " << (void *)this << " - " << std::boolalpha << closed_ << "\n";
 		valid_ = false;
@@ -382,6 +647,10 @@ protected:
 	bool valid_;
 	/** Flag indicating that we are already doing something */
 	bool already_active_;
+	/** Flag indicating that we've switched away from HTTP */
+	bool upgraded_;
+	/** Set when a read failed because the peer closed the connection cleanly */
+	bool at_eof_;
 	/** Input buffer */
 	std::shared_ptr<boost::asio::streambuf> in_;
 	/** The response we're currently processing */
@@ -392,6 +661,22 @@ protected:
 	transfer transfer_mode_;
 	/** Bytes we're expecting to read */
 	size_t expected_bytes_;
+	/** Decoder state for chunked responses */
+	chunked_decoder chunked_;
+	/** Address we picked from the balancer */
+	boost::asio::ip::tcp::endpoint endpoint_;
+	/** True once we've connected to endpoint_ */
+	bool balanced_;
+	/** True while the balancer is counting a request against us */
+	bool request_outstanding_;
+	/** When the current request was sent */
+	std::chrono::steady_clock::time_point request_start_;
+
+private:
+	/* Latency and failure reporting for the address balancer */
+	void request_started();
+	void request_finished();
+	bool address_ejected();
 };
 
 };
@@ -402,11 +687,110 @@ protected:
 namespace net {
 namespace http {
 
+inline
+std::shared_ptr<
+	cps::future<
+		bool
+	>
+>
+connection::open()
+{
+	auto f = cps::future<bool>::create_shared("open " + hostname_ + ":" + std::to_string(port_));
+	auto self = shared_from_this();
+	auto balancer = pool().balancer();
+	auto opt = pool().connect_options();
+	auto sockopt = pool().socket_options();
+	auto &service = service_;
+	balancer->pick()->on_done([self, balancer, opt, sockopt, &service, f](const boost::asio::ip::tcp::endpoint &picked) mutable {
+		auto eps = balancer->alternatives(picked);
+		eps.insert(eps.begin(), picked);
+		auto raced = sockopt.for_candidates(eps.size());
+		opt.prepare = [raced](boost::asio::ip::tcp::socket &sock) {
+			raced.apply_or_warn(sock);
+		};
+		auto race = std::make_shared<net::asio::happy_eyeballs>(service, eps, opt);
+		race->on_attempt = [balancer, picked](const boost::asio::ip::tcp::endpoint &ep) {
+			/* pick() already counted the first one */
+			if(ep != picked)
+				balancer->attempting(ep);
+		};
+		race->on_result = [balancer](const boost::asio::ip::tcp::endpoint &ep, const boost::system::error_code &ec) {
+			if(!ec)
+				balancer->connected(ep);
+			else if(ec == boost::asio::error::operation_aborted)
+				balancer->abandoned(ep);
+			else
+				balancer->failed(ep);
+		};
+		race->start()->on_done([self, f](std::shared_ptr<boost::asio::ip::tcp::socket> sock) {
+			boost::system::error_code ec;
+			self->endpoint_ = sock->remote_endpoint(ec);
+			self->balanced_ = !ec;
+			self->adopt(sock)->on_ready([f](cps::future<bool> &c) {
+				if(f->is_ready())
+					return;
+				if(c.is_done())
+					f->done(c.value());
+				else if(c.is_failed())
+					f->fail_from(c);
+				else
+					f->cancel();
+			});
+		})->on_fail([self, f](const std::string &err) {
+			self->close();
+			if(!f->is_ready())
+				f->fail(err);
+		});
+	})->on_fail([self, f](const std::string &err) {
+		self->close();
+		if(!f->is_ready())
+			f->fail(err);
+	});
+	return f;
+}
+
+inline void response::abandon() {
+	if(auto conn = connection_.lock())
+		conn->abandon(*this);
+}
+
+inline void connection::request_started() {
+	if(!balanced_)
+		return;
+	request_outstanding_ = true;
+	request_start_ = std::chrono::steady_clock::now();
+	pool().balancer()->request_started(endpoint_);
+}
+
+inline void connection::request_finished() {
+	if(!request_outstanding_)
+		return;
+	request_outstanding_ = false;
+	pool().balancer()->request_finished(
+		endpoint_,
+		std::chrono::steady_clock::now() - request_start_
+	);
+}
+
+inline bool connection::address_ejected() {
+	return balanced_ && pool().balancer()->is_ejected(endpoint_);
+}
+
 inline void connection::remove() {
+	/* upgrade() has already taken us out */
+	if(upgraded_)
+		return;
+	if(request_outstanding_) {
+		/* Closed with no response - timeout, reset, or similar */
+		request_outstanding_ = false;
+		pool().balancer()->request_failed(endpoint_);
+	}
 	pool().remove(shared_from_this());
 }
 
 inline void connection::release() {
+	if(upgraded_)
+		return;
 	pool().release(shared_from_this());
 }
 
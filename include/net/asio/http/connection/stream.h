@@ -0,0 +1,374 @@
+#pragma once
+#include <iostream>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <queue>
+#include <iostream>
+#include <boost/asio.hpp>
+#include <boost/asio/read_until.hpp>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+#include <net/asio/http/connection.h>
+#include <net/asio/http/connection_pool.h>
+
+namespace net {
+namespace http {
+
+/**
+ * Plaintext HTTP over any stream socket. Everything after the
+ * connect step is the same whether we're talking TCP or a UNIX
+ * domain socket, so the concrete transports only need to
+ * provide {@link open}.
+ */
+template<typename Protocol>
+class stream_connection : public connection {
+public:
+	using socket_type = typename Protocol::socket;
+
+	stream_connection(
+		boost::asio::io_service &service,
+		connection_pool &pool,
+		const std::string &hostname,
+		uint16_t port
+	):connection(service, pool, hostname, port),
+	  socket_(std::make_shared<socket_type>(service))
+	{
+	}
+
+	virtual ~stream_connection() {
+		// std::cerr << "~stream conn " << (void *)this << "\n";
+	}
+
+	std::shared_ptr<
+		stream_connection
+	>
+	shared_from_this()
+	{
+		return std::dynamic_pointer_cast<
+			stream_connection
+		>(
+			connection::shared_from_this()
+		);
+	}
+
+	/**
+	 * Attempts to write data to the underlying connection.
+	 */
+	virtual
+	std::shared_ptr<
+		cps::future<
+			size_t
+		>
+	>
+	write(std::shared_ptr<std::vector<char>> data) override
+	{
+		auto f = cps::future<size_t>::create_shared("http write to " + hostname_ + ":" + std::to_string(port_));
+		auto self = shared_from_this();
+		boost::asio::async_write(
+			*socket_,
+			boost::asio::buffer(*data),
+			[self, data, f](const boost::system::error_code &ec, size_t bytes) {
+				if(ec) {
+					if(!f->is_ready())
+						f->fail(ec.message());
+					self->close();
+				} else {
+					f->done(bytes);
+				}
+			}
+		);
+		return f;
+	}
+
+	/**
+	 * Sends a file-backed body. On Linux this goes through sendfile(2),
+	 * elsewhere we write from a read-only mapping of the file.
+	 */
+	virtual
+	std::shared_ptr<
+		cps::future<
+			size_t
+		>
+	>
+	write_file(std::shared_ptr<file_body> body) override
+	{
+		auto f = cps::future<size_t>::create_shared("http sendfile to " + hostname_ + ":" + std::to_string(port_));
+#if defined(__linux__)
+		boost::system::error_code ec;
+		socket_->native_non_blocking(true, ec);
+		if(ec) {
+			f->fail(ec.message());
+			close();
+			return f;
+		}
+		send_file_chunk(body, std::make_shared<off_t>(0), f);
+#else
+		auto self = shared_from_this();
+		boost::asio::const_buffer buf;
+		try {
+			buf = body->mapped();
+		} catch(const std::runtime_error &e) {
+			f->fail(e.what());
+			close();
+			return f;
+		}
+		boost::asio::async_write(
+			*socket_,
+			boost::asio::buffer(buf),
+			[self, body, f](const boost::system::error_code &ec, size_t bytes) {
+				if(ec) {
+					if(!f->is_ready())
+						f->fail(ec.message());
+					self->close();
+				} else {
+					f->done(bytes);
+				}
+			}
+		);
+#endif
+		return f;
+	}
+
+	virtual
+	std::shared_ptr<
+		cps::future<
+			std::string
+		>
+	>
+	read_delimited(const std::string &delim) override
+	{
+		auto f = cps::future<std::string>::create_shared("http read_delim from " + hostname_ + ":" + std::to_string(port_));
+		auto self = shared_from_this();
+		auto delim_size = delim.size();
+		boost::asio::async_read_until(
+			*socket_,
+			*in_,
+			delim,
+			[self, f, delim_size](const boost::system::error_code &ec, size_t bytes) {
+				// std::cout << "Read until - now have " << bytes << " bytes\n";
+				if(ec) {
+					// std::cerr << "Error received during read_delimited: " << ec.message() << "\n";
+					self->close();
+					if(!f->is_ready())
+						f->fail(ec.message());
+				} else {
+					auto b = self->in_->data();
+					auto start = boost::asio::buffers_begin(b);
+					if(bytes < delim_size) {
+						// std::cerr << "Received fewer bytes than expected in read_delimited\n";
+						if(!f->is_ready())
+							f->fail("short read in read_delimited");
+					} else {
+						std::string str {
+							start,
+							start + static_cast<std::ptrdiff_t>(bytes - delim_size)
+						};
+						self->in_->consume(bytes);
+						f->done(str);
+					}
+				}
+			}
+		);
+		return f;
+	}
+
+	virtual
+	std::shared_ptr<
+		cps::future<
+			std::string
+		>
+	>
+	read(size_t wanted) override
+	{
+		auto f = cps::future<std::string>::create_shared("http read(" + std::to_string(wanted) + " from " + hostname_ + ":" + std::to_string(port_));
+		if(in_->size() < wanted) {
+			auto self = shared_from_this();
+			boost::asio::async_read(
+				*socket_,
+				*in_,
+				boost::asio::transfer_exactly(wanted - in_->size()),
+				[self, f, wanted](const boost::system::error_code &ec, size_t bytes) {
+					// std::cout << "Read " << bytes << "\n";
+					if(ec) {
+						self->close();
+						if(!f->is_ready())
+							f->fail("Error reading: " + ec.message());
+					} else {
+						auto b = self->in_->data();
+						auto start = boost::asio::buffers_begin(b);
+						std::string str {
+							start,
+							start + static_cast<std::ptrdiff_t>(wanted)
+						};
+						self->in_->consume(wanted);
+						f->done(str);
+					}
+				}
+			);
+		} else {
+			auto b = in_->data();
+			auto start = boost::asio::buffers_begin(b);
+			std::string str {
+				start,
+				start + static_cast<std::ptrdiff_t>(wanted)
+			};
+			in_->consume(wanted);
+			f->done(str);
+		}
+		return f;
+	}
+
+	virtual
+	std::shared_ptr<
+		cps::future<
+			size_t
+		>
+	>
+	read_into(char *data, size_t wanted) override
+	{
+		auto f = cps::future<size_t>::create_shared("http read_into");
+		auto have = std::min(in_->size(), wanted);
+		if(have > 0) {
+			boost::asio::buffer_copy(boost::asio::buffer(data, have), in_->data());
+			in_->consume(have);
+		}
+		if(have == wanted) {
+			f->done(wanted);
+			return f;
+		}
+
+		auto self = shared_from_this();
+		boost::asio::async_read(
+			*socket_,
+			boost::asio::buffer(data + have, wanted - have),
+			[self, f, wanted](const boost::system::error_code &ec, size_t) {
+				if(ec) {
+					self->close();
+					if(!f->is_ready())
+						f->fail("Error reading: " + ec.message());
+				} else {
+					f->done(wanted);
+				}
+			}
+		);
+		return f;
+	}
+
+	virtual
+	std::shared_ptr<
+		cps::future<
+			size_t
+		>
+	>
+	fill() override
+	{
+		auto f = cps::future<size_t>::create_shared("http fill");
+		auto self = shared_from_this();
+		boost::asio::async_read(
+			*socket_,
+			*in_,
+			boost::asio::transfer_at_least(1),
+			[self, f](const boost::system::error_code &ec, size_t bytes) {
+				if(ec) {
+					self->at_eof_ = ec == boost::asio::error::eof;
+					self->close();
+					if(!f->is_ready())
+						f->fail("Error reading: " + ec.message());
+				} else {
+					f->done(bytes);
+				}
+			}
+		);
+		return f;
+	}
+
+	virtual std::shared_ptr<cps::future<bool>> post_connect() override {
+		auto f = cps::future<bool>::create_shared("http post-connect for " + hostname_ + ":" + std::to_string(port_));
+		extend_timer();
+		handle_response();
+		f->done(true);
+		return f;
+	}
+
+	virtual void close() override {
+		if(already_closing()) {
+			// std::cerr << "someone else is doing the close() for " << (void *)this << "\n";
+			return;
+		//} else {
+		//	std::cerr << "we get to close() for " << (void *)this << "\n";
+		}
+
+		cancel_timer();
+		remove();
+		boost::system::error_code ec;
+		socket_->shutdown(socket_type::shutdown_both, ec);
+		if(ec) {
+			// std::cerr << "Failed to shut down HTTP socket: " << ec.message() << "\n";
+		}
+		socket_->close(ec);
+		if(ec) {
+			// std::cerr << "Failed to close: " << ec.message() << "\n";
+		}
+	}
+
+private:
+#if defined(__linux__)
+	/**
+	 * Pushes as much of the file as the socket will take, then waits
+	 * for writability and picks up again from the same offset.
+	 */
+	void
+	send_file_chunk(
+		std::shared_ptr<file_body> body,
+		std::shared_ptr<off_t> offset,
+		std::shared_ptr<cps::future<size_t>> f
+	)
+	{
+		while(static_cast<size_t>(*offset) < body->size()) {
+			auto n = ::sendfile(
+				socket_->native_handle(),
+				body->fd(),
+				offset.get(),
+				body->size() - static_cast<size_t>(*offset)
+			);
+			if(n > 0)
+				continue;
+			if(n < 0 && errno == EINTR)
+				continue;
+			if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				auto self = shared_from_this();
+				socket_->async_wait(
+					socket_type::wait_write,
+					[self, body, offset, f](const boost::system::error_code &ec) {
+						if(ec) {
+							if(!f->is_ready())
+								f->fail(ec.message());
+							self->close();
+						} else {
+							self->extend_timer();
+							self->send_file_chunk(body, offset, f);
+						}
+					}
+				);
+				return;
+			}
+
+			/* Zero bytes means the file was truncated underneath us */
+			if(!f->is_ready())
+				f->fail(n == 0 ? "short read from " + body->path() : std::string { std::strerror(errno) });
+			close();
+			return;
+		}
+		f->done(body->size());
+	}
+#endif
+
+protected:
+	std::shared_ptr<socket_type> socket_;
+};
+
+};
+};
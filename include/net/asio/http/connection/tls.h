@@ -59,29 +59,38 @@ public:
 			bool
 		>
 	>
-	connect(
-		const boost::asio::ip::tcp::resolver::iterator &ei
+	adopt(
+		std::shared_ptr<boost::asio::ip::tcp::socket> sock
 	) override
 	{
 		auto f = cps::future<bool>::create_shared("https connect to " + hostname_ + ":" + std::to_string(port_));
-		auto sock = socket_;
-		// std::cout << "will connect\n";
+		socket_->next_layer() = std::move(*sock);
+		return f->done(true);
+	}
+
+	/**
+	 * Attempts to write data to the underlying connection.
+	 */
+	virtual
+	std::shared_ptr<
+		cps::future<
+			size_t
+		>
+	>
+	write(std::shared_ptr<std::vector<char>> data) override
+	{
+		auto f = cps::future<size_t>::create_shared("https write to " + hostname_ + ":" + std::to_string(port_));
 		auto self = shared_from_this();
-		boost::asio::async_connect(
-			socket_->lowest_layer(),
-			ei,
-			[self, sock, f](const boost::system::error_code &ec, const boost::asio::ip::tcp::resolver::iterator &) {
-				// std::cout << "connect callback\n";
+		boost::asio::async_write(
+			*socket_,
+			boost::asio::buffer(*data),
+			[self, data, f](const boost::system::error_code &ec, size_t bytes) {
 				if(ec) {
-					self->close();
 					if(!f->is_ready())
-						f->fail("Connect failed: " + ec.message());
+						f->fail(ec.message());
+					self->close();
 				} else {
-				/*
-					boost::asio::ip::tcp::socket::non_blocking_io nb(true);
-					sock->lowest_layer().io_control(nb);
-				*/
-					f->done(true);
+					f->done(bytes);
 				}
 			}
 		);
@@ -89,7 +98,9 @@ public:
 	}
 
 	/**
-	 * Attempts to write data to the underlying connection.
+	 * Sends a file-backed body. OpenSSL needs the plaintext in user space,
+	 * so we write straight from a mapping of the file rather than reading
+	 * it into a buffer first.
 	 */
 	virtual
 	std::shared_ptr<
@@ -97,14 +108,22 @@ public:
 			size_t
 		>
 	>
-	write(std::shared_ptr<std::vector<char>> data) override
+	write_file(std::shared_ptr<file_body> body) override
 	{
-		auto f = cps::future<size_t>::create_shared("https write to " + hostname_ + ":" + std::to_string(port_));
+		auto f = cps::future<size_t>::create_shared("https write file to " + hostname_ + ":" + std::to_string(port_));
 		auto self = shared_from_this();
+		boost::asio::const_buffer buf;
+		try {
+			buf = body->mapped();
+		} catch(const std::runtime_error &e) {
+			f->fail(e.what());
+			close();
+			return f;
+		}
 		boost::asio::async_write(
 			*socket_,
-			boost::asio::buffer(*data),
-			[self, data, f](const boost::system::error_code &ec, size_t bytes) {
+			boost::asio::buffer(buf),
+			[self, body, f](const boost::system::error_code &ec, size_t bytes) {
 				if(ec) {
 					if(!f->is_ready())
 						f->fail(ec.message());
@@ -205,6 +224,70 @@ public:
 	}
 
 
+	virtual
+	std::shared_ptr<
+		cps::future<
+			size_t
+		>
+	>
+	read_into(char *data, size_t wanted) override
+	{
+		auto f = cps::future<size_t>::create_shared("https read_into");
+		auto have = std::min(in_->size(), wanted);
+		if(have > 0) {
+			boost::asio::buffer_copy(boost::asio::buffer(data, have), in_->data());
+			in_->consume(have);
+		}
+		if(have == wanted) {
+			f->done(wanted);
+			return f;
+		}
+
+		auto self = shared_from_this();
+		boost::asio::async_read(
+			*socket_,
+			boost::asio::buffer(data + have, wanted - have),
+			[self, f, wanted](const boost::system::error_code &ec, size_t) {
+				if(ec) {
+					self->close();
+					if(!f->is_ready())
+						f->fail("Error reading: " + ec.message());
+				} else {
+					f->done(wanted);
+				}
+			}
+		);
+		return f;
+	}
+
+	virtual
+	std::shared_ptr<
+		cps::future<
+			size_t
+		>
+	>
+	fill() override
+	{
+		auto f = cps::future<size_t>::create_shared("https fill");
+		auto self = shared_from_this();
+		boost::asio::async_read(
+			*socket_,
+			*in_,
+			boost::asio::transfer_at_least(1),
+			[self, f](const boost::system::error_code &ec, size_t bytes) {
+				if(ec) {
+					self->at_eof_ = ec == boost::asio::error::eof;
+					self->close();
+					if(!f->is_ready())
+						f->fail("Error reading: " + ec.message());
+				} else {
+					f->done(bytes);
+				}
+			}
+		);
+		return f;
+	}
+
 	virtual std::shared_ptr<cps::future<bool>> post_connect() override {
 		auto f = cps::future<bool>::create_shared("https post-connect for " + hostname_ + ":" + std::to_string(port_));
 		auto self = shared_from_this();
@@ -250,7 +333,7 @@ public:
 	}
 
 	virtual void release() override {
-		pool().release(shared_from_this());
+		connection::release();
 	}
 
 	/*
@@ -0,0 +1,70 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <boost/asio.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <net/asio/http/connection/stream.h>
+
+namespace net {
+namespace http {
+
+/**
+ * Plaintext HTTP over a UNIX domain socket, for http+unix:// URIs.
+ * The hostname is the filesystem path of the socket; there's no
+ * resolver step and no port.
+ */
+class unix_socket : public stream_connection<boost::asio::local::stream_protocol> {
+public:
+	unix_socket(
+		boost::asio::io_service &service,
+		connection_pool &pool,
+		const std::string &path
+	):stream_connection(service, pool, path, 0)
+	{
+	}
+
+	virtual ~unix_socket() {
+		// std::cerr << "~unix conn " << (void *)this << "\n";
+	}
+
+	std::shared_ptr<
+		unix_socket
+	>
+	shared_from_this()
+	{
+		return std::dynamic_pointer_cast<
+			unix_socket
+		>(
+			connection::shared_from_this()
+		);
+	}
+
+	virtual
+	std::shared_ptr<
+		cps::future<
+			bool
+		>
+	>
+	open() override
+	{
+		auto f = cps::future<bool>::create_shared("http connect to " + hostname_);
+		auto sock = socket_;
+		auto self = shared_from_this();
+		sock->async_connect(
+			boost::asio::local::stream_protocol::endpoint { hostname_ },
+			[self, sock, f](const boost::system::error_code &ec) {
+				if(ec) {
+					self->close();
+					if(!f->is_ready())
+						f->fail("Connect failed: " + ec.message());
+				} else {
+					f->done(true);
+				}
+			}
+		);
+		return f;
+	}
+};
+
+};
+};
@@ -7,7 +7,10 @@
 #include <queue>
 #include <boost/asio/io_service.hpp>
 
+#include <net/asio/happy_eyeballs.h>
+#include <net/asio/socket_options.h>
 #include <net/asio/http/details.h>
+#include <net/asio/http/address_balancer.h>
 #include <net/asio/http/connection.h>
 
 namespace net {
@@ -30,6 +33,13 @@ public:
 	)
 	 :service_(service),
 	  endpoint_(details),
+	  balancer_(
+		std::make_shared<address_balancer>(
+			service,
+			details.host(),
+			details.port()
+		)
+	  ),
 	  limit_connections_{true},
 	  max_connections_{8}
 	{
@@ -55,37 +65,38 @@ public:
 	next()
 	{
 		std::lock_guard<std::mutex> guard { mutex_ };
+		return next_locked();
+	}
 
-		/* Try the items in the available queue - some may have expired already */
-		while(!available_.empty()) {
-			auto conn = available_.front().lock();
-			available_.pop();
-			if(conn && conn->is_valid()) {
-				// std::cerr << endpoint_.string() << " have available conn " << static_cast<void*>(conn.get()) << ", returning that\n";
-				return cps::future<std::shared_ptr<connection>>::create_shared("available connection for " + endpoint_.string())->done(conn);
-			// } else {
-			//	std::cerr << endpoint_.string() << " Item in available list is no longer valid, dropping it\n";
-			}
-		}
-
-		/* Next option: try a new connection */
-		if(!limit_connections_ || connections_.size() < max_connections_) {
-			// std::cerr << endpoint_.string() << " Can create new conn, doing so\n";
-			auto conn = connect();
-			connections_.push_back(conn);
-			return conn;
-		} else {
-			/* Finally, queue the request until we have an endpoint that can deal with it */
-			// std::cerr << endpoint_.string() << " Have " << connections_.size() << " already, waiting\n";
-			auto f = cps::future<std::shared_ptr<connection>>::create_shared("queued connection for " + endpoint_.string());
-			auto start = std::chrono::high_resolution_clock::now();
-			next_.push([f, start](const std::shared_ptr<connection> &conn) {
-				auto elapsed = std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - start);
-				// std::cerr << "Waiting over - took " << elapsed.count() << "s\n";
-				f->done(conn);
-			});
-			return f;
-		}
+	/**
+	 * As {@link next}, for several requests at once. The pool lock is taken
+	 * once for the whole group rather than once per request.
+	 */
+	std::vector<
+		std::shared_ptr<
+			cps::future<
+				std::shared_ptr<
+					connection
+				>
+			>
+		>
+	>
+	next(size_t count)
+	{
+		std::vector<
+			std::shared_ptr<
+				cps::future<
+					std::shared_ptr<
+						connection
+					>
+				>
+			>
+		> out;
+		out.reserve(count);
+		std::lock_guard<std::mutex> guard { mutex_ };
+		for(size_t i = 0; i < count; ++i)
+			out.push_back(next_locked());
+		return out;
 	}
 
 	/**
@@ -154,7 +165,8 @@ public:
 
 					return false;
 				}
-			)
+			),
+			end(connections_)
 		);
 		// std::cerr << "removed conn " << (void *)conn.get() << ", count now " << connections_.size() << "\n";
 
@@ -200,16 +212,78 @@ public:
 	 * we'll always open a new connection as required.
 	 */
 	virtual void limit_connections(bool limit) { limit_connections_ = limit; }
+	/** How new connections race across the endpoint's addresses */
+	virtual void connect_options(const net::asio::happy_eyeballs::options &opt) { connect_options_ = opt; }
+	const net::asio::happy_eyeballs::options &connect_options() const { return connect_options_; }
+	/** Options set on each new socket */
+	virtual void socket_options(const net::asio::socket_options &opt) { socket_options_ = opt; }
+	const net::asio::socket_options &socket_options() const { return socket_options_; }
+
+	/** The endpoint this pool connects to */
+	const details &endpoint() const { return endpoint_; }
+
+	/**
+	 * Chooses which of the endpoint's addresses each new connection goes to.
+	 * Not used for UNIX domain sockets.
+	 */
+	const std::shared_ptr<address_balancer> &balancer() const { return balancer_; }
 
 private:
+	/**
+	 * Implementation for {@link next}. Caller must hold the mutex.
+	 */
+	std::shared_ptr<
+		cps::future<
+			std::shared_ptr<
+				connection
+			>
+		>
+	>
+	next_locked()
+	{
+		/* Try the items in the available queue - some may have expired already */
+		while(!available_.empty()) {
+			auto conn = available_.front().lock();
+			available_.pop();
+			if(conn && conn->is_valid()) {
+				// std::cerr << endpoint_.string() << " have available conn " << static_cast<void*>(conn.get()) << ", returning that\n";
+				return cps::future<std::shared_ptr<connection>>::create_shared("available connection for " + endpoint_.string())->done(conn);
+			// } else {
+			//	std::cerr << endpoint_.string() << " Item in available list is no longer valid, dropping it\n";
+			}
+		}
+
+		/* Next option: try a new connection */
+		if(!limit_connections_ || connections_.size() < max_connections_) {
+			// std::cerr << endpoint_.string() << " Can create new conn, doing so\n";
+			auto conn = connect();
+			connections_.push_back(conn);
+			return conn;
+		} else {
+			/* Finally, queue the request until we have an endpoint that can deal with it */
+			// std::cerr << endpoint_.string() << " Have " << connections_.size() << " already, waiting\n";
+			auto f = cps::future<std::shared_ptr<connection>>::create_shared("queued connection for " + endpoint_.string());
+			auto start = std::chrono::high_resolution_clock::now();
+			next_.push([f, start](const std::shared_ptr<connection> &conn) {
+				auto elapsed = std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - start);
+				// std::cerr << "Waiting over - took " << elapsed.count() << "s\n";
+				f->done(conn);
+			});
+			return f;
+		}
+	}
+
 	boost::asio::io_service &service_;
 	details endpoint_;
+	std::shared_ptr<address_balancer> balancer_;
 
 	std::mutex mutex_;
 	/** If true, we limit the number of connections we allow to our endpoint */
 	bool limit_connections_;
 	/** If limit_connections_ is set, this defines the number of connections we'll allow */
 	size_t max_connections_;
+	net::asio::happy_eyeballs::options connect_options_;
+	net::asio::socket_options socket_options_;
 	/** All connections, whether in use or not */
 	std::vector<
 		std::shared_ptr<
@@ -239,6 +313,7 @@ private:
 
 #include <net/asio/http/connection/tcp.h>
 #include <net/asio/http/connection/tls.h>
+#include <net/asio/http/connection/unix_socket.h>
 
 namespace net {
 namespace http {
@@ -254,7 +329,15 @@ std::shared_ptr<
 connection_pool::connect()
 {
 	//std::cerr << "Connecting\n";
-	std::shared_ptr<connection> conn = endpoint_.tls()
+	std::shared_ptr<connection> conn = endpoint_.is_unix()
+	? std::static_pointer_cast<connection>(
+		std::make_shared<unix_socket>(
+			service_,
+			*this,
+			endpoint_.socket_path()
+		)
+	)
+	: endpoint_.tls()
 	? std::static_pointer_cast<connection>(
 		std::make_shared<tls>(
 			service_,
@@ -274,6 +357,9 @@ connection_pool::connect()
 	auto f = cps::future<std::shared_ptr<connection>>::create_shared("new connection for " + endpoint_.string());
 	conn->request([conn, f] {
 		f->done(conn);
+	}, [f](const std::string &err) {
+		if(!f->is_ready())
+			f->fail(err);
 	});
 	return f;
 }
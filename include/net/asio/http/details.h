@@ -1,5 +1,6 @@
 #pragma once
 #include <string>
+#include <cstdint>
 #include <functional>
 #include <net/asio/http/uri.h>
 
@@ -14,52 +15,114 @@ namespace http {
  * * Hostname, IP or vhost
  * * Port
  * * SSL certificate
+ * * UNIX socket path, for http+unix:// URIs
+ *
+ * The key and hash are computed once on construction, since we look these
+ * up for every request.
  */
 class details {
 public:
 	details(
 		const net::http::uri &u
-	):host_{ u.host() },
+	):host_{ u.host().to_string() },
 	  port_{ u.port() },
-	  tls_{ u.scheme() == "https" }
+	  tls_{ tls_scheme(u.scheme()) },
+	  unix_{ unix_scheme(u.scheme()) },
+	  key_{ unix_ ? "http+unix://" + host_ : (tls_ ? "https://" : "http://") + host_ + ":" + std::to_string(port_) },
+	  hash_{ hash_for(tls_, unix_, host_, port_) }
 	{
 		// std::cout << " hd => " << string() << "\n";
 	}
 	details() = delete;
 	virtual ~details() {
 		// std::cout << "~hd\n";
-	}	
+	}
 
-	/** Our hashing function is currently based on the stringified value */
+	/** Hashing uses the value cached at construction */
 	class hash {
 	public:
 		std::size_t operator()(details const &hd) const {
-			return std::hash<std::string>()(hd.string());
+			return hd.hash_;
 		}
 	};
 
-	/** Equality operator is, again, based on stringified value */
+	/** Equality compares the cached hash first, then the full key */
 	class equal {
 	public:
 		bool operator()(details const &src, details const &dst) const {
-			return src.string() == dst.string();
+			return src.hash_ == dst.hash_ && src.key_ == dst.key_;
 		}
 	};
 
+	/**
+	 * Hash for the endpoint a URI would map to. Matches {@link hash_value} for
+	 * the details constructed from the same URI, without having to build one.
+	 */
+	static std::size_t hash_for(const net::http::uri &u) {
+		return hash_for(tls_scheme(u.scheme()), unix_scheme(u.scheme()), u.host(), u.port());
+	}
+
+	/** True for schemes which run over TLS */
+	static bool tls_scheme(string_view scheme) {
+		return scheme == "https" || scheme == "wss";
+	}
+
+	/**
+	 * True for schemes which talk to a UNIX domain socket. The host part
+	 * of these is the percent-encoded socket path, e.g.
+	 * http+unix://%2Fvar%2Frun%2Fsvc.sock/path
+	 */
+	static bool unix_scheme(string_view scheme) {
+		return scheme == "http+unix";
+	}
+
+	/** FNV-1a over the host, with port and transport flags folded in */
+	static std::size_t hash_for(bool tls, bool unix_socket, string_view host, uint16_t port) {
+		uint64_t h = 14695981039346656037ULL;
+		for(auto ch : host) {
+			h ^= static_cast<unsigned char>(ch);
+			h *= 1099511628211ULL;
+		}
+		h ^= static_cast<uint64_t>(port)
+			| (tls ? 0x10000ULL : 0ULL)
+			| (unix_socket ? 0x20000ULL : 0ULL);
+		h *= 1099511628211ULL;
+		return static_cast<std::size_t>(h);
+	}
+
+	/** True if the given URI would map to this endpoint */
+	bool matches(const net::http::uri &u) const {
+		return port_ == u.port()
+			&& tls_ == tls_scheme(u.scheme())
+			&& unix_ == unix_scheme(u.scheme())
+			&& u.host() == host_;
+	}
+
 	/**
 	 * Stringified value for this endpoint.
-	 * Currently takes the form host:port
+	 * Currently takes the form scheme://host:port, or
+	 * http+unix://path for UNIX sockets.
 	 */
-	std::string string() const { return (tls_ ? "https://" : "http://") + host_ + std::string { ":" } + std::to_string(port_); }
+	const std::string &string() const { return key_; }
 
 	const std::string &host() const { return host_; }
 	uint16_t port() const { return port_; }
 	bool tls() const { return tls_; }
+	bool is_unix() const { return unix_; }
+	/** Filesystem path of the UNIX socket, decoded from the host */
+	std::string socket_path() const { return uri::decoded(host_); }
+	std::size_t hash_value() const { return hash_; }
 
 private:
 	std::string host_;
 	uint16_t port_;
 	bool tls_;
+	/** True if we connect to a UNIX domain socket rather than host:port */
+	bool unix_;
+	/** Precomputed stringified form, used for equality */
+	std::string key_;
+	/** Precomputed hash of the endpoint */
+	std::size_t hash_;
 };
 
 };
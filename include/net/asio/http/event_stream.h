@@ -0,0 +1,392 @@
+#pragma once
+#include <string>
+#include <memory>
+#include <chrono>
+#include <vector>
+#include <cstdint>
+#include <stdexcept>
+#include <boost/asio.hpp>
+#include <boost/asio/high_resolution_timer.hpp>
+#include <boost/signals2.hpp>
+
+#include <net/asio/http/client.h>
+
+namespace net {
+namespace http {
+
+/**
+ * A single Server-Sent Event.
+ */
+struct sse_event {
+	/** Event type, "message" unless the server said otherwise */
+	std::string type;
+	/** Payload, with multiple data: lines joined by LF */
+	std::string data;
+	/** Last event ID as of this event */
+	std::string id;
+};
+
+/**
+ * Incremental parser for text/event-stream content.
+ *
+ * Accepts the stream in arbitrary pieces and emits each event as soon as
+ * the blank line which terminates it arrives. Only the current line and the
+ * event being assembled are held, and both are capped at max_event_size so
+ * a misbehaving server can't make us grow without bound.
+ */
+class sse_parser {
+public:
+	sse_parser(
+		size_t max_event_size = 1024 * 1024
+	):max_event_size_{ max_event_size },
+	  retry_{ 0 }
+	{
+		reset();
+	}
+
+	/** Prepare for a new stream. The last event ID is kept, as per the spec. */
+	void reset() {
+		line_.clear();
+		data_.clear();
+		type_.clear();
+		have_data_ = false;
+		skip_lf_ = false;
+		start_ = true;
+	}
+
+	/**
+	 * Parses the given data.
+	 *
+	 * on_event is called as on_event(const sse_event &) for each complete event,
+	 * on_comment as on_comment() for each comment line - servers use these as
+	 * heartbeats. Throws std::runtime_error if an event exceeds the size limit.
+	 */
+	template<typename Event, typename Comment>
+	void
+	parse(
+		const char *in,
+		size_t len,
+		Event &&on_event,
+		Comment &&on_comment
+	)
+	{
+		const char *p = in;
+		const char *end = in + len;
+		/* A UTF-8 BOM is allowed at the very start of the stream. We only check
+		 * for it when it arrives in one piece, which in practice it always does.
+		 */
+		if(start_ && p != end) {
+			start_ = false;
+			if(len >= 3 && static_cast<unsigned char>(p[0]) == 0xEF
+				&& static_cast<unsigned char>(p[1]) == 0xBB
+				&& static_cast<unsigned char>(p[2]) == 0xBF)
+				p += 3;
+		}
+		while(p != end) {
+			if(skip_lf_) {
+				skip_lf_ = false;
+				if(*p == '\x0A') {
+					++p;
+					continue;
+				}
+			}
+			const char *start = p;
+			while(p != end && *p != '\x0A' && *p != '\x0D')
+				++p;
+			if(line_.size() + static_cast<size_t>(p - start) > max_event_size_)
+				throw std::runtime_error("event stream line too long");
+			line_.append(start, static_cast<size_t>(p - start));
+			if(p == end)
+				break;
+
+			/* CR, LF and CRLF all end a line */
+			skip_lf_ = *p == '\x0D';
+			++p;
+			process_line(on_event, on_comment);
+			line_.clear();
+		}
+	}
+
+	/** ID from the most recent id: field, for reconnecting */
+	const std::string &last_event_id() const { return last_event_id_; }
+	void last_event_id(const std::string &id) { last_event_id_ = id; }
+
+	/** Reconnection delay requested by the server, in milliseconds, or 0 if none */
+	uint32_t retry() const { return retry_; }
+
+private:
+	template<typename Event, typename Comment>
+	void
+	process_line(Event &&on_event, Comment &&on_comment)
+	{
+		if(line_.empty()) {
+			dispatch(on_event);
+			return;
+		}
+		if(line_[0] == ':') {
+			on_comment();
+			return;
+		}
+
+		auto colon = line_.find(':');
+		auto field_len = colon == std::string::npos ? line_.size() : colon;
+		const char *value = line_.data() + line_.size();
+		size_t value_len = 0;
+		if(colon != std::string::npos) {
+			value = line_.data() + colon + 1;
+			value_len = line_.size() - colon - 1;
+			if(value_len > 0 && *value == ' ') {
+				++value;
+				--value_len;
+			}
+		}
+
+		if(line_.compare(0, field_len, "data") == 0 && field_len == 4) {
+			if(data_.size() + value_len + 1 > max_event_size_)
+				throw std::runtime_error("event stream event too large");
+			data_.append(value, value_len);
+			data_ += '\x0A';
+			have_data_ = true;
+		} else if(line_.compare(0, field_len, "event") == 0 && field_len == 5) {
+			type_.assign(value, value_len);
+		} else if(line_.compare(0, field_len, "id") == 0 && field_len == 2) {
+			/* IDs containing NUL are ignored */
+			if(std::char_traits<char>::find(value, value_len, '\0') == nullptr)
+				last_event_id_.assign(value, value_len);
+		} else if(line_.compare(0, field_len, "retry") == 0 && field_len == 5) {
+			uint64_t ms = 0;
+			bool valid = value_len > 0 && value_len < 10;
+			for(size_t i = 0; valid && i < value_len; ++i) {
+				if(value[i] < '0' || value[i] > '9')
+					valid = false;
+				else
+					ms = ms * 10 + static_cast<uint64_t>(value[i] - '0');
+			}
+			if(valid)
+				retry_ = static_cast<uint32_t>(ms);
+		}
+		/* Anything else is ignored */
+	}
+
+	template<typename Event>
+	void
+	dispatch(Event &&on_event)
+	{
+		if(!have_data_) {
+			type_.clear();
+			return;
+		}
+		/* Drop the LF after the last data line */
+		data_.pop_back();
+		sse_event ev;
+		ev.type = type_.empty() ? std::string { "message" } : std::move(type_);
+		ev.data = std::move(data_);
+		ev.id = last_event_id_;
+		data_.clear();
+		type_.clear();
+		have_data_ = false;
+		on_event(ev);
+	}
+
+	size_t max_event_size_;
+	/** Partial line carried over between calls */
+	std::string line_;
+	/** Event being assembled */
+	std::string data_;
+	std::string type_;
+	bool have_data_;
+	std::string last_event_id_;
+	uint32_t retry_;
+	/** Last line ended in CR, so a following LF belongs to it */
+	bool skip_lf_;
+	/** Nothing seen yet, so we may have a BOM */
+	bool start_;
+};
+
+/**
+ * Consumes a text/event-stream endpoint, delivering events as they arrive
+ * and reconnecting when the stream drops.
+ *
+ * The response body is never accumulated - events are parsed straight off
+ * the connection. The idle timeout applies to the connection as a whole, so
+ * any traffic including comment heartbeats keeps the stream alive; set it
+ * comfortably above the server's heartbeat interval. After a disconnect we
+ * wait for the server's retry: delay (or our default) and reconnect, sending
+ * Last-Event-ID so the server can pick up where it left off.
+ *
+ * A status other than 200, or a Content-Type other than text/event-stream,
+ * stops the stream for good, as does {@link stop}.
+ *
+ * Must be held in a std::shared_ptr, and stays alive only as long as the
+ * caller holds it.
+ */
+class event_stream : public std::enable_shared_from_this<event_stream> {
+public:
+	event_stream(
+		boost::asio::io_service &service,
+		client &c,
+		const net::http::uri &u,
+		float idle_timeout = 60.0f,
+		size_t max_event_size = 1024 * 1024
+	):service_(service),
+	  client_(c),
+	  uri_(u),
+	  idle_timeout_{ idle_timeout },
+	  reconnect_delay_{ 3000 },
+	  parser_{ max_event_size },
+	  timer_(service),
+	  running_{ false },
+	  generation_{ 0 }
+	{
+	}
+
+	event_stream(const event_stream &) = delete;
+	event_stream(event_stream &&) = delete;
+	virtual ~event_stream() = default;
+
+	/** Adds a header to send with each connection attempt */
+	event_stream &header(const std::string &k, const std::string &v) {
+		headers_.emplace_back(k, v);
+		return *this;
+	}
+
+	/** Delay before reconnecting, in milliseconds, unless the server sends retry: */
+	event_stream &reconnect_delay(uint32_t ms) {
+		reconnect_delay_ = ms;
+		return *this;
+	}
+
+	/** Resume from a known event ID */
+	event_stream &last_event_id(const std::string &id) {
+		parser_.last_event_id(id);
+		return *this;
+	}
+	const std::string &last_event_id() const { return parser_.last_event_id(); }
+
+	bool is_running() const { return running_; }
+
+	void start() {
+		if(running_)
+			return;
+		running_ = true;
+		connect();
+	}
+
+	/**
+	 * Stops the stream, closing the current connection if there is one.
+	 */
+	void stop() {
+		if(!running_)
+			return;
+		running_ = false;
+		++generation_;
+		boost::system::error_code ec;
+		timer_.cancel(ec);
+		if(auto r = res_.lock())
+			r->abandon();
+		res_.reset();
+		on_close();
+	}
+
+public: // Signals
+	/** Each complete event */
+	boost::signals2::signal<void(const sse_event &)> on_event;
+	/** Comment lines, which servers send as keepalives */
+	boost::signals2::signal<void()> on_heartbeat;
+	/** Each time a connection is accepted by the server */
+	boost::signals2::signal<void()> on_open;
+	/** Connection failures. We'll reconnect unless the stream has stopped. */
+	boost::signals2::signal<void(const std::string &)> on_error;
+	/** The stream has stopped and won't reconnect */
+	boost::signals2::signal<void()> on_close;
+
+private:
+	void connect() {
+		auto gen = generation_;
+		std::weak_ptr<event_stream> weak = shared_from_this();
+
+		net::http::request req { uri_ };
+		req.set_header("Accept", "text/event-stream");
+		req.set_header("Cache-Control", "no-cache");
+		if(!parser_.last_event_id().empty())
+			req.set_header("Last-Event-ID", parser_.last_event_id());
+		for(const auto &h : headers_)
+			req.set_header(h.first, h.second);
+
+		parser_.reset();
+		auto res = client_.GET(std::move(req));
+		res->stall_timeout(idle_timeout_);
+		std::weak_ptr<net::http::response> weak_res = res;
+		res_ = weak_res;
+		res->on_header_end.connect([weak, weak_res, gen]() {
+			auto self = weak.lock();
+			auto r = weak_res.lock();
+			if(!self || !r || gen != self->generation_)
+				return;
+			auto type = r->have_header("Content-Type") ? r->header_value("Content-Type") : std::string { };
+			if(r->status_code() != 200 || type.compare(0, 17, "text/event-stream") != 0) {
+				self->on_error("Unexpected response " + std::to_string(r->status_code()) + " " + type);
+				self->stop();
+				return;
+			}
+			self->on_open();
+		});
+		res->body_sink([weak, gen](const char *data, size_t len) {
+			auto self = weak.lock();
+			if(!self || gen != self->generation_)
+				throw std::runtime_error("event stream stopped");
+			self->parser_.parse(
+				data,
+				len,
+				[&self](const sse_event &ev) { self->on_event(ev); },
+				[&self]() { self->on_heartbeat(); }
+			);
+		});
+		res->completion()->on_done([weak, gen](uint16_t) {
+			auto self = weak.lock();
+			if(!self || gen != self->generation_)
+				return;
+			self->on_error("Stream closed by server");
+			self->schedule_reconnect();
+		})->on_fail([weak, gen](const std::string &err) {
+			auto self = weak.lock();
+			if(!self || gen != self->generation_)
+				return;
+			self->on_error(err);
+			self->schedule_reconnect();
+		});
+	}
+
+	void schedule_reconnect() {
+		if(!running_)
+			return;
+		auto gen = ++generation_;
+		std::weak_ptr<event_stream> weak = shared_from_this();
+		auto delay = parser_.retry() > 0 ? parser_.retry() : reconnect_delay_;
+		timer_.expires_from_now(std::chrono::milliseconds(delay));
+		timer_.async_wait([weak, gen](const boost::system::error_code &ec) {
+			auto self = weak.lock();
+			if(ec || !self || gen != self->generation_ || !self->running_)
+				return;
+			self->connect();
+		});
+	}
+
+	boost::asio::io_service &service_;
+	client &client_;
+	net::http::uri uri_;
+	std::vector<std::pair<std::string, std::string>> headers_;
+	float idle_timeout_;
+	/** Default reconnection delay in milliseconds */
+	uint32_t reconnect_delay_;
+	sse_parser parser_;
+	boost::asio::high_resolution_timer timer_;
+	/** The response we're currently reading events from */
+	std::weak_ptr<net::http::response> res_;
+	bool running_;
+	/** Bumped on each stop or reconnect, so we can tell stale callbacks apart */
+	uint64_t generation_;
+};
+
+};
+};
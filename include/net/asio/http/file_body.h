@@ -0,0 +1,96 @@
+#pragma once
+#include <string>
+#include <memory>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <boost/asio/buffer.hpp>
+
+namespace net {
+namespace http {
+
+/**
+ * A request body which lives in a file on disk.
+ *
+ * Plain TCP connections hand the file descriptor straight to the kernel
+ * via sendfile(2), so the content never passes through user space. TLS
+ * needs the plaintext in memory for encryption, so there we map the file
+ * and write from the mapping instead of reading it onto the heap.
+ *
+ * The file is opened once and may be sent any number of times - each send
+ * tracks its own offset, so a retried request will start from the beginning
+ * again.
+ */
+class file_body {
+public:
+	file_body(
+		const std::string &path
+	):path_(path),
+	  fd_{ ::open(path.c_str(), O_RDONLY | O_CLOEXEC) },
+	  size_{ 0 },
+	  map_{ nullptr }
+	{
+		if(fd_ < 0)
+			throw std::runtime_error("Failed to open " + path + ": " + std::strerror(errno));
+
+		struct stat st;
+		if(::fstat(fd_, &st) != 0) {
+			auto err = errno;
+			::close(fd_);
+			throw std::runtime_error("Failed to stat " + path + ": " + std::strerror(err));
+		}
+		size_ = static_cast<size_t>(st.st_size);
+	}
+
+	file_body() = delete;
+	file_body(const file_body &) = delete;
+	file_body(file_body &&) = delete;
+
+	virtual ~file_body() {
+		if(map_)
+			::munmap(map_, size_);
+		::close(fd_);
+	}
+
+	const std::string &path() const { return path_; }
+	/** Underlying file descriptor, suitable for sendfile(2) */
+	int fd() const { return fd_; }
+	/** Total number of bytes we'll send */
+	size_t size() const { return size_; }
+
+	/**
+	 * Returns a read-only view of the file contents.
+	 * The mapping is created on first use and shared by all later sends.
+	 */
+	boost::asio::const_buffer
+	mapped()
+	{
+		if(size_ == 0)
+			return boost::asio::const_buffer();
+
+		if(!map_) {
+			auto p = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd_, 0);
+			if(p == MAP_FAILED)
+				throw std::runtime_error("Failed to map " + path_ + ": " + std::strerror(errno));
+			::madvise(p, size_, MADV_SEQUENTIAL);
+			map_ = p;
+		}
+		return boost::asio::const_buffer(map_, size_);
+	}
+
+private:
+	std::string path_;
+	int fd_;
+	size_t size_;
+	void *map_;
+};
+
+};
+};
+
@@ -165,8 +165,19 @@ public:
 		body_ = in;
 		set_header("Content-Length", std::to_string(body_.size()));
 	}
-	virtual void append_body(const std::string &in) {
-		body_ += in;
+	/**
+	 * Sizes the body to hold content we're about to receive, returning
+	 * the storage to read it into.
+	 */
+	virtual char *body_storage(size_t len) {
+		body_.resize(len);
+		return len > 0 ? &body_[0] : nullptr;
+	}
+	void append_body(const std::string &in) {
+		append_body(in.data(), in.size());
+	}
+	virtual void append_body(const char *in, size_t len) {
+		body_.append(in, len);
 	}
 
 // Signals
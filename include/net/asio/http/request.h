@@ -1,8 +1,10 @@
 #pragma once
 #include <string>
+#include <memory>
 
 #include <net/asio/http/uri.h>
 #include <net/asio/http/message.h>
+#include <net/asio/http/file_body.h>
 
 namespace net {
 namespace http {
@@ -36,11 +38,15 @@ public:
 	 */
 	 :message("HTTP/1.1"),
 	  uri_(u),
-	  request_path_(u.path())
+	  request_path_(u.path().to_string())
 	{
 		if(request_path_.empty()) request_path_ = "/";
-		if(u.have_query()) request_path_ += std::string { "?" } + u.query_string();
-		add_header(header { "Host", u.host() });
+		if(u.have_query()) {
+			request_path_ += '?';
+			request_path_.append(u.query_string().data(), u.query_string().size());
+		}
+		/* For UNIX sockets the host is the socket path, which means nothing to the server */
+		add_header(header { "Host", u.scheme() == "http+unix" ? std::string { "localhost" } : u.host().to_string() });
 	}
 
 	/**
@@ -51,8 +57,10 @@ public:
 	request(
 		request &&src
 	):message(std::move(src)),
+	  uri_(std::move(src.uri_)),
 	  method_(std::move(src.method_)),
-	  request_path_(std::move(src.request_path_))
+	  request_path_(std::move(src.request_path_)),
+	  body_file_(std::move(src.body_file_))
 	{
 	}
 
@@ -112,8 +120,38 @@ public:
 		return *this;
 	}
 
+	/**
+	 * Sends the content of the given file as the request body.
+	 * Replaces any in-memory body.
+	 */
+	request &body_file(std::shared_ptr<file_body> f) {
+		body_.clear();
+		body_file_ = std::move(f);
+		set_header("Content-Length", std::to_string(body_file_->size()));
+		return *this;
+	}
+	request &body_file(const std::string &path) {
+		return body_file(std::make_shared<file_body>(path));
+	}
+	const std::shared_ptr<file_body> &body_file() const { return body_file_; }
+	bool have_body_file() const { return static_cast<bool>(body_file_); }
+
+	/**
+	 * Sets an in-memory body, replacing any {@link body_file} so that
+	 * Content-Length matches what we send.
+	 */
+	virtual void body(const std::string &in) override {
+		body_file_.reset();
+		message::body(in);
+	}
+	using message::body;
+
+	/**
+	 * Request line and headers, including the blank line
+	 * which separates them from the body.
+	 */
 	virtual std::string
-	bytes() const
+	head_bytes() const
 	{
 		std::stringstream ss;
 		ss << method() << " " << request_path() << " " << version() << "\x0D\x0A";
@@ -121,10 +159,19 @@ public:
 			ss << h.key() << ": " << h.value() << "\x0D\x0A";
 		});
 		ss << "\x0D\x0A";
-		ss << body();
 		return ss.str();
 	}
 
+	/**
+	 * The full request. File-backed bodies are not included here,
+	 * those are streamed separately by the connection.
+	 */
+	virtual std::string
+	bytes() const
+	{
+		return head_bytes() + body();
+	}
+
 public: // Signals
 	boost::signals2::signal<void(const std::string &)> on_method;
 	boost::signals2::signal<void(const std::string &)> on_request_path;
@@ -135,6 +182,8 @@ protected:
 	std::string method_;
 	/** Full path info from the first line, may be a complete URI */
 	std::string request_path_;
+	/** Body content to send from disk rather than memory, if any */
+	std::shared_ptr<file_body> body_file_;
 };
 
 };
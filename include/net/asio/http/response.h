@@ -1,15 +1,19 @@
 #pragma once
 #include <string>
 #include <memory>
+#include <functional>
 #include <boost/signals2.hpp>
 
 #include <cps/future.h>
 
 #include <net/asio/http/request.h>
+#include <net/asio/http/body_store.h>
 
 namespace net {
 namespace http {
 
+class connection;
+
 /**
  * A response is always associated with a request. Note that a request may
  * be "virtual" - this is the case with HTTP/2 PUSH, for example. These
@@ -34,7 +38,8 @@ public:
 	{
 	}
 
-	response(const response &) = default;
+	/** Signals can't be copied, and a copy would share the spilled body with us */
+	response(const response &) = delete;
 
 	/**
 	 * Move constructor.
@@ -48,7 +53,16 @@ public:
 	  status_message_(std::move(src.status_message_)),
 	  completion_(std::move(src.completion_)),
 	  current_completion_(std::move(src.current_completion_)),
-	  stall_timeout_(std::move(src.stall_timeout_))
+	  stall_timeout_(std::move(src.stall_timeout_)),
+	  body_sink_(std::move(src.body_sink_)),
+	  body_buffer_(src.body_buffer_),
+	  body_buffer_capacity_(src.body_buffer_capacity_),
+	  body_buffer_size_(src.body_buffer_size_),
+	  body_store_(std::move(src.body_store_)),
+	  stored_copy_(std::move(src.stored_copy_)),
+	  stored_copy_valid_(src.stored_copy_valid_),
+	  upgraded_connection_(std::move(src.upgraded_connection_)),
+	  connection_(std::move(src.connection_))
 	{
 	}
 
@@ -107,6 +121,16 @@ public:
 	 */
 	const std::string &status_message() const { return status_message_; }
 
+	/**
+	 * False for responses which never have a body, whatever their headers
+	 * say: anything to a HEAD, 1xx, 204 and 304 (RFC 7230 section 3.3.3).
+	 */
+	bool may_have_body() const {
+		if(request_.method() == "HEAD")
+			return false;
+		return status_code_ >= 200 && status_code_ != 204 && status_code_ != 304;
+	}
+
 	/**
 	 * Returns the completion future for this response.
 	 * It will resolve with the status code when done.
@@ -133,11 +157,134 @@ public:
 	const float stall_timeout() const { return stall_timeout_; }
 	void stall_timeout(float sec) { stall_timeout_ = sec; }
 
+	/**
+	 * Delivers body content to the given code as it arrives, instead of
+	 * accumulating it in {@link body}. The data is only valid for the
+	 * duration of the call. Throwing from the sink abandons the response:
+	 * the connection is closed and the completion fails.
+	 */
+	response &body_sink(std::function<void(const char *, size_t)> code) {
+		body_sink_ = std::move(code);
+		return *this;
+	}
+
+	bool have_body_sink() const { return static_cast<bool>(body_sink_); }
+
+	/**
+	 * Provides memory to receive the body into - a pooled buffer, or a mapped
+	 * file, for example. A Content-Length body which fits will be read straight
+	 * into this storage and {@link body} will stay empty. Anything else goes to
+	 * {@link body} as usual.
+	 */
+	response &body_buffer(char *data, size_t capacity) {
+		body_buffer_ = data;
+		body_buffer_capacity_ = capacity;
+		return *this;
+	}
+
+	/** Number of bytes received into the {@link body_buffer}, if used */
+	size_t body_buffer_size() const { return body_buffer_size_; }
+
+	/**
+	 * True if a len-byte body would go into storage the caller set up - a
+	 * {@link body_buffer} big enough, or a {@link spill_threshold} store -
+	 * rather than memory we'd commit for it up front.
+	 */
+	bool has_body_storage(size_t len) const {
+		return (body_buffer_ && len <= body_buffer_capacity_) || body_store_;
+	}
+
+	/**
+	 * Keeps at most this many bytes of the body in memory, moving the rest
+	 * to an unlinked file in the given directory. Use {@link body_view} to
+	 * get at a large body without copying it back into memory; {@link body}
+	 * still works, but reads the whole thing into a string.
+	 */
+	response &spill_threshold(size_t bytes, const std::string &directory = body_store::default_directory()) {
+		body_store_ = std::make_shared<body_store>(bytes, directory);
+		return *this;
+	}
+
+	/** The spill-to-disk store, if {@link spill_threshold} was set */
+	const std::shared_ptr<body_store> &stored_body() const { return body_store_; }
+
+	/**
+	 * The body as a contiguous range, wherever it's held. Valid until more
+	 * body content arrives.
+	 */
+	boost::string_view body_view() const {
+		if(body_store_)
+			return body_store_->view();
+		return boost::string_view { body_ };
+	}
+
+	/**
+	 * With a {@link spill_threshold}, this is a copy of the stored body,
+	 * made when first asked for and again after more arrives. The store
+	 * keeps the body either way, so asking early doesn't stop the rest
+	 * going to disk.
+	 */
+	virtual const std::string &body() const override {
+		if(!body_store_)
+			return body_;
+		if(!stored_copy_valid_) {
+			auto v = body_store_->view();
+			stored_copy_.assign(v.data(), v.size());
+			stored_copy_valid_ = true;
+		}
+		return stored_copy_;
+	}
+
+	virtual char *body_storage(size_t len) override {
+		if(body_buffer_ && len <= body_buffer_capacity_) {
+			body_buffer_size_ = len;
+			return body_buffer_;
+		}
+		if(body_store_) {
+			stored_copy_valid_ = false;
+			return body_store_->storage(len);
+		}
+		return message::body_storage(len);
+	}
+
+	virtual void append_body(const char *in, size_t len) override {
+		if(body_sink_) {
+			body_sink_(in, len);
+		} else if(body_store_) {
+			body_store_->append(in, len);
+			stored_copy_valid_ = false;
+		} else {
+			message::append_body(in, len);
+		}
+	}
+	using message::append_body;
+
+	/**
+	 * After a 101 Switching Protocols, this holds the connection which was
+	 * upgraded. It is no longer part of any pool.
+	 */
+	std::shared_ptr<connection> upgraded_connection() const { return upgraded_connection_; }
+	void upgraded_connection(std::shared_ptr<connection> conn) { upgraded_connection_ = std::move(conn); }
+
+	/** The connection this response was last sent on */
+	void active_connection(std::weak_ptr<connection> conn) { connection_ = std::move(conn); }
+
+	/**
+	 * Stops reading this response: if it's still arriving, the connection
+	 * is closed and the completion fails. Defined in connection.h.
+	 */
+	void abandon();
+
 	void reset() {
 		current_completion_ = cps::future<uint16_t>::create_shared(request_.method() + " " + request_.uri().string() + " completion");
 		headers_.clear();
 		version_ = "";
 		body_ = "";
+		body_buffer_size_ = 0;
+		if(body_store_)
+			body_store_->clear();
+		stored_copy_.clear();
+		stored_copy_valid_ = false;
 	}
 
 public: // Signals
@@ -153,6 +300,22 @@ protected:
 	std::shared_ptr<cps::future<uint16_t>> completion_;
 	std::shared_ptr<cps::future<uint16_t>> current_completion_;
 	float stall_timeout_;
+	/** Optional destination for body content */
+	std::function<void(const char *, size_t)> body_sink_;
+	/** Optional caller-provided storage for Content-Length bodies */
+	char *body_buffer_ = nullptr;
+	size_t body_buffer_capacity_ = 0;
+	size_t body_buffer_size_ = 0;
+	/** Optional spill-to-disk storage for the body */
+	std::shared_ptr<body_store> body_store_;
+	/** The stored body, once someone has asked for it as a string */
+	mutable std::string stored_copy_;
+	/** False once the store has changed since stored_copy_ was made */
+	mutable bool stored_copy_valid_ = false;
+	/** Set if the server switched protocols */
+	std::shared_ptr<connection> upgraded_connection_;
+	/** Set when the request is written, so we can be abandoned */
+	std::weak_ptr<connection> connection_;
 };
 
 };
@@ -1,13 +1,50 @@
 #pragma once
 #include <string>
-#include <iostream>
-#include <iomanip>
-#include <cctype>
-#include <boost/regex.hpp>
+#include <cstdint>
+#include <stdexcept>
+#include <boost/utility/string_view.hpp>
 
 namespace net {
 namespace http {
 
+/** Until we require C++17, this stands in for std::string_view */
+using string_view = boost::string_view;
+
+namespace detail {
+
+/**
+ * Lookup tables for percent-encoding. Built at compile time so that
+ * encoding and decoding are a single table load per byte.
+ */
+struct percent_table {
+	constexpr percent_table(
+	):unreserved{ },
+	  hex_value{ },
+	  hex_digit{ '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f' }
+	{
+		for(int i = 0; i < 256; ++i) {
+			unreserved[i] = (i >= 'a' && i <= 'z')
+				|| (i >= 'A' && i <= 'Z')
+				|| (i >= '0' && i <= '9')
+				|| i == '.' || i == '_' || i == '~' || i == '-';
+			hex_value[i] = (i >= '0' && i <= '9') ? static_cast<int8_t>(i - '0')
+				: (i >= 'a' && i <= 'f') ? static_cast<int8_t>(i - 'a' + 10)
+				: (i >= 'A' && i <= 'F') ? static_cast<int8_t>(i - 'A' + 10)
+				: -1;
+		}
+	}
+
+	/** RFC3986 unreserved characters, which we never escape */
+	bool unreserved[256];
+	/** Value of each hex digit, -1 for anything else */
+	int8_t hex_value[256];
+	char hex_digit[16];
+};
+
+static constexpr percent_table percent { };
+
+};
+
 class uri {
 public:
 	class query {
@@ -22,7 +59,12 @@ public:
 
 		std::string encoded_string() const
 		{
-			return encoded_key() + "=" + encoded_value();
+			std::string out;
+			out.reserve(encoded_size(key_) + 1 + encoded_size(value_));
+			encode_into(out, key_);
+			out += '=';
+			encode_into(out, value_);
+			return out;
 		}
 		std::string encoded_key() const
 		{
@@ -33,17 +75,9 @@ public:
 			return escape(value_);
 		}
 
-		static std::string escape(const std::string &in)
+		static std::string escape(string_view in)
 		{
-			std::stringstream out;
-			/* FIXME Pretty sure there are better ways of doing this */
-			for(auto &ch : in) {
-				if(isalnum(ch) || ch == '.' || ch == '_' || ch == '~' || ch == '-')
-					out << ch;
-				else
-					out << "%" << std::setw(2) << std::hex << static_cast<int>(ch);
-			}
-			return out.str();
+			return encoded(in);
 		}
 
 	private:
@@ -53,43 +87,88 @@ public:
 
 	uri &operator<<(const query &q)
 	{
-		if(have_query()) query_ += "&";
-		query_ += q.encoded_string();
+		/* The query sits before any fragment, so we insert rather than append */
+		auto at = query_.offset + query_.length;
+		auto item = q.encoded_string();
+		if(have_query()) {
+			item.insert(item.begin(), '&');
+			query_.length += item.size();
+		} else if(query_.offset > 0 && text_[query_.offset - 1] == '?') {
+			/* We already have a separator from an empty query string */
+			query_.length = item.size();
+		} else {
+			item.insert(item.begin(), '?');
+			query_.offset = at + 1;
+			query_.length = item.size() - 1;
+		}
+		text_.insert(at, item);
+		fragment_.offset += item.size();
 		return *this;
 	}
 
-	static std::string encoded(const std::string &in)
+	/** Number of bytes the percent-encoded form of the input would take */
+	static size_t encoded_size(string_view in)
+	{
+		size_t n = in.size();
+		for(auto ch : in)
+			if(!detail::percent.unreserved[static_cast<unsigned char>(ch)])
+				n += 2;
+		return n;
+	}
+
+	/** Appends the percent-encoded form of the input to the given string */
+	static void encode_into(std::string &out, string_view in)
 	{
-		std::stringstream out;
-		/* FIXME Pretty sure there are better ways of doing this */
-		for(auto &ch : in) {
-			if(isalnum(ch) || ch == '.' || ch == '_' || ch == '~' || ch == '-')
-				out << ch;
-			else
-				out << "%" << std::setw(2) << std::setfill('0') << std::hex << static_cast<int>(ch);
-		}
-		return out.str();
+		auto start = out.size();
+		out.resize(start + encoded_size(in));
+		auto p = &out[start];
+		for(auto ch : in) {
+			auto c = static_cast<unsigned char>(ch);
+			if(detail::percent.unreserved[c]) {
+				*p++ = ch;
+			} else {
+				*p++ = '%';
+				*p++ = detail::percent.hex_digit[c >> 4];
+				*p++ = detail::percent.hex_digit[c & 0x0F];
+			}
+		}
 	}
 
-	static std::string decoded(const std::string &in)
+	static std::string encoded(string_view in)
 	{
-		std::stringstream out;
-		/* FIXME Pretty sure there are better ways of doing this */
-		auto it = in.cbegin();
-		while(it != in.cend()) {
+		std::string out;
+		encode_into(out, in);
+		return out;
+	}
+
+	/**
+	 * Decodes %xx escapes and '+'. Malformed escapes are passed through as-is.
+	 */
+	static std::string decoded(string_view in)
+	{
+		std::string out(in.size(), '\0');
+		auto p = &out[0];
+		const auto *it = in.data();
+		const auto *end = it + in.size();
+		while(it != end) {
 			if(*it == '+') {
-				out << ' ';
-			} else if(*it == '%') {
-				++it;
-				std::string s { it, it + 2 };
-				out << static_cast<char>(std::stoi(s, 0, 16));
-				++it;
+				*p++ = ' ';
+			} else if(*it == '%' && end - it > 2) {
+				auto hi = detail::percent.hex_value[static_cast<unsigned char>(it[1])];
+				auto lo = detail::percent.hex_value[static_cast<unsigned char>(it[2])];
+				if(hi < 0 || lo < 0) {
+					*p++ = *it;
+				} else {
+					*p++ = static_cast<char>((hi << 4) | lo);
+					it += 2;
+				}
 			} else {
-				out << *it;
+				*p++ = *it;
 			}
 			++it;
 		}
-		return out.str();
+		out.resize(static_cast<size_t>(p - out.data()));
+		return out;
 	}
 
 	/**
@@ -99,82 +178,179 @@ public:
 	 *
 	 *     "http://localhost/some/path?query=string"
 	 *
+	 * The input is copied once, and each component refers to
+	 * a range within that copy.
 	 */
 	uri(
 		const std::string &in
-	)
+	):text_(in),
+	  port_{ 0 }
 	{
-		static const boost::regex re(
-			"^(?<scheme>[a-z]+)://(?:(?<user>[^:]*):(?<password>[^@]*)@)?(?<host>[^:/]+)(?::(?<port>\\d+))?(?<path>/[^?#]*)?(?:\\?(?<query>[^#]*))?(?:#(?<fragment>.*))?$",
-			boost::regex::icase
-		);
-		boost::smatch matches;
-		if(!regex_match(in, matches, re)) throw std::runtime_error("Failed to parse " + in);
-		scheme_ = matches["scheme"];
-		hostname_ = matches["host"];
-		port_ = std::string(matches["port"]).empty()
-		? port_for_scheme(scheme_)
-		: static_cast<uint16_t>(std::stoi(matches["port"]));
-		user_ = matches["user"];
-		pass_ = matches["password"];
-		path_ = matches["path"];
-		query_ = matches["query"];
-		fragment_ = matches["fragment"];
+		const size_t size = text_.size();
+		const char *s = text_.data();
+		size_t pos = 0;
+
+		/* scheme: ALPHA *( ALPHA / DIGIT / "+" / "-" / "." ) */
+		while(pos < size && (
+			(s[pos] >= 'a' && s[pos] <= 'z')
+			|| (s[pos] >= 'A' && s[pos] <= 'Z')
+			|| (pos > 0 && (
+				(s[pos] >= '0' && s[pos] <= '9')
+				|| s[pos] == '+' || s[pos] == '-' || s[pos] == '.'
+			))
+		)) ++pos;
+		if(pos == 0 || size - pos < 3 || s[pos] != ':' || s[pos + 1] != '/' || s[pos + 2] != '/')
+			throw std::runtime_error("Failed to parse " + in);
+		scheme_ = { 0, pos };
+		pos += 3;
+
+		/* Authority runs up to the path, query or fragment */
+		size_t auth_end = pos;
+		while(auth_end < size && s[auth_end] != '/' && s[auth_end] != '?' && s[auth_end] != '#')
+			++auth_end;
+
+		/* Optional user:password@ */
+		auto at = text_.find('@', pos);
+		if(at != std::string::npos && at < auth_end) {
+			auto colon = text_.find(':', pos);
+			if(colon != std::string::npos && colon < at) {
+				user_ = { pos, colon - pos };
+				pass_ = { colon + 1, at - colon - 1 };
+			} else {
+				user_ = { pos, at - pos };
+				pass_ = { at, 0 };
+			}
+			pos = at + 1;
+		} else {
+			user_ = { pos, 0 };
+			pass_ = { pos, 0 };
+		}
+
+		/* host[:port] */
+		size_t host_start = pos;
+		while(pos < auth_end && s[pos] != ':')
+			++pos;
+		if(pos == host_start)
+			throw std::runtime_error("Failed to parse " + in);
+		hostname_ = { host_start, pos - host_start };
+		if(pos < auth_end) {
+			++pos;
+			if(pos == auth_end)
+				throw std::runtime_error("Failed to parse " + in);
+			uint32_t port = 0;
+			for(; pos < auth_end; ++pos) {
+				if(s[pos] < '0' || s[pos] > '9')
+					throw std::runtime_error("Failed to parse " + in);
+				port = port * 10 + static_cast<uint32_t>(s[pos] - '0');
+				if(port > 65535)
+					throw std::runtime_error("Failed to parse " + in);
+			}
+			port_ = static_cast<uint16_t>(port);
+		} else {
+			port_ = port_for_scheme(scheme());
+		}
+
+		/* /path?query#fragment */
+		size_t path_start = pos;
+		while(pos < size && s[pos] != '?' && s[pos] != '#')
+			++pos;
+		path_ = { path_start, pos - path_start };
+		if(pos < size && s[pos] == '?') {
+			size_t query_start = ++pos;
+			while(pos < size && s[pos] != '#')
+				++pos;
+			query_ = { query_start, pos - query_start };
+		} else {
+			query_ = { pos, 0 };
+		}
+		if(pos < size) {
+			/* Must be '#' at this point */
+			fragment_ = { pos + 1, size - pos - 1 };
+		} else {
+			fragment_ = { size, 0 };
+		}
 	}
 
-	uri() = default;
+	uri():port_{ 0 } { }
 	uri(const uri &src) = default;
 	uri(uri &&src) = default;
+	uri &operator=(const uri &src) = default;
+	uri &operator=(uri &&src) = default;
 	virtual ~uri() = default;
 
-	const std::string &scheme() const { return scheme_; }
-	const std::string &host() const { return hostname_; }
-	const std::string &user() const { return user_; }
-	const std::string &pass() const { return pass_; }
-	const std::string &path() const { return path_; }
-	const std::string &query_string() const { return query_; }
-	const std::string &fragment() const { return fragment_; }
-	bool have_query() const { return !query_.empty(); }
+	string_view scheme() const { return part(scheme_); }
+	string_view host() const { return part(hostname_); }
+	string_view user() const { return part(user_); }
+	string_view pass() const { return part(pass_); }
+	string_view path() const { return part(path_); }
+	string_view query_string() const { return part(query_); }
+	string_view fragment() const { return part(fragment_); }
+	bool have_query() const { return query_.length > 0; }
 	uint16_t port() const { return port_; }
 
 	/** Returns true if the port used for this URI would be the default for the scheme */
 	bool is_default_port() const {
 		try {
-			return port_for_scheme(scheme_) == port_;
+			return port_for_scheme(scheme()) == port_;
 		} catch(const std::runtime_error &e) {
 			return false;
 		}
 	}
 
-	static uint16_t port_for_scheme(const std::string &scheme) {
+	static uint16_t port_for_scheme(string_view scheme) {
 		/* TODO hey this looks a lot like the information we'd get from /etc/services and GAI */
 		if(scheme == "amqp") return 5672;
 		else if(scheme == "amqps") return 5671;
 		else if(scheme == "http") return 80;
 		else if(scheme == "https") return 443;
+		else if(scheme == "ws") return 80;
+		else if(scheme == "wss") return 443;
+		/* The host is a socket path, so there's no port to speak of */
+		else if(scheme == "http+unix") return 0;
 		else if(scheme == "imap") return 143;
 		else if(scheme == "pop3") return 110;
 		else if(scheme == "smtp") return 25;
-		throw std::runtime_error("Unknown scheme " + scheme);
+		throw std::runtime_error("Unknown scheme " + scheme.to_string());
 	}
 
 	std::string string() const {
-		return scheme_
-		+ "://"
-		+ hostname_
-		+ (is_default_port() ? std::string { "" } : std::string { ":" } + std::to_string(port()))
-		+ path_
-		+ (have_query() ? "?" + query_ : "");
+		auto default_port = is_default_port();
+		auto port_str = default_port ? std::string { } : std::to_string(port_);
+		std::string out;
+		out.reserve(scheme_.length + 3 + hostname_.length + 1 + port_str.size() + path_.length + 1 + query_.length);
+		out.append(text_, scheme_.offset, scheme_.length);
+		out += "://";
+		out.append(text_, hostname_.offset, hostname_.length);
+		if(!default_port) {
+			out += ':';
+			out += port_str;
+		}
+		out.append(text_, path_.offset, path_.length);
+		if(have_query()) {
+			out += '?';
+			out.append(text_, query_.offset, query_.length);
+		}
+		return out;
 	}
 
 private:
-	std::string scheme_;
-	std::string hostname_;
-	std::string user_;
-	std::string pass_;
-	std::string path_;
-	std::string query_;
-	std::string fragment_;
+	/** A component, as a range within text_ */
+	struct range {
+		size_t offset;
+		size_t length;
+	};
+
+	string_view part(const range &r) const { return string_view { text_.data() + r.offset, r.length }; }
+
+	/** The URI as given, which all of the components refer into */
+	std::string text_;
+	range scheme_{ 0, 0 };
+	range hostname_{ 0, 0 };
+	range user_{ 0, 0 };
+	range pass_{ 0, 0 };
+	range path_{ 0, 0 };
+	range query_{ 0, 0 };
+	range fragment_{ 0, 0 };
 	uint16_t port_;
 };
 
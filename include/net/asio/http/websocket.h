@@ -0,0 +1,726 @@
+#pragma once
+#include <string>
+#include <memory>
+#include <queue>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+
+#include <zlib.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include <boost/asio.hpp>
+#include <boost/signals2.hpp>
+#include <boost/algorithm/string.hpp>
+
+#include <cps/future.h>
+
+#include <net/asio/source.h>
+#include <net/asio/http/connection.h>
+
+namespace net {
+namespace http {
+
+/**
+ * WebSocket (RFC6455) client session, running over an HTTP connection
+ * which has been through a successful 101 upgrade.
+ *
+ * Use {@link client::connect_websocket} to establish one. Complete messages
+ * are emitted through {@link messages} - if a handler returns a future which
+ * is not yet ready, we stop reading until it resolves.
+ *
+ * Supports fragmentation in both directions, ping/pong, the close
+ * handshake and permessage-deflate (RFC7692). Text messages and close
+ * reasons which aren't valid UTF-8 close the connection with 1007.
+ */
+class websocket : public std::enable_shared_from_this<websocket> {
+public:
+	enum class opcode : uint8_t {
+		continuation = 0x0,
+		text = 0x1,
+		binary = 0x2,
+		close = 0x8,
+		ping = 0x9,
+		pong = 0xA
+	};
+
+	/**
+	 * Negotiated permessage-deflate parameters.
+	 */
+	class deflate_options {
+	public:
+		deflate_options(
+		):enabled{ false },
+		  server_no_context_takeover{ false },
+		  client_no_context_takeover{ false },
+		  server_max_window_bits{ 15 },
+		  client_max_window_bits{ 15 }
+		{
+		}
+
+		bool enabled;
+		bool server_no_context_takeover;
+		bool client_no_context_takeover;
+		int server_max_window_bits;
+		int client_max_window_bits;
+
+		/** The offer we send in Sec-WebSocket-Extensions */
+		static const char *offer() { return "permessage-deflate; client_max_window_bits"; }
+
+		/**
+		 * Extracts permessage-deflate parameters from the server's
+		 * Sec-WebSocket-Extensions response header.
+		 */
+		static deflate_options
+		parse(const std::string &in)
+		{
+			deflate_options opt;
+			std::vector<std::string> extensions;
+			boost::algorithm::split(extensions, in, boost::algorithm::is_any_of(","));
+			for(auto &ext : extensions) {
+				std::vector<std::string> params;
+				boost::algorithm::split(params, ext, boost::algorithm::is_any_of(";"));
+				boost::algorithm::trim(params[0]);
+				if(params[0] != "permessage-deflate")
+					continue;
+
+				opt.enabled = true;
+				for(size_t i = 1; i < params.size(); ++i) {
+					auto &p = params[i];
+					boost::algorithm::trim(p);
+					auto eq = p.find('=');
+					auto k = p.substr(0, eq);
+					auto v = eq == std::string::npos ? std::string { } : p.substr(eq + 1);
+					boost::algorithm::trim(k);
+					boost::algorithm::trim_if(v, boost::algorithm::is_any_of(" \""));
+					if(k == "server_no_context_takeover") {
+						opt.server_no_context_takeover = true;
+					} else if(k == "client_no_context_takeover") {
+						opt.client_no_context_takeover = true;
+					} else if(k == "server_max_window_bits") {
+						opt.server_max_window_bits = window_bits(v);
+					} else if(k == "client_max_window_bits") {
+						opt.client_max_window_bits = window_bits(v);
+						/* zlib can't produce raw deflate with a 256-byte window */
+						if(opt.client_max_window_bits < 9)
+							throw std::runtime_error("Can't compress with client_max_window_bits=" + v);
+					} else {
+						throw std::runtime_error("Unknown permessage-deflate parameter " + k);
+					}
+				}
+				break;
+			}
+			return opt;
+		}
+
+	private:
+		static int window_bits(const std::string &v) {
+			if(v.empty()) return 15;
+			auto bits = std::stoi(v);
+			if(bits < 8 || bits > 15)
+				throw std::runtime_error("Invalid window bits " + v);
+			return bits;
+		}
+	};
+
+	websocket(
+		std::shared_ptr<connection> conn,
+		const deflate_options &deflate = deflate_options { }
+	):conn_(std::move(conn)),
+	  in_(conn_->input_buffer()),
+	  source_(net::source<uint8_t>::create()),
+	  deflate_(deflate),
+	  keys_used_{ key_batch },
+	  max_frame_size_{ 65536 },
+	  max_message_size_{ 64 * 1024 * 1024 },
+	  state_{ read_state::header },
+	  paused_{ false },
+	  writing_{ false },
+	  close_sent_{ false },
+	  closed_{ false },
+	  in_message_{ false },
+	  message_op_{ opcode::text }
+	{
+		if(deflate_.enabled) {
+			std::memset(&deflate_stream_, 0, sizeof(deflate_stream_));
+			std::memset(&inflate_stream_, 0, sizeof(inflate_stream_));
+			if(deflateInit2(&deflate_stream_, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -deflate_.client_max_window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+				throw std::runtime_error("Failed to initialise deflate");
+			if(inflateInit2(&inflate_stream_, -15) != Z_OK) {
+				deflateEnd(&deflate_stream_);
+				throw std::runtime_error("Failed to initialise inflate");
+			}
+		}
+	}
+
+	websocket() = delete;
+	websocket(const websocket &) = delete;
+	websocket(websocket &&) = delete;
+
+	virtual ~websocket() {
+		if(deflate_.enabled) {
+			deflateEnd(&deflate_stream_);
+			inflateEnd(&inflate_stream_);
+		}
+	}
+
+	/** Starts reading frames from the server */
+	void start() { read_frames(); }
+
+	/** Complete incoming messages */
+	std::shared_ptr<net::source<uint8_t>> messages() { return source_; }
+
+	/** Opcode of the most recent message emitted via {@link messages} */
+	opcode message_type() const { return message_op_; }
+
+	std::shared_ptr<cps::future<size_t>>
+	send_text(const std::string &in) { return send(opcode::text, in.data(), in.size()); }
+
+	std::shared_ptr<cps::future<size_t>>
+	send_binary(const std::string &in) { return send(opcode::binary, in.data(), in.size()); }
+
+	std::shared_ptr<cps::future<size_t>>
+	ping(const std::string &payload = "")
+	{
+		if(payload.size() > 125)
+			throw std::runtime_error("ping payload too large");
+		return queue_frame(encode_frame(opcode::ping, true, false, payload.data(), payload.size()));
+	}
+
+	/**
+	 * Starts the close handshake. The connection is closed once the server
+	 * acknowledges.
+	 */
+	std::shared_ptr<cps::future<size_t>>
+	close(uint16_t code = 1000, const std::string &reason = "")
+	{
+		if(close_sent_)
+			return cps::future<size_t>::create_shared("websocket close")->done(0);
+		close_sent_ = true;
+		std::string payload;
+		payload.reserve(2 + reason.size());
+		payload += static_cast<char>(code >> 8);
+		payload += static_cast<char>(code & 0xFF);
+		payload += reason.substr(0, 123);
+		return queue_frame(encode_frame(opcode::close, true, false, payload.data(), payload.size()));
+	}
+
+	/** Outgoing messages larger than this are sent as multiple fragments */
+	void max_frame_size(size_t n) { max_frame_size_ = n > 0 ? n : 1; }
+	/** Incoming messages larger than this will close the connection with 1009 */
+	void max_message_size(size_t n) { max_message_size_ = n; }
+
+	bool is_closed() const { return closed_; }
+
+	/**
+	 * Encodes a single client frame, masking the payload with the given key.
+	 */
+	static
+	std::shared_ptr<std::vector<char>>
+	encode_frame(
+		opcode op,
+		bool fin,
+		bool rsv1,
+		const char *data,
+		size_t len,
+		uint32_t mask_key
+	)
+	{
+		auto out = std::make_shared<std::vector<char>>();
+		out->reserve(14 + len);
+		out->push_back(static_cast<char>((fin ? 0x80 : 0x00) | (rsv1 ? 0x40 : 0x00) | static_cast<uint8_t>(op)));
+		if(len < 126) {
+			out->push_back(static_cast<char>(0x80 | len));
+		} else if(len <= 0xFFFF) {
+			out->push_back(static_cast<char>(0x80 | 126));
+			out->push_back(static_cast<char>(len >> 8));
+			out->push_back(static_cast<char>(len & 0xFF));
+		} else {
+			out->push_back(static_cast<char>(0x80 | 127));
+			for(int shift = 56; shift >= 0; shift -= 8)
+				out->push_back(static_cast<char>((static_cast<uint64_t>(len) >> shift) & 0xFF));
+		}
+		uint8_t key[4] = {
+			static_cast<uint8_t>(mask_key >> 24),
+			static_cast<uint8_t>(mask_key >> 16),
+			static_cast<uint8_t>(mask_key >> 8),
+			static_cast<uint8_t>(mask_key)
+		};
+		out->insert(out->end(), key, key + 4);
+		auto offset = out->size();
+		out->insert(out->end(), data, data + len);
+		mask(out->data() + offset, len, key);
+		return out;
+	}
+
+	/**
+	 * Applies the XOR mask in place. Works a machine word at a time, which
+	 * the compiler is free to widen further.
+	 */
+	static void
+	mask(char *data, size_t len, const uint8_t key[4])
+	{
+		uint8_t kb[8] = { key[0], key[1], key[2], key[3], key[0], key[1], key[2], key[3] };
+		uint64_t k8;
+		std::memcpy(&k8, kb, sizeof(k8));
+		size_t i = 0;
+		for(; i + 8 <= len; i += 8) {
+			uint64_t v;
+			std::memcpy(&v, data + i, sizeof(v));
+			v ^= k8;
+			std::memcpy(data + i, &v, sizeof(v));
+		}
+		for(; i < len; ++i)
+			data[i] ^= static_cast<char>(key[i & 3]);
+	}
+
+	/** A random Sec-WebSocket-Key */
+	static std::string
+	generate_key()
+	{
+		unsigned char bytes[16];
+		if(RAND_bytes(bytes, sizeof(bytes)) != 1)
+			throw std::runtime_error("RAND_bytes failed");
+		return base64(bytes, sizeof(bytes));
+	}
+
+	/**
+	 * True if the data is well-formed UTF-8: no overlong forms, surrogates
+	 * or code points past U+10FFFF, and nothing cut off at the end.
+	 */
+	static bool
+	valid_utf8(const char *data, size_t len)
+	{
+		auto p = reinterpret_cast<const uint8_t *>(data);
+		auto end = p + len;
+		while(p != end) {
+			uint8_t c = *p++;
+			if(c < 0x80)
+				continue;
+			size_t extra;
+			uint32_t cp;
+			if(c >= 0xC2 && c <= 0xDF) {
+				extra = 1;
+				cp = c & 0x1F;
+			} else if(c >= 0xE0 && c <= 0xEF) {
+				extra = 2;
+				cp = c & 0x0F;
+			} else if(c >= 0xF0 && c <= 0xF4) {
+				extra = 3;
+				cp = c & 0x07;
+			} else {
+				return false;
+			}
+			if(static_cast<size_t>(end - p) < extra)
+				return false;
+			for(size_t i = 0; i < extra; ++i) {
+				if((p[i] & 0xC0) != 0x80)
+					return false;
+				cp = (cp << 6) | (p[i] & 0x3F);
+			}
+			p += extra;
+			if(extra == 2 && (cp < 0x800 || (cp >= 0xD800 && cp <= 0xDFFF)))
+				return false;
+			if(extra == 3 && (cp < 0x10000 || cp > 0x10FFFF))
+				return false;
+		}
+		return true;
+	}
+
+	/** The Sec-WebSocket-Accept value we expect for the given key */
+	static std::string
+	accept_for(const std::string &key)
+	{
+		static const std::string guid { "258EAFA5-E914-47DA-95CA-C5AB0DC85B11" };
+		auto in = key + guid;
+		unsigned char md[EVP_MAX_MD_SIZE];
+		unsigned int len = 0;
+		if(!EVP_Digest(in.data(), in.size(), md, &len, EVP_sha1(), nullptr))
+			throw std::runtime_error("SHA1 failed");
+		return base64(md, len);
+	}
+
+public: // Signals
+	boost::signals2::signal<void(const std::string &)> on_pong;
+	boost::signals2::signal<void(uint16_t, const std::string &)> on_close;
+
+private:
+	enum class read_state {
+		header,
+		payload
+	};
+
+	/** Masking keys fetched from the CSPRNG at a time */
+	enum : size_t { key_batch = 64 };
+
+	static std::string
+	base64(const unsigned char *in, size_t len)
+	{
+		static const char *chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+		std::string out;
+		out.reserve(((len + 2) / 3) * 4);
+		size_t i = 0;
+		for(; i + 3 <= len; i += 3) {
+			uint32_t v = (in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+			out += chars[(v >> 18) & 0x3F];
+			out += chars[(v >> 12) & 0x3F];
+			out += chars[(v >> 6) & 0x3F];
+			out += chars[v & 0x3F];
+		}
+		if(i < len) {
+			uint32_t v = in[i] << 16;
+			if(i + 1 < len) v |= in[i + 1] << 8;
+			out += chars[(v >> 18) & 0x3F];
+			out += chars[(v >> 12) & 0x3F];
+			out += (i + 1 < len) ? chars[(v >> 6) & 0x3F] : '=';
+			out += '=';
+		}
+		return out;
+	}
+
+	std::shared_ptr<std::vector<char>>
+	encode_frame(opcode op, bool fin, bool rsv1, const char *data, size_t len)
+	{
+		return encode_frame(op, fin, rsv1, data, len, next_mask_key());
+	}
+
+	/**
+	 * RFC6455 wants masking keys the server can't predict, so they come
+	 * from OpenSSL's CSPRNG, a batch at a time.
+	 */
+	uint32_t
+	next_mask_key()
+	{
+		if(keys_used_ == key_batch) {
+			if(RAND_bytes(keys_, sizeof(keys_)) != 1)
+				throw std::runtime_error("RAND_bytes failed");
+			keys_used_ = 0;
+		}
+		uint32_t key;
+		std::memcpy(&key, keys_ + 4 * keys_used_++, sizeof(key));
+		return key;
+	}
+
+	std::shared_ptr<cps::future<size_t>>
+	send(opcode op, const char *data, size_t len)
+	{
+		if(close_sent_ || closed_)
+			return cps::future<size_t>::create_shared("websocket send")->fail("websocket is closing");
+
+		std::string compressed;
+		bool rsv1 = false;
+		if(deflate_.enabled && len > 0) {
+			compress(data, len, compressed);
+			data = compressed.data();
+			len = compressed.size();
+			rsv1 = true;
+		}
+
+		std::shared_ptr<cps::future<size_t>> f;
+		size_t offset = 0;
+		do {
+			auto n = std::min(len - offset, max_frame_size_);
+			f = queue_frame(encode_frame(
+				offset == 0 ? op : opcode::continuation,
+				offset + n == len,
+				rsv1 && offset == 0,
+				data + offset,
+				n
+			));
+			offset += n;
+		} while(offset < len);
+		return f;
+	}
+
+	/** Compresses a whole message, leaving off the trailing 00 00 ff ff */
+	void
+	compress(const char *data, size_t len, std::string &out)
+	{
+		deflate_stream_.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+		deflate_stream_.avail_in = static_cast<uInt>(len);
+		size_t pos = 0;
+		do {
+			out.resize(pos + len / 2 + 64);
+			deflate_stream_.next_out = reinterpret_cast<Bytef *>(&out[pos]);
+			deflate_stream_.avail_out = static_cast<uInt>(out.size() - pos);
+			if(deflate(&deflate_stream_, Z_SYNC_FLUSH) == Z_STREAM_ERROR)
+				throw std::runtime_error("deflate failed");
+			pos = out.size() - deflate_stream_.avail_out;
+		} while(deflate_stream_.avail_out == 0);
+		out.resize(pos);
+		if(out.size() >= 4 && out.compare(out.size() - 4, 4, "\x00\x00\xff\xff", 4) == 0)
+			out.resize(out.size() - 4);
+		if(deflate_.client_no_context_takeover)
+			deflateReset(&deflate_stream_);
+	}
+
+	/** Decompresses the current message in place */
+	bool
+	decompress()
+	{
+		message_.append("\x00\x00\xff\xff", 4);
+		std::string out;
+		inflate_stream_.next_in = reinterpret_cast<Bytef *>(&message_[0]);
+		inflate_stream_.avail_in = static_cast<uInt>(message_.size());
+		size_t pos = 0;
+		/* A server may finish the deflate stream with each message */
+		bool ended = false;
+		do {
+			out.resize(pos + std::max<size_t>(message_.size() * 4, 1024));
+			inflate_stream_.next_out = reinterpret_cast<Bytef *>(&out[pos]);
+			inflate_stream_.avail_out = static_cast<uInt>(out.size() - pos);
+			auto rc = inflate(&inflate_stream_, Z_SYNC_FLUSH);
+			if(rc == Z_STREAM_END)
+				ended = true;
+			else if(rc != Z_OK && rc != Z_BUF_ERROR)
+				return false;
+			pos = out.size() - inflate_stream_.avail_out;
+			if(pos > max_message_size_)
+				return false;
+		} while(!ended && inflate_stream_.avail_out == 0);
+		out.resize(pos);
+		message_.swap(out);
+		if(ended || deflate_.server_no_context_takeover)
+			inflateReset(&inflate_stream_);
+		return true;
+	}
+
+	/**
+	 * Frames are written one at a time, so that concurrent sends
+	 * don't interleave on the wire.
+	 */
+	std::shared_ptr<cps::future<size_t>>
+	queue_frame(std::shared_ptr<std::vector<char>> frame)
+	{
+		auto f = cps::future<size_t>::create_shared("websocket write");
+		outgoing_.emplace(std::move(frame), f);
+		write_next();
+		return f;
+	}
+
+	void
+	write_next()
+	{
+		if(writing_ || outgoing_.empty())
+			return;
+		writing_ = true;
+		auto next = outgoing_.front();
+		outgoing_.pop();
+		auto self = shared_from_this();
+		conn_->write(next.first)->on_done([self, next](size_t bytes) {
+			self->writing_ = false;
+			next.second->done(bytes);
+			self->write_next();
+		})->on_fail([self, next](const std::string &err) {
+			self->writing_ = false;
+			next.second->fail(err);
+			self->closed(1006, err);
+		});
+	}
+
+	void
+	read_frames()
+	{
+		auto self = shared_from_this();
+		while(!paused_ && !closed_) {
+			auto b = in_->data();
+			auto p = reinterpret_cast<const uint8_t *>(boost::asio::buffer_cast<const char *>(b));
+			auto available = boost::asio::buffer_size(b);
+			if(state_ == read_state::header) {
+				if(available < 2)
+					break;
+				size_t header = 2;
+				uint64_t len = p[1] & 0x7F;
+				if(len == 126) header += 2;
+				else if(len == 127) header += 8;
+				if(available < header)
+					break;
+				if(len == 126) {
+					len = (static_cast<uint64_t>(p[2]) << 8) | p[3];
+				} else if(len == 127) {
+					len = 0;
+					for(size_t i = 0; i < 8; ++i)
+						len = (len << 8) | p[2 + i];
+				}
+				fin_ = (p[0] & 0x80) != 0;
+				rsv1_ = (p[0] & 0x40) != 0;
+				op_ = static_cast<opcode>(p[0] & 0x0F);
+				bool masked = (p[1] & 0x80) != 0;
+				bool reserved = (p[0] & 0x30) != 0;
+				in_->consume(header);
+
+				if(masked)
+					return fail(1002, "masked frame from server");
+				if(reserved || (rsv1_ && !deflate_.enabled))
+					return fail(1002, "unexpected reserved bits");
+				if(is_control(op_)) {
+					if(!fin_ || len > 125 || rsv1_)
+						return fail(1002, "invalid control frame");
+					control_.clear();
+				} else if(op_ == opcode::continuation) {
+					if(!in_message_ || rsv1_)
+						return fail(1002, "unexpected continuation frame");
+				} else if(op_ == opcode::text || op_ == opcode::binary) {
+					if(in_message_)
+						return fail(1002, "expected continuation frame");
+					in_message_ = true;
+					message_op_ = op_;
+					compressed_ = rsv1_;
+					message_.clear();
+				} else {
+					return fail(1002, "unknown opcode");
+				}
+				if(!is_control(op_) && message_.size() + len > max_message_size_)
+					return fail(1009, "message too large");
+				remaining_ = static_cast<size_t>(len);
+				state_ = read_state::payload;
+			} else {
+				auto n = std::min(available, remaining_);
+				auto data = reinterpret_cast<const char *>(p);
+				(is_control(op_) ? control_ : message_).append(data, n);
+				in_->consume(n);
+				remaining_ -= n;
+				if(remaining_ > 0)
+					break;
+				state_ = read_state::header;
+				frame_complete();
+			}
+		}
+		if(paused_ || closed_)
+			return;
+
+		conn_->fill()->on_done([self](size_t) {
+			self->read_frames();
+		})->on_fail([self](const std::string &err) {
+			self->closed(1006, err);
+		});
+	}
+
+	static bool is_control(opcode op) { return static_cast<uint8_t>(op) & 0x08; }
+
+	void
+	frame_complete()
+	{
+		switch(op_) {
+		case opcode::ping:
+			queue_frame(encode_frame(opcode::pong, true, false, control_.data(), control_.size()));
+			return;
+		case opcode::pong:
+			on_pong(control_);
+			return;
+		case opcode::close: {
+			uint16_t code = 1005;
+			std::string reason;
+			if(control_.size() >= 2) {
+				code = static_cast<uint16_t>((static_cast<uint8_t>(control_[0]) << 8) | static_cast<uint8_t>(control_[1]));
+				reason = control_.substr(2);
+			}
+			if(!valid_utf8(reason.data(), reason.size()))
+				return fail(1007, "invalid UTF-8 in close reason");
+			if(close_sent_) {
+				closed(code, reason);
+			} else {
+				/* Echo the close, then drop the connection once that's gone out */
+				auto self = shared_from_this();
+				close(code == 1005 ? 1000 : code)->on_ready([self, code, reason](cps::future<size_t> &) {
+					self->closed(code, reason);
+				});
+				paused_ = true;
+			}
+			return;
+		}
+		default:
+			break;
+		}
+
+		if(!fin_)
+			return;
+
+		in_message_ = false;
+		if(compressed_ && !decompress())
+			return fail(1007, "invalid compressed message");
+		if(message_op_ == opcode::text && !valid_utf8(message_.data(), message_.size()))
+			return fail(1007, "invalid UTF-8 in text message");
+
+		auto r = source_->data(message_);
+		if(r && *r && !(*r)->is_ready()) {
+			paused_ = true;
+			auto self = shared_from_this();
+			(*r)->on_ready([self](cps::future<int> &) {
+				self->paused_ = false;
+				self->read_frames();
+			});
+		}
+	}
+
+	/** Protocol error: tell the server why, then drop the connection */
+	void
+	fail(uint16_t code, const std::string &reason)
+	{
+		auto self = shared_from_this();
+		paused_ = true;
+		if(close_sent_) {
+			closed(code, reason);
+			return;
+		}
+		close(code, reason)->on_ready([self, code, reason](cps::future<size_t> &) {
+			self->closed(code, reason);
+		});
+	}
+
+	void
+	closed(uint16_t code, const std::string &reason)
+	{
+		if(closed_)
+			return;
+		closed_ = true;
+		conn_->close();
+		on_close(code, reason);
+	}
+
+	std::shared_ptr<connection> conn_;
+	std::shared_ptr<boost::asio::streambuf> in_;
+	std::shared_ptr<net::source<uint8_t>> source_;
+	deflate_options deflate_;
+	z_stream deflate_stream_;
+	z_stream inflate_stream_;
+	/** Masking keys from the last RAND_bytes call, and how many we've used */
+	uint8_t keys_[4 * key_batch];
+	size_t keys_used_;
+	size_t max_frame_size_;
+	size_t max_message_size_;
+
+	/** Frames waiting to be written, and the futures to resolve once they are */
+	std::queue<
+		std::pair<
+			std::shared_ptr<std::vector<char>>,
+			std::shared_ptr<cps::future<size_t>>
+		>
+	> outgoing_;
+
+	read_state state_;
+	/** Set while a message handler is still busy, or once we're closing */
+	bool paused_;
+	bool writing_;
+	bool close_sent_;
+	bool closed_;
+
+	/** Current frame */
+	opcode op_;
+	bool fin_;
+	bool rsv1_;
+	size_t remaining_;
+
+	/** Current message, which may span several frames */
+	bool in_message_;
+	opcode message_op_;
+	bool compressed_;
+	std::string message_;
+	/** Payload of the current control frame */
+	std::string control_;
+};
+
+};
+};
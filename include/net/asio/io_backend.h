@@ -0,0 +1,58 @@
+#pragma once
+#include <boost/version.hpp>
+#include <boost/asio/detail/config.hpp>
+
+/**
+ * Socket I/O backend selection.
+ *
+ * Everything here does its I/O through Asio, so the backend is whichever
+ * one Asio was built to use - epoll on Linux by default. Building with
+ * -DUSE_IO_URING=ON switches every TCP and UDP socket operation (HTTP
+ * transports, net::asio::tcp::stream, statsd) over to io_uring instead,
+ * which batches submissions and completions through shared rings rather
+ * than making a syscall per readiness check, read and write.
+ *
+ * That needs both halves defined for every translation unit, which the
+ * CMake option takes care of:
+ *
+ *     BOOST_ASIO_HAS_IO_URING   use io_uring for socket and file I/O
+ *     BOOST_ASIO_DISABLE_EPOLL  ... rather than only for file I/O
+ *
+ * The public API is the same either way.
+ */
+
+#if defined(BOOST_ASIO_HAS_IO_URING)
+#  if BOOST_VERSION < 107800
+#    error "io_uring support needs Boost 1.78 or later"
+#  endif
+#  if !defined(__linux__)
+#    error "io_uring is only available on Linux"
+#  endif
+#  if !defined(BOOST_ASIO_DISABLE_EPOLL)
+#    error "BOOST_ASIO_HAS_IO_URING without BOOST_ASIO_DISABLE_EPOLL only covers file I/O - define both, or use -DUSE_IO_URING=ON"
+#  endif
+#endif
+
+namespace net {
+namespace asio {
+
+/** Name of the reactor Asio is using for socket I/O, for logging and benchmarks */
+inline
+const char *
+io_backend()
+{
+#if defined(BOOST_ASIO_HAS_IO_URING) && defined(BOOST_ASIO_DISABLE_EPOLL)
+	return "io_uring";
+#elif defined(BOOST_ASIO_HAS_EPOLL)
+	return "epoll";
+#elif defined(BOOST_ASIO_HAS_KQUEUE)
+	return "kqueue";
+#elif defined(BOOST_ASIO_HAS_IOCP)
+	return "iocp";
+#else
+	return "select";
+#endif
+}
+
+};
+};
@@ -0,0 +1,172 @@
+#pragma once
+#include <cstddef>
+#include <boost/asio.hpp>
+#include <boost/log/trivial.hpp>
+
+#if defined(__linux__)
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+namespace net {
+namespace asio {
+
+namespace detail {
+
+/**
+ * An integer TCP-level socket option, for the ones Asio doesn't wrap.
+ */
+template<int Level, int Name>
+class int_option {
+public:
+	explicit int_option(int v):value_{ v } { }
+
+	template<typename Protocol> int level(const Protocol &) const { return Level; }
+	template<typename Protocol> int name(const Protocol &) const { return Name; }
+	template<typename Protocol> const int *data(const Protocol &) const { return &value_; }
+	template<typename Protocol> std::size_t size(const Protocol &) const { return sizeof(value_); }
+
+private:
+	int value_;
+};
+
+};
+
+/**
+ * Options to set on each new TCP socket.
+ *
+ * Anything left at zero or false keeps the system default, apart from
+ * nodelay: our requests are small writes which Nagle would otherwise hold
+ * back waiting for the previous ACK, so that's on unless turned off.
+ *
+ * Options which the platform doesn't support are skipped silently.
+ */
+struct socket_options {
+	socket_options(
+	):nodelay{ true },
+	  keepalive{ false },
+	  keepalive_idle{ 0 },
+	  keepalive_interval{ 0 },
+	  keepalive_count{ 0 },
+	  send_buffer{ 0 },
+	  receive_buffer{ 0 },
+	  quickack{ false },
+	  user_timeout{ 0 },
+	  fast_open{ false }
+	{
+	}
+
+	/** TCP_NODELAY */
+	bool nodelay;
+	/** SO_KEEPALIVE */
+	bool keepalive;
+	/** Seconds idle before the first keepalive probe (Linux) */
+	int keepalive_idle;
+	/** Seconds between keepalive probes (Linux) */
+	int keepalive_interval;
+	/** Unanswered probes before the connection is dropped (Linux) */
+	int keepalive_count;
+	/** SO_SNDBUF in bytes. Set before connecting so window scaling takes it into account. */
+	int send_buffer;
+	/** SO_RCVBUF in bytes */
+	int receive_buffer;
+	/** TCP_QUICKACK (Linux). The kernel may turn this off again later, so it's best-effort. */
+	bool quickack;
+	/** TCP_USER_TIMEOUT in milliseconds: how long sent data may go unacknowledged (Linux) */
+	unsigned int user_timeout;
+	/**
+	 * TCP_FASTOPEN_CONNECT (Linux 4.11+). The connect completes at once and
+	 * the SYN goes out with our first write, saving a round trip on new
+	 * connections to servers we've talked to before.
+	 *
+	 * Since the connect no longer waits for the handshake, there is
+	 * nothing to race or time: connections which race several addresses
+	 * (see happy_eyeballs) leave this off, or the first address tried
+	 * would always win. With a single address it stays on, and that
+	 * address's connect latency as seen by http::address_balancer is just
+	 * the local setup time.
+	 */
+	bool fast_open;
+
+	/**
+	 * Applies the options to an open socket which hasn't connected yet.
+	 * Carries on past failures, reporting the first one in ec.
+	 */
+	template<typename Socket>
+	void
+	apply(Socket &sock, boost::system::error_code &ec) const
+	{
+		ec = boost::system::error_code { };
+		apply_each(sock, [&ec](const char *, const boost::system::error_code &e) {
+			if(!ec)
+				ec = e;
+		});
+	}
+
+	/**
+	 * Applies the options, logging a warning for each one that fails.
+	 * For connect paths which have nowhere to report the error but
+	 * shouldn't let a mistyped option go unnoticed.
+	 */
+	template<typename Socket>
+	void
+	apply_or_warn(Socket &sock) const
+	{
+		apply_each(sock, [](const char *name, const boost::system::error_code &e) {
+			BOOST_LOG_TRIVIAL(warning) << "Could not set socket option " << name << ": " << e.message();
+		});
+	}
+
+	/** A copy for connecting to the given number of candidate addresses */
+	socket_options
+	for_candidates(size_t n) const
+	{
+		auto out = *this;
+		if(n > 1)
+			out.fast_open = false;
+		return out;
+	}
+
+private:
+	/** Sets each option, calling failed(name, ec) for any the socket refuses */
+	template<typename Socket, typename F>
+	void
+	apply_each(Socket &sock, F failed) const
+	{
+		auto set = [&sock, &failed](const char *name, const auto &opt) {
+			boost::system::error_code e;
+			sock.set_option(opt, e);
+			if(e)
+				failed(name, e);
+		};
+		if(nodelay)
+			set("TCP_NODELAY", boost::asio::ip::tcp::no_delay(true));
+		if(keepalive)
+			set("SO_KEEPALIVE", boost::asio::socket_base::keep_alive(true));
+		if(send_buffer > 0)
+			set("SO_SNDBUF", boost::asio::socket_base::send_buffer_size(send_buffer));
+		if(receive_buffer > 0)
+			set("SO_RCVBUF", boost::asio::socket_base::receive_buffer_size(receive_buffer));
+#if defined(__linux__)
+		if(keepalive && keepalive_idle > 0)
+			set("TCP_KEEPIDLE", detail::int_option<IPPROTO_TCP, TCP_KEEPIDLE>(keepalive_idle));
+		if(keepalive && keepalive_interval > 0)
+			set("TCP_KEEPINTVL", detail::int_option<IPPROTO_TCP, TCP_KEEPINTVL>(keepalive_interval));
+		if(keepalive && keepalive_count > 0)
+			set("TCP_KEEPCNT", detail::int_option<IPPROTO_TCP, TCP_KEEPCNT>(keepalive_count));
+		if(quickack)
+			set("TCP_QUICKACK", detail::int_option<IPPROTO_TCP, TCP_QUICKACK>(1));
+#if defined(TCP_USER_TIMEOUT)
+		if(user_timeout > 0)
+			set("TCP_USER_TIMEOUT", detail::int_option<IPPROTO_TCP, TCP_USER_TIMEOUT>(static_cast<int>(user_timeout)));
+#endif
+#if defined(TCP_FASTOPEN_CONNECT)
+		if(fast_open)
+			set("TCP_FASTOPEN_CONNECT", detail::int_option<IPPROTO_TCP, TCP_FASTOPEN_CONNECT>(1));
+#endif
+#endif
+	}
+};
+
+};
+};
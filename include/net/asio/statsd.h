@@ -1,10 +1,25 @@
 #pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <initializer_list>
 #include <memory>
+#include <mutex>
+#include <random>
 #include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include <cps/future.h>
 
 #include <boost/asio.hpp>
+#include <boost/asio/high_resolution_timer.hpp>
+
+#include <net/asio/io_backend.h>
+#include <net/asio/udp_batch.h>
 
 namespace net {
 namespace statsd {
@@ -29,6 +44,113 @@ private:
 	uint16_t port_;
 };
 
+/**
+ * A set of DogStatsD tags, serialised once into the "|#k:v,k2:v2" block
+ * that follows the type on the wire.
+ *
+ * Sets are interned: building the same tags twice gives two handles on
+ * one shared, immutable block, so they're cheap to copy, cheap to compare
+ * and cost nothing further to send. Build one per combination of
+ * dimensions up front - per endpoint and status, say - and reuse it on
+ * the hot path rather than describing the tags on each call.
+ *
+ * Characters that would break the line format (',', '|', '#', newlines)
+ * are replaced by '_'.
+ */
+class tag_set {
+public:
+	using tag = std::pair<std::string, std::string>;
+
+	/** No tags at all */
+	tag_set():block_{ empty_block() } { }
+
+	/** Tags as key/value pairs; an empty value gives a bare "key" tag */
+	tag_set(std::initializer_list<tag> tags):tag_set(std::vector<tag>(tags)) { }
+
+	explicit
+	tag_set(const std::vector<tag> &tags)
+	{
+		std::string wire;
+		for(const auto &t : tags) {
+			wire += wire.empty() ? "|#" : ",";
+			append_clean(wire, t.first);
+			if(!t.second.empty()) {
+				wire += ':';
+				append_clean(wire, t.second);
+			}
+		}
+		block_ = intern(wire);
+	}
+
+	/** This set with another tag added on the end */
+	tag_set
+	with(const std::string &k, const std::string &v = "") const
+	{
+		std::string wire = *block_;
+		wire += wire.empty() ? "|#" : ",";
+		append_clean(wire, k);
+		if(!v.empty()) {
+			wire += ':';
+			append_clean(wire, v);
+		}
+		return tag_set { intern(wire) };
+	}
+
+	/** The serialised block, including the leading "|#", or empty if there are no tags */
+	const std::string &wire() const { return *block_; }
+	bool empty() const { return block_->empty(); }
+
+	/** Interned, so equal sets share a block */
+	bool operator==(const tag_set &other) const { return block_ == other.block_; }
+	bool operator!=(const tag_set &other) const { return block_ != other.block_; }
+
+private:
+	explicit tag_set(std::shared_ptr<const std::string> block):block_(std::move(block)) { }
+
+	static
+	void
+	append_clean(std::string &out, const std::string &in)
+	{
+		for(auto c : in) {
+			switch(c) {
+			case ',': case '|': case '#': case '\n': case '\r':
+				out += '_';
+				break;
+			default:
+				out += c;
+			}
+		}
+	}
+
+	static
+	std::shared_ptr<const std::string>
+	empty_block()
+	{
+		static auto empty = std::make_shared<const std::string>();
+		return empty;
+	}
+
+	/** The one shared block for this serialisation */
+	static
+	std::shared_ptr<const std::string>
+	intern(const std::string &wire)
+	{
+		if(wire.empty())
+			return empty_block();
+		static std::mutex mutex;
+		static std::unordered_map<std::string, std::shared_ptr<const std::string>> blocks;
+		std::lock_guard<std::mutex> guard { mutex };
+		auto it = blocks.find(wire);
+		if(it != blocks.end())
+			return it->second;
+		auto block = std::make_shared<const std::string>(wire);
+		blocks.emplace(wire, block);
+		return block;
+	}
+
+	std::shared_ptr<const std::string> block_;
+};
+
 class client:public std::enable_shared_from_this<client> {
 public:
 
@@ -43,8 +165,69 @@ public:
 
 	client(
 		boost::asio::io_service &service
-	):service_( service )
+	):service_( service ),
+	  payload_{ 0 },
+	  interval_{ std::chrono::milliseconds(100) },
+	  timer_{ service },
+	  timer_armed_{ false },
+	  batch_count_{ 0 },
+	  sending_{ false }
+	{
+	}
+
+	/** Largest payload that fits a 1500-byte Ethernet frame along with IPv6 and UDP headers */
+	static size_t standard_payload() { return 1432; }
+	/** ... and for 9000-byte jumbo frames */
+	static size_t jumbo_payload() { return 8932; }
+
+	/**
+	 * Packs metrics into newline-separated datagrams of up to payload bytes
+	 * rather than sending one datagram each. A datagram goes out once the
+	 * next metric would not fit, or interval after its first metric,
+	 * whichever comes first. Metrics in the same datagram share a future,
+	 * which resolves to the number of metrics in it once it has been sent.
+	 * Datagrams filled in quick succession go to the kernel together, in
+	 * as few sendmmsg() calls as possible - see net::asio::udp_batch.
+	 *
+	 * A payload of 0 turns batching off again, sending anything pending.
+	 */
+	client &
+	batching(
+		size_t payload = standard_payload(),
+		std::chrono::milliseconds interval = std::chrono::milliseconds(100)
+	)
+	{
+		if(payload == 0)
+			flush();
+		payload_ = payload;
+		interval_ = interval;
+		return *this;
+	}
+	size_t batch_payload() const { return payload_; }
+
+	/**
+	 * Sends any metrics waiting for a batch to fill. Resolves to the number
+	 * of metrics sent, which is 0 if there were none.
+	 */
+	std::shared_ptr<cps::future<int>>
+	flush()
 	{
+		if(batch_.empty())
+			return cps::future<int>::create_shared()->done(0);
+		outbox_.push_back(outgoing { std::string { }, batch_f_, static_cast<int>(batch_count_) });
+		outbox_.back().data.swap(batch_);
+		auto f = batch_f_;
+		batch_f_.reset();
+		batch_count_ = 0;
+		/* Anything else flushed before we get round to it goes in the same
+		 * sendmmsg() call
+		 */
+		if(!sending_) {
+			sending_ = true;
+			auto self = shared_from_this();
+			service_.post([self]() { self->send_outbox(); });
+		}
+		return f;
 	}
 
 virtual ~client() { }
@@ -98,16 +281,158 @@ virtual ~client() { }
 	std::shared_ptr<cps::future<int>> inc(const std::string &k) { return delta(k, 1); }
 	std::shared_ptr<cps::future<int>> dec(const std::string &k) { return delta(k, -1); }
 
-protected:
+	/** As above, with tags */
+	std::shared_ptr<cps::future<int>> timing(const std::string &k, float v, const tag_set &t) { return send(k, std::to_string(static_cast<uint64_t>(1000.0f * v)) + "|ms" + t.wire()); }
+	std::shared_ptr<cps::future<int>> gauge(const std::string &k, int64_t v, const tag_set &t) { return send(k, std::to_string(v) + "|g" + t.wire()); }
+	std::shared_ptr<cps::future<int>> delta(const std::string &k, int64_t v, const tag_set &t) { return send(k, std::to_string(v) + "|c" + t.wire()); }
+	std::shared_ptr<cps::future<int>> inc(const std::string &k, const tag_set &t) { return delta(k, 1, t); }
+	std::shared_ptr<cps::future<int>> dec(const std::string &k, const tag_set &t) { return delta(k, -1, t); }
+
+	/**
+	 * Sends a preformatted "value|type" for the given key, for types the
+	 * helpers above don't cover.
+	 */
 	std::shared_ptr<cps::future<int>>
 	send(const std::string &k, std::string v)
 	{
 		size_t len = k.size() + v.size() + 1;
+		if(payload_ > 0)
+			return queue(k, v, len);
 		auto data = std::make_shared<std::vector<char>>();
 		std::copy(begin(k), end(k), back_inserter(*data));
 		data->emplace_back(':');
 		std::copy(begin(v), end(v), back_inserter(*data));
 		assert(data->size() == len);
+		return send_datagram(data, len);
+	}
+
+	/**
+	 * Sends a complete line, "key:value|type" and anything after it. The
+	 * data is copied before this returns, so the caller can reuse its
+	 * buffer straight away. There's no future to watch: this is for
+	 * callers which have already done their own formatting and want as
+	 * little overhead as possible.
+	 */
+	void
+	send_line(const char *line, size_t len)
+	{
+		if(payload_ > 0) {
+			begin_line(len);
+			batch_.append(line, len);
+			end_line();
+			return;
+		}
+		auto data = std::make_shared<std::vector<char>>(line, line + len);
+		send_datagram(data, len);
+	}
+
+protected:
+	/** Adds a line to the current batch, sending what we have first if it won't fit */
+	std::shared_ptr<cps::future<int>>
+	queue(const std::string &k, const std::string &v, size_t len)
+	{
+		auto f = begin_line(len);
+		batch_ += k;
+		batch_ += ':';
+		batch_ += v;
+		end_line();
+		return f;
+	}
+
+	/** Makes room in the batch for a line of len bytes, returning the future for the batch it will go in */
+	std::shared_ptr<cps::future<int>>
+	begin_line(size_t len)
+	{
+		if(!batch_.empty() && batch_.size() + 1 + len > payload_)
+			flush();
+		if(batch_.empty()) {
+			batch_.reserve(std::max(payload_, len));
+			batch_f_ = cps::future<int>::create_shared();
+		} else {
+			batch_ += '\n';
+		}
+		return batch_f_;
+	}
+
+	/** Counts the line just added, sending the batch if it's full */
+	void
+	end_line()
+	{
+		++batch_count_;
+		if(batch_.size() >= payload_)
+			flush();
+		else if(!timer_armed_)
+			arm_timer();
+	}
+
+	void
+	arm_timer()
+	{
+		auto self = shared_from_this();
+		timer_armed_ = true;
+		timer_.expires_from_now(interval_);
+		timer_.async_wait([self](const boost::system::error_code &) {
+			self->timer_armed_ = false;
+			self->flush();
+		});
+	}
+
+	/**
+	 * Sends every datagram waiting in the outbox, as many per system call
+	 * as the socket will take, and waits for it to be writable if it fills.
+	 */
+	void
+	send_outbox()
+	{
+		while(!outbox_.empty()) {
+			auto n = std::min(outbox_.size(), udp_.max_datagrams());
+			buffers_.clear();
+			for(size_t i = 0; i < n; ++i)
+				buffers_.push_back(boost::asio::buffer(outbox_[i].data));
+			boost::system::error_code ec;
+			auto sent = udp_.send(*socket_, target_, buffers_.data(), n, ec);
+			for(size_t i = 0; i < sent; ++i)
+				complete_front(boost::system::error_code { });
+			if(ec == boost::asio::error::would_block || ec == boost::asio::error::try_again) {
+				auto self = shared_from_this();
+				socket_->async_wait(
+					boost::asio::ip::udp::socket::wait_write,
+					[self](const boost::system::error_code &ec) {
+						if(!ec) {
+							self->send_outbox();
+							return;
+						}
+						while(!self->outbox_.empty())
+							self->complete_front(ec);
+						self->sending_ = false;
+					}
+				);
+				return;
+			}
+			/* Anything else only affects this datagram, so report it and carry on */
+			if(ec)
+				complete_front(ec);
+		}
+		sending_ = false;
+	}
+
+	/** Takes the first datagram off the outbox and resolves its future */
+	void
+	complete_front(const boost::system::error_code &ec)
+	{
+		auto out = std::move(outbox_.front());
+		outbox_.pop_front();
+		if(ec)
+			out.f->fail(ec.message());
+		else
+			out.f->done(out.count);
+	}
+
+	/** Sends the first len bytes of data as a single datagram */
+	template<typename Container>
+	std::shared_ptr<cps::future<int>>
+	send_datagram(const std::shared_ptr<Container> &data, size_t len)
+	{
 		auto f = cps::future<int>::create_shared();
 		socket_->async_send_to(
 			boost::asio::buffer(*data, len),
@@ -132,31 +457,192 @@ private:
 	boost::asio::io_service &service_;
 	std::shared_ptr<boost::asio::ip::udp::socket> socket_;
 	boost::asio::ip::udp::endpoint target_;
+	/** Maximum datagram payload when batching, 0 if we're not */
+	size_t payload_;
+	/** Longest a metric waits for its batch to fill */
+	std::chrono::milliseconds interval_;
+	boost::asio::high_resolution_timer timer_;
+	bool timer_armed_;
+	/** Lines waiting to go out, and the future they share */
+	std::string batch_;
+	std::shared_ptr<cps::future<int>> batch_f_;
+	size_t batch_count_;
+	/** Full batches waiting to be sent */
+	struct outgoing {
+		std::string data;
+		std::shared_ptr<cps::future<int>> f;
+		int count;
+	};
+	std::deque<outgoing> outbox_;
+	bool sending_;
+	net::asio::udp_batch udp_;
+	std::vector<boost::asio::const_buffer> buffers_;
+};
+
+enum class metric_type {
+	counter,
+	gauge,
+	timer,
+	histogram,
+	meter
+};
+
+namespace detail {
+
+/** Wire suffix for each type */
+inline
+const char *
+type_suffix(metric_type t)
+{
+	switch(t) {
+	case metric_type::counter: return "|c";
+	case metric_type::gauge: return "|g";
+	case metric_type::timer: return "|ms";
+	case metric_type::histogram: return "|h";
+	case metric_type::meter: return "|m";
+	}
+	return "";
+}
+
+/**
+ * Writes v in decimal ending just before out, returning the start. Needs
+ * 20 bytes of room below out.
+ */
+inline
+char *
+format_int(int64_t v, char *out)
+{
+	/* Negate as unsigned so INT64_MIN doesn't overflow */
+	uint64_t u = v < 0 ? 0 - static_cast<uint64_t>(v) : static_cast<uint64_t>(v);
+	do {
+		*--out = static_cast<char>('0' + u % 10);
+		u /= 10;
+	} while(u > 0);
+	if(v < 0)
+		*--out = '-';
+	return out;
+}
+
+/**
+ * xorshift64* - a few cycles per number, good enough for deciding whether
+ * to keep a sample. One per thread, so there's nothing shared to contend
+ * on.
+ */
+inline
+uint64_t
+fast_random()
+{
+	static thread_local uint64_t state = [] {
+		std::random_device rd;
+		uint64_t seed = (static_cast<uint64_t>(rd()) << 32) ^ rd();
+		return seed ? seed : 0x9E3779B97F4A7C15ull;
+	}();
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * 0x2545F4914F6CDD1Dull;
+}
+
 };
 
-#if 0
+/**
+ * A handle for sending one metric, with everything that doesn't change
+ * between calls worked out up front.
+ *
+ * The line is kept in a buffer that's reused for every send: the key and
+ * ':' stay in place at the front, and each send writes the new value
+ * after them and copies in the preformatted type, sample-rate and tag suffix,
+ * then hands the line to client::send_line(). Nothing is allocated once
+ * the buffer has grown to fit.
+ *
+ * With a sample rate below 1 only that fraction of calls is sent, along
+ * with "|@rate" so the server can scale counters back up. Calls that
+ * aren't sampled return after a single thread-local random number.
+ *
+ * Like the client, a handle should only be used on the io_service thread.
+ */
 class key {
 public:
-	void
-	operator=(size_t v) {
-		statsd_.gauge(key_, v);
+	key(
+		std::shared_ptr<client> c,
+		const std::string &name,
+		metric_type type = metric_type::counter,
+		double sample_rate = 1.0,
+		const tag_set &tags = tag_set { }
+	):client_(std::move(c)),
+	  type_{ type },
+	  rate_{ sample_rate },
+	  tags_(tags),
+	  threshold_{ sample_threshold(sample_rate) },
+	  prefix_{ name.size() + 1 }
+	{
+		line_.reserve(prefix_ + 32);
+		line_.assign(name);
+		line_ += ':';
+		suffix_ = detail::type_suffix(type);
+		if(rate_ < 1.0) {
+			char rate[32];
+			std::snprintf(rate, sizeof(rate), "|@%g", rate_);
+			suffix_ += rate;
+		}
+		suffix_ += tags_.wire();
 	}
 
+	/** Sets a gauge, records a timer/histogram value, or adds to a counter */
 	void
-	operator++() {
-		statsd_.inc(key_);
+	record(int64_t v)
+	{
+		if(threshold_ != all() && detail::fast_random() >= threshold_)
+			return;
+		char digits[24];
+		auto end = digits + sizeof(digits);
+		auto start = detail::format_int(v, end);
+		line_.resize(prefix_);
+		line_.append(start, end - start);
+		line_ += suffix_;
+		client_->send_line(line_.data(), line_.size());
 	}
 
-	void
-	operator--() {
-		statsd_.inc(key_);
-	}
+	/** Records a duration in seconds, sent as whole milliseconds like client::timing() */
+	void timing(float seconds) { record(static_cast<int64_t>(1000.0f * seconds)); }
+
+	key &operator=(int64_t v) { record(v); return *this; }
+	key &operator+=(int64_t v) { record(v); return *this; }
+	key &operator-=(int64_t v) { record(-v); return *this; }
+	key &operator++() { record(1); return *this; }
+	key &operator--() { record(-1); return *this; }
+
+	std::string name() const { return line_.substr(0, prefix_ - 1); }
+	metric_type type() const { return type_; }
+	double sample_rate() const { return rate_; }
+	const tag_set &tags() const { return tags_; }
 
 private:
-	statsd &statsd_;
-	std::string key_;
+	static uint64_t all() { return ~uint64_t { 0 }; }
+
+	/** Calls are sent when a random 64-bit value falls below this */
+	static
+	uint64_t
+	sample_threshold(double rate)
+	{
+		if(rate >= 1.0)
+			return all();
+		if(rate <= 0.0)
+			return 0;
+		return static_cast<uint64_t>(rate * 18446744073709551616.0);
+	}
+
+	std::shared_ptr<client> client_;
+	metric_type type_;
+	double rate_;
+	tag_set tags_;
+	uint64_t threshold_;
+	/** Length of "key:" at the start of line_ */
+	size_t prefix_;
+	/** Type, sample rate and tags, appended after the value */
+	std::string suffix_;
+	std::string line_;
 };
-#endif
 
 };
 };
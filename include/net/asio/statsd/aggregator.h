@@ -0,0 +1,170 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/asio/high_resolution_timer.hpp>
+
+#include <net/asio/statsd.h>
+#include <net/asio/statsd/sketch.h>
+
+namespace net {
+namespace statsd {
+
+/**
+ * Collects metrics locally and sends a summary of each key once per
+ * interval, rather than a line per call.
+ *
+ * Counters are summed, gauges keep their latest value, and timings go
+ * into a statsd::sketch per key, so a key costs the same few kilobytes
+ * however many timings it sees. The flush sends each timing key's count,
+ * min, max and mean, which are exact, and the configured percentiles,
+ * which are within 1% of the true value. Emitted names for timings are
+ * the key with a suffix - "api.latency.p99", "api.latency.count" and so
+ * on - all as gauges in milliseconds apart from the count, which is a
+ * counter.
+ *
+ * Keys that saw nothing during an interval are not sent at all. For a
+ * busy service this turns hundreds of thousands of packets a second into
+ * a few per key per interval, and works best with client::batching()
+ * enabled so that the flush itself goes out in full datagrams.
+ *
+ * Everything here runs on the io_service thread, like the client itself.
+ * Must be held in a std::shared_ptr.
+ */
+class aggregator : public std::enable_shared_from_this<aggregator> {
+public:
+	static
+	std::shared_ptr<aggregator>
+	create(
+		boost::asio::io_service &service,
+		std::shared_ptr<client> target,
+		std::chrono::milliseconds interval = std::chrono::seconds(10)
+	)
+	{
+		auto a = std::make_shared<aggregator>(service, std::move(target), interval);
+		a->arm_timer();
+		return a;
+	}
+
+	aggregator(
+		boost::asio::io_service &service,
+		std::shared_ptr<client> target,
+		std::chrono::milliseconds interval
+	):client_(std::move(target)),
+	  interval_(interval),
+	  timer_(service),
+	  percentiles_{ 50.0, 90.0, 99.0 }
+	{
+	}
+
+	/** Anything recorded since the last interval is sent on the way out */
+	virtual ~aggregator() {
+		flush();
+	}
+
+	/** Percentiles sent for each timing key, as values between 0 and 100 */
+	aggregator &percentiles(std::vector<double> p) { percentiles_ = std::move(p); return *this; }
+	const std::vector<double> &percentiles() const { return percentiles_; }
+
+	std::chrono::milliseconds interval() const { return interval_; }
+
+	/** Records a duration in seconds */
+	void timing(const std::string &k, float v) { timers_[k].add(1000.0 * v); }
+	void gauge(const std::string &k, int64_t v) { gauges_[k] = v; }
+	void delta(const std::string &k, int64_t v) { counters_[k] += v; }
+	void inc(const std::string &k) { delta(k, 1); }
+	void dec(const std::string &k) { delta(k, -1); }
+
+	/** Sends everything recorded so far and starts a new interval */
+	void
+	flush()
+	{
+		for(const auto &it : counters_)
+			client_->delta(it.first, it.second);
+		for(const auto &it : gauges_)
+			client_->gauge(it.first, it.second);
+		for(const auto &it : timers_)
+			send_timer(it.first, it.second);
+		counters_.clear();
+		gauges_.clear();
+		timers_.clear();
+	}
+
+	/** Stops the periodic flush, leaving anything recorded to be sent by flush() or the destructor */
+	void
+	stop()
+	{
+		boost::system::error_code ec;
+		timer_.cancel(ec);
+	}
+
+	/** Formats a value in milliseconds with up to microsecond precision, dropping trailing zeros */
+	static
+	std::string
+	format_ms(double v)
+	{
+		char buf[32];
+		auto n = std::snprintf(buf, sizeof(buf), "%.3f", v);
+		while(n > 0 && buf[n - 1] == '0')
+			--n;
+		if(n > 0 && buf[n - 1] == '.')
+			--n;
+		return std::string(buf, n);
+	}
+
+	/** Name suffix for a percentile - 99 becomes ".p99", 99.9 becomes ".p999" */
+	static
+	std::string
+	percentile_suffix(double p)
+	{
+		auto s = format_ms(p);
+		s.erase(std::remove(s.begin(), s.end(), '.'), s.end());
+		return ".p" + s;
+	}
+
+private:
+	void
+	arm_timer()
+	{
+		std::weak_ptr<aggregator> weak = shared_from_this();
+		timer_.expires_from_now(interval_);
+		timer_.async_wait([weak](const boost::system::error_code &ec) {
+			if(ec)
+				return;
+			if(auto self = weak.lock()) {
+				self->flush();
+				self->arm_timer();
+			}
+		});
+	}
+
+	void
+	send_timer(const std::string &k, const sketch &values)
+	{
+		if(values.empty())
+			return;
+		client_->delta(k + ".count", static_cast<int64_t>(values.count()));
+		client_->send(k + ".min", format_ms(values.min()) + "|g");
+		client_->send(k + ".max", format_ms(values.max()) + "|g");
+		client_->send(k + ".mean", format_ms(values.mean()) + "|g");
+		for(auto p : percentiles_)
+			client_->send(k + percentile_suffix(p), format_ms(values.percentile(p)) + "|g");
+	}
+
+	std::shared_ptr<client> client_;
+	std::chrono::milliseconds interval_;
+	boost::asio::high_resolution_timer timer_;
+	std::vector<double> percentiles_;
+	std::unordered_map<std::string, int64_t> counters_;
+	std::unordered_map<std::string, int64_t> gauges_;
+	std::unordered_map<std::string, sketch> timers_;
+};
+
+};
+};
@@ -0,0 +1,112 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include <net/asio/statsd/parser.h>
+#include <net/asio/statsd/sketch.h>
+
+namespace net {
+namespace statsd {
+
+/**
+ * Everything received for each key during one flush interval.
+ *
+ * Keys with tags are kept apart from the same key without them, or with
+ * different ones: the name used here is the key followed by "|#" and the
+ * tags, exactly as they arrived.
+ */
+class interval {
+public:
+	struct gauge {
+		double value;
+		/** False if we only saw adjustments, which apply to whatever the value was before */
+		bool absolute;
+	};
+
+	interval():metrics{ 0 }, bad_lines{ 0 } { }
+
+	/** Counters, scaled up by their sample rates */
+	std::unordered_map<std::string, double> counters;
+	std::unordered_map<std::string, gauge> gauges;
+	/**
+	 * Timer and histogram values, each weighted by 1/rate so that count()
+	 * is the events they stand for. Sketches merge exactly, so the merged
+	 * interval has the same percentiles as if one thread had seen it all.
+	 */
+	std::unordered_map<std::string, sketch> timers;
+	/** Meters, as a total for the interval */
+	std::unordered_map<std::string, double> meters;
+	uint64_t metrics;
+	uint64_t bad_lines;
+
+	/** Adds a metric, using scratch to build the key so a key we've seen before costs no allocation */
+	void
+	add(const metric &m, std::string &scratch)
+	{
+		++metrics;
+		scratch.assign(m.key.data(), m.key.size());
+		if(!m.tags.empty()) {
+			scratch += "|#";
+			scratch.append(m.tags.data(), m.tags.size());
+		}
+		switch(m.type) {
+		case metric::kind::counter:
+			counters[scratch] += m.value / m.rate;
+			break;
+		case metric::kind::gauge: {
+			auto it = gauges.find(scratch);
+			if(it == gauges.end())
+				gauges.emplace(scratch, gauge { m.value, !m.relative });
+			else if(m.relative)
+				it->second.value += m.value;
+			else
+				it->second = gauge { m.value, true };
+			break;
+		}
+		case metric::kind::timer:
+			timers[scratch].add(m.value, 1.0 / m.rate);
+			break;
+		case metric::kind::meter:
+			meters[scratch] += m.value;
+			break;
+		}
+	}
+
+	/**
+	 * Folds another interval's data into this one. Gauges set in both end
+	 * up with the other's value, since there's no telling which was later.
+	 */
+	void
+	merge(interval &&other)
+	{
+		for(auto &it : other.counters)
+			counters[it.first] += it.second;
+		for(auto &it : other.gauges) {
+			auto mine = gauges.find(it.first);
+			if(mine == gauges.end())
+				gauges.emplace(it.first, it.second);
+			else if(it.second.absolute)
+				mine->second = it.second;
+			else
+				mine->second.value += it.second.value;
+		}
+		for(auto &it : other.timers) {
+			auto &t = timers[it.first];
+			if(t.empty())
+				t = std::move(it.second);
+			else
+				t.merge(it.second);
+		}
+		for(auto &it : other.meters)
+			meters[it.first] += it.second;
+		metrics += other.metrics;
+		bad_lines += other.bad_lines;
+	}
+
+	bool empty() const { return metrics == 0 && bad_lines == 0; }
+};
+
+};
+};
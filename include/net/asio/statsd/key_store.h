@@ -0,0 +1,306 @@
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/utility/string_view.hpp>
+
+#include <net/asio/statsd/interval.h>
+#include <net/asio/statsd/parser.h>
+#include <net/asio/statsd/sketch.h>
+
+namespace net {
+namespace statsd {
+
+/**
+ * Stores the latest value for each key in a tree following the dots in
+ * the key, so that everything under "api.users" can be listed without
+ * looking at any key outside it.
+ *
+ * Path segments are interned, so "api" is stored once however many keys
+ * start with it. Nodes are small fixed-size records in one contiguous
+ * array and refer to each other by index; the values live in a parallel
+ * array, so walking the tree doesn't drag them through the cache. Finding
+ * a key is one hash lookup per segment, and listing a subtree visits only
+ * the nodes in it.
+ *
+ * Timers also keep the last interval's statsd::sketch, for percentiles
+ * beyond the mean - see distribution().
+ *
+ * Tags stay with the last segment: "api.hits|#status:200" is the node
+ * "hits|#status:200" under "api", next to the untagged "hits".
+ *
+ * Not thread-safe; statsd::server updates it from the io_service thread.
+ */
+class key_store {
+public:
+	using node_id = uint32_t;
+	/** Numbers the keys with values from 0, in the order they first got one, skipping parent-only nodes */
+	using value_id = uint32_t;
+
+	struct entry {
+		entry():type{ metric::kind::gauge }, value{ 0.0 }, count{ 0.0 }, updated{ 0 }, id{ ~value_id { 0 } }, present{ false } { }
+
+		metric::kind type;
+		/** Counter or meter total for the last interval, gauge value, or timer mean */
+		double value;
+		/** Events behind the value - the same as value for counters */
+		double count;
+		/** Which update() last touched this */
+		uint64_t updated;
+		/** Only meaningful once present */
+		value_id id;
+		/** False for nodes which are only there as a parent */
+		bool present;
+	};
+
+	key_store():generation_{ 0 }, values_{ 0 } {
+		nodes_.push_back(node { no_segment(), none(), none(), none() });
+		entries_.emplace_back();
+	}
+
+	static node_id root() { return 0; }
+	static node_id none() { return ~node_id { 0 }; }
+
+	/** The node for path, or none() */
+	node_id
+	find(boost::string_view path) const
+	{
+		node_id n = root();
+		for_each_segment(path, [&](boost::string_view seg) {
+			if(n == none())
+				return;
+			auto s = segments_.find(seg);
+			if(s == segments_.end()) {
+				n = none();
+				return;
+			}
+			auto e = edges_.find(edge(n, s->second));
+			n = e == edges_.end() ? none() : e->second;
+		});
+		return n;
+	}
+
+	/** The value at path, or null if nothing has been stored there */
+	const entry *
+	get(boost::string_view path) const
+	{
+		auto n = find(path);
+		if(n == none() || !entries_[n].present)
+			return nullptr;
+		return &entries_[n];
+	}
+
+	/** The last interval's values for the timer at path, or null if it isn't a timer */
+	const sketch *
+	distribution(boost::string_view path) const
+	{
+		auto it = sketches_.find(find(path));
+		if(it == sketches_.end() || entries_[it->first].type != metric::kind::timer)
+			return nullptr;
+		return &it->second;
+	}
+
+	/** The node for path, creating it and any parents as needed */
+	node_id
+	insert(boost::string_view path)
+	{
+		node_id n = root();
+		for_each_segment(path, [&](boost::string_view seg) {
+			auto s = intern(seg);
+			auto key = edge(n, s);
+			auto e = edges_.find(key);
+			if(e != edges_.end()) {
+				n = e->second;
+				return;
+			}
+			auto child = static_cast<node_id>(nodes_.size());
+			nodes_.push_back(node { s, n, none(), nodes_[n].first_child });
+			nodes_[n].first_child = child;
+			entries_.emplace_back();
+			edges_.emplace(key, child);
+			n = child;
+		});
+		return n;
+	}
+
+	void
+	set(boost::string_view path, metric::kind type, double value, double count)
+	{
+		auto &e = entries_[insert(path)];
+		if(!e.present)
+			e.id = static_cast<value_id>(values_++);
+		e.type = type;
+		e.value = value;
+		e.count = count;
+		e.updated = generation_;
+		e.present = true;
+	}
+
+	/**
+	 * Records one flush interval. Gauges come from the server rather than
+	 * the interval, since it tracks their absolute values.
+	 */
+	void
+	update(const interval &iv, const std::unordered_map<std::string, double> &gauges)
+	{
+		++generation_;
+		for(const auto &it : iv.counters)
+			set(it.first, metric::kind::counter, it.second, it.second);
+		for(const auto &it : iv.meters)
+			set(it.first, metric::kind::meter, it.second, it.second);
+		for(const auto &it : iv.timers) {
+			set(it.first, metric::kind::timer, it.second.mean(), it.second.count());
+			sketches_[find(it.first)] = it.second;
+		}
+		for(const auto &it : iv.gauges) {
+			auto g = gauges.find(it.first);
+			if(g != gauges.end())
+				set(it.first, metric::kind::gauge, g->second, 1.0);
+		}
+	}
+
+	/**
+	 * Calls f(path, entry) for prefix itself, if it has a value, and every
+	 * key below it. An empty prefix lists everything.
+	 */
+	template<typename F>
+	void
+	for_each(boost::string_view prefix, F f) const
+	{
+		auto n = find(prefix);
+		if(n == none())
+			return;
+		std::string path = prefix.to_string();
+		walk(n, path, f);
+	}
+
+	/** Calls f(name, node) for each direct child of prefix */
+	template<typename F>
+	void
+	for_each_child(boost::string_view prefix, F f) const
+	{
+		auto n = find(prefix);
+		if(n == none())
+			return;
+		for(auto c = nodes_[n].first_child; c != none(); c = nodes_[c].next_sibling)
+			f(segment_names_[nodes_[c].segment], c);
+	}
+
+	/** Full dotted path for a node */
+	std::string
+	path(node_id n) const
+	{
+		std::vector<node_id> up;
+		for(; n != root(); n = nodes_[n].parent)
+			up.push_back(n);
+		std::string out;
+		for(auto it = up.rbegin(); it != up.rend(); ++it) {
+			if(!out.empty())
+				out += '.';
+			out += segment_names_[nodes_[*it].segment];
+		}
+		return out;
+	}
+
+	const entry &at(node_id n) const { return entries_[n]; }
+
+	/** Keys with a value */
+	size_t size() const { return values_; }
+	/** Nodes, including parents with no value of their own */
+	size_t nodes() const { return nodes_.size() - 1; }
+	/** Distinct path segments */
+	size_t segments() const { return segment_names_.size(); }
+	uint64_t generation() const { return generation_; }
+
+private:
+	struct node {
+		uint32_t segment;
+		node_id parent;
+		node_id first_child;
+		node_id next_sibling;
+	};
+
+	/** FNV-1a, so segments can be looked up by string_view without building a string */
+	struct view_hash {
+		size_t
+		operator()(boost::string_view s) const
+		{
+			uint64_t h = 14695981039346656037ull;
+			for(auto c : s) {
+				h ^= static_cast<unsigned char>(c);
+				h *= 1099511628211ull;
+			}
+			return static_cast<size_t>(h);
+		}
+	};
+
+	static uint32_t no_segment() { return ~uint32_t { 0 }; }
+	static uint64_t edge(node_id parent, uint32_t segment) { return (static_cast<uint64_t>(parent) << 32) | segment; }
+
+	/** Splits on dots, keeping any "|#tags" with the last segment */
+	template<typename F>
+	static
+	void
+	for_each_segment(boost::string_view path, F f)
+	{
+		auto tags = path.find("|#");
+		auto name = path.substr(0, tags);
+		while(!name.empty()) {
+			auto dot = name.find('.');
+			if(dot == boost::string_view::npos) {
+				f(tags == boost::string_view::npos ? name : boost::string_view { name.data(), static_cast<size_t>(path.data() + path.size() - name.data()) });
+				return;
+			}
+			if(dot > 0)
+				f(name.substr(0, dot));
+			name.remove_prefix(dot + 1);
+		}
+	}
+
+	uint32_t
+	intern(boost::string_view seg)
+	{
+		auto it = segments_.find(seg);
+		if(it != segments_.end())
+			return it->second;
+		auto id = static_cast<uint32_t>(segment_names_.size());
+		/* A deque never moves what it holds, so the view in the map stays valid */
+		segment_names_.push_back(seg.to_string());
+		segments_.emplace(boost::string_view { segment_names_.back() }, id);
+		return id;
+	}
+
+	template<typename F>
+	void
+	walk(node_id n, std::string &path, F &f) const
+	{
+		if(entries_[n].present) {
+			const std::string &p = path;
+			f(p, entries_[n]);
+		}
+		auto len = path.size();
+		for(auto c = nodes_[n].first_child; c != none(); c = nodes_[c].next_sibling) {
+			if(len > 0)
+				path += '.';
+			path += segment_names_[nodes_[c].segment];
+			walk(c, path, f);
+			path.resize(len);
+		}
+	}
+
+	std::vector<node> nodes_;
+	std::vector<entry> entries_;
+	std::deque<std::string> segment_names_;
+	std::unordered_map<boost::string_view, uint32_t, view_hash> segments_;
+	std::unordered_map<uint64_t, node_id> edges_;
+	/** Kept apart from entries_ since only timers have one, and they're much bigger */
+	std::unordered_map<node_id, sketch> sketches_;
+	uint64_t generation_;
+	size_t values_;
+};
+
+};
+};
@@ -0,0 +1,218 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include <boost/utility/string_view.hpp>
+
+namespace net {
+namespace statsd {
+
+/** One metric from a line of the wire format, pointing into the packet it came from */
+struct metric {
+	enum class kind {
+		counter,
+		gauge,
+		/** ms and h, which the server treats the same */
+		timer,
+		meter
+	};
+
+	boost::string_view key;
+	double value;
+	kind type;
+	/** For gauges, whether the value was "+n" or "-n" - an adjustment rather than a new value */
+	bool relative;
+	/** Fraction of events the client sent, from "|@rate" */
+	double rate;
+	/** DogStatsD tags from "|#...", without the "|#" */
+	boost::string_view tags;
+};
+
+/**
+ * Parses packets in the format described in docs/statsd.md without
+ * copying: every metric refers back into the packet.
+ *
+ * Lines and fields are found with memchr(), which the C library
+ * implements with vector instructions, so long packets are scanned a
+ * word or more at a time rather than a byte at a time.
+ */
+class parser {
+public:
+	/**
+	 * Calls f(const metric &) for each valid line in the packet, and
+	 * returns the number of lines which couldn't be parsed. Empty lines
+	 * are skipped.
+	 */
+	template<typename F>
+	static
+	size_t
+	parse_packet(boost::string_view packet, F f)
+	{
+		size_t bad = 0;
+		metric m;
+		const char *p = packet.data();
+		const char *end = p + packet.size();
+		while(p < end) {
+			auto nl = static_cast<const char *>(std::memchr(p, '\n', end - p));
+			auto line_end = nl ? nl : end;
+			boost::string_view line { p, static_cast<size_t>(line_end - p) };
+			if(!line.empty() && line.back() == '\r')
+				line.remove_suffix(1);
+			if(!line.empty()) {
+				if(parse_line(line, m))
+					f(m);
+				else
+					++bad;
+			}
+			p = line_end + 1;
+		}
+		return bad;
+	}
+
+	/** Parses one line, without its newline */
+	static
+	bool
+	parse_line(boost::string_view line, metric &m)
+	{
+		m.relative = false;
+		m.rate = 1.0;
+		m.tags = boost::string_view { };
+
+		auto colon = find(line, ':');
+		if(colon == boost::string_view::npos) {
+			/* A bare key counts as one event on a meter */
+			m.key = line;
+			m.value = 1.0;
+			m.type = metric::kind::meter;
+			return true;
+		}
+		if(colon == 0)
+			return false;
+		m.key = line.substr(0, colon);
+		auto rest = line.substr(colon + 1);
+
+		auto bar = find(rest, '|');
+		if(bar == boost::string_view::npos)
+			return false;
+		auto value = rest.substr(0, bar);
+		rest = rest.substr(bar + 1);
+
+		bar = find(rest, '|');
+		auto type = rest.substr(0, bar);
+		rest = bar == boost::string_view::npos ? boost::string_view { } : rest.substr(bar + 1);
+		if(type == "c") {
+			m.type = metric::kind::counter;
+		} else if(type == "g") {
+			m.type = metric::kind::gauge;
+			m.relative = !value.empty() && (value.front() == '+' || value.front() == '-');
+		} else if(type == "ms" || type == "h") {
+			m.type = metric::kind::timer;
+		} else if(type == "m") {
+			m.type = metric::kind::meter;
+		} else {
+			return false;
+		}
+		if(!parse_number(value, m.value))
+			return false;
+
+		/* Optional sections, in any order; ones we don't know are skipped */
+		while(!rest.empty()) {
+			bar = find(rest, '|');
+			auto section = rest.substr(0, bar);
+			rest = bar == boost::string_view::npos ? boost::string_view { } : rest.substr(bar + 1);
+			if(section.empty())
+				continue;
+			if(section.front() == '@') {
+				if(!parse_number(section.substr(1), m.rate) || !(m.rate > 0.0) || m.rate > 1.0)
+					return false;
+			} else if(section.front() == '#') {
+				m.tags = section.substr(1);
+			}
+		}
+		return true;
+	}
+
+	/**
+	 * Parses a decimal number with optional sign, fraction and exponent.
+	 * Unlike strtod this needs no terminator and ignores the locale. Values
+	 * too large for a double are rejected rather than becoming infinity.
+	 */
+	static
+	bool
+	parse_number(boost::string_view in, double &out)
+	{
+		const char *p = in.data();
+		const char *end = p + in.size();
+		bool negative = false;
+		if(p < end && (*p == '+' || *p == '-'))
+			negative = *p++ == '-';
+		uint64_t mantissa = 0;
+		int exponent = 0;
+		size_t digits = 0;
+		for(; p < end && *p >= '0' && *p <= '9'; ++p, ++digits) {
+			if(mantissa < 100000000000000000ull)
+				mantissa = mantissa * 10 + (*p - '0');
+			else
+				++exponent;
+		}
+		if(p < end && *p == '.') {
+			for(++p; p < end && *p >= '0' && *p <= '9'; ++p, ++digits) {
+				if(mantissa < 100000000000000000ull) {
+					mantissa = mantissa * 10 + (*p - '0');
+					--exponent;
+				}
+			}
+		}
+		if(digits == 0)
+			return false;
+		if(p < end && (*p == 'e' || *p == 'E')) {
+			++p;
+			bool negative_exponent = false;
+			if(p < end && (*p == '+' || *p == '-'))
+				negative_exponent = *p++ == '-';
+			if(p == end)
+				return false;
+			int e = 0;
+			for(; p < end && *p >= '0' && *p <= '9'; ++p)
+				e = e < 10000 ? e * 10 + (*p - '0') : e;
+			exponent += negative_exponent ? -e : e;
+		}
+		if(p != end)
+			return false;
+		double v = static_cast<double>(mantissa);
+		if(exponent != 0)
+			v = exponent > 0 ? v * power_of_ten(exponent) : v / power_of_ten(-exponent);
+		/* An exponent like 1e400 overflows to infinity, which no metric should hold */
+		if(!std::isfinite(v))
+			return false;
+		out = negative ? -v : v;
+		return true;
+	}
+
+private:
+	static
+	size_t
+	find(boost::string_view in, char c)
+	{
+		auto p = static_cast<const char *>(std::memchr(in.data(), c, in.size()));
+		return p ? static_cast<size_t>(p - in.data()) : boost::string_view::npos;
+	}
+
+	static
+	double
+	power_of_ten(int n)
+	{
+		static const double small[] = {
+			1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+			1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15
+		};
+		double v = 1.0;
+		for(; n >= 16; n -= 16)
+			v *= 1e16;
+		return v * small[n];
+	}
+};
+
+};
+};
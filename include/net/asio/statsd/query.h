@@ -0,0 +1,260 @@
+#pragma once
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/utility/string_view.hpp>
+
+#include <net/asio/statsd/server.h>
+
+namespace net {
+namespace statsd {
+
+/**
+ * Answers queries about a statsd::server's keys over a line-based TCP
+ * protocol. Each request is one line; each response is zero or more lines
+ * followed by "END", or a single "ERROR ..." line.
+ *
+ *     get api.latency          api.latency ms 12.5 340
+ *     list api                 every key under api, one per line
+ *     children api             names of the nodes directly under api
+ *     percentiles api.latency  p50, p90, p99 and p99.9 for a timer
+ *     percentiles api.latency 75 99.99
+ *     range api.latency 3600   the last hour of history, oldest first
+ *     range api.latency 1700000000 1700003600
+ *     stats                    keys, nodes and segments in the store
+ *
+ * Values come as "path type value count", where the type is c, g, ms or
+ * m and count is the number of events behind the value. Percentiles come
+ * as "path pN value", from the timer's last interval, and are within 1%
+ * of the true value. History comes as "path time value count", with the
+ * time in seconds since the epoch, at the finest resolution that reaches
+ * back far enough.
+ *
+ * A request line longer than max_line() closes the connection.
+ *
+ * Sessions run on the server's io_service thread, so they read the store
+ * between flushes and never see one half-applied.
+ *
+ * Must be held in a std::shared_ptr.
+ */
+class query_server : public std::enable_shared_from_this<query_server> {
+public:
+	static
+	std::shared_ptr<query_server>
+	create(
+		boost::asio::io_service &service,
+		std::shared_ptr<server> source
+	)
+	{
+		return std::make_shared<query_server>(service, std::move(source));
+	}
+
+	query_server(
+		boost::asio::io_service &service,
+		std::shared_ptr<server> source
+	):service_(service),
+	  acceptor_(service),
+	  source_(std::move(source))
+	{
+	}
+
+	virtual ~query_server() = default;
+
+	/** Starts accepting connections; throws boost::system::system_error if we can't bind */
+	void
+	listen(
+		const std::string &host = "127.0.0.1",
+		uint16_t port = 0
+	)
+	{
+		using boost::asio::ip::tcp;
+		tcp::endpoint ep { boost::asio::ip::address::from_string(host), port };
+		acceptor_.open(ep.protocol());
+		acceptor_.set_option(tcp::acceptor::reuse_address(true));
+		acceptor_.bind(ep);
+		acceptor_.listen();
+		accept();
+	}
+
+	uint16_t port() const { return acceptor_.local_endpoint().port(); }
+
+	/** Longest request line we'll buffer, newline included */
+	static size_t max_line() { return 4096; }
+
+	void
+	stop()
+	{
+		boost::system::error_code ec;
+		acceptor_.close(ec);
+	}
+
+	/** The full response to one request line */
+	std::string
+	answer(boost::string_view line) const
+	{
+		while(!line.empty() && (line.back() == '\r' || line.back() == ' '))
+			line.remove_suffix(1);
+		auto space = line.find(' ');
+		auto command = line.substr(0, space);
+		auto arg = space == boost::string_view::npos ? boost::string_view { } : line.substr(space + 1);
+		const auto &store = source_->store();
+		std::string out;
+		if(command == "get") {
+			if(auto e = store.get(arg))
+				append(out, arg, *e);
+		} else if(command == "list") {
+			store.for_each(arg, [&out](const std::string &path, const key_store::entry &e) {
+				append(out, path, e);
+			});
+		} else if(command == "children") {
+			store.for_each_child(arg, [&out](const std::string &name, key_store::node_id) {
+				out += name;
+				out += '\n';
+			});
+		} else if(command == "percentiles") {
+			auto rest = arg;
+			auto path = next_word(rest);
+			std::vector<double> wanted;
+			for(auto word = next_word(rest); !word.empty(); word = next_word(rest)) {
+				double p;
+				if(!parser::parse_number(word, p) || p < 0.0 || p > 100.0)
+					return "ERROR bad percentile\n";
+				wanted.push_back(p);
+			}
+			if(wanted.empty())
+				wanted = { 50.0, 90.0, 99.0, 99.9 };
+			if(auto d = store.distribution(path)) {
+				for(auto p : wanted) {
+					char numbers[64];
+					std::snprintf(numbers, sizeof(numbers), " p%g %.15g\n", p, d->percentile(p));
+					out.append(path.data(), path.size());
+					out += numbers;
+				}
+			}
+		} else if(command == "range") {
+			double numbers[2];
+			size_t given = 0;
+			auto rest = arg;
+			auto path = next_word(rest);
+			for(auto word = next_word(rest); !word.empty(); word = next_word(rest)) {
+				if(given == 2 || !parser::parse_number(word, numbers[given]) || numbers[given] < 0.0)
+					return "ERROR bad range\n";
+				++given;
+			}
+			if(given == 0)
+				return "ERROR bad range\n";
+			using clock = retention::clock;
+			auto at = [](double secs) { return clock::time_point { std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(secs)) }; };
+			auto to = given == 2 ? at(numbers[1]) : clock::now();
+			auto from = given == 2 ? at(numbers[0]) : to - std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(numbers[0]));
+			if(auto e = store.get(path)) {
+				for(const auto &p : source_->history().range(e->id, from, to)) {
+					char line[96];
+					std::snprintf(
+						line, sizeof(line), " %lld %.9g %.9g\n",
+						static_cast<long long>(std::chrono::duration_cast<std::chrono::seconds>(p.time.time_since_epoch()).count()),
+						p.value,
+						p.count
+					);
+					out.append(path.data(), path.size());
+					out += line;
+				}
+			}
+		} else if(command == "stats") {
+			out += "keys " + std::to_string(store.size()) + "\n";
+			out += "nodes " + std::to_string(store.nodes()) + "\n";
+			out += "segments " + std::to_string(store.segments()) + "\n";
+		} else {
+			return "ERROR unknown command\n";
+		}
+		out += "END\n";
+		return out;
+	}
+
+private:
+	/** One client connection, answering a line at a time */
+	class session : public std::enable_shared_from_this<session> {
+	public:
+		session(
+			std::shared_ptr<const query_server> owner,
+			std::shared_ptr<boost::asio::ip::tcp::socket> socket
+		):owner_(std::move(owner)),
+		  socket_(std::move(socket)),
+		  in_(max_line())
+		{
+		}
+
+		void
+		read()
+		{
+			auto self = shared_from_this();
+			boost::asio::async_read_until(*socket_, in_, '\n', [self](const boost::system::error_code &ec, size_t len) {
+				/* Includes a line that fills in_ without ending, which drops the session and with it the socket */
+				if(ec)
+					return;
+				std::string line(len - 1, '\0');
+				self->in_.sgetn(&line[0], len - 1);
+				self->in_.consume(1);
+				auto reply = std::make_shared<std::string>(self->owner_->answer(line));
+				boost::asio::async_write(*self->socket_, boost::asio::buffer(*reply), [self, reply](const boost::system::error_code &ec, size_t) {
+					if(!ec)
+						self->read();
+				});
+			});
+		}
+
+	private:
+		std::shared_ptr<const query_server> owner_;
+		std::shared_ptr<boost::asio::ip::tcp::socket> socket_;
+		boost::asio::streambuf in_;
+	};
+
+	void
+	accept()
+	{
+		auto self = shared_from_this();
+		auto socket = std::make_shared<boost::asio::ip::tcp::socket>(service_);
+		acceptor_.async_accept(*socket, [self, socket](const boost::system::error_code &ec) {
+			if(!self->acceptor_.is_open())
+				return;
+			if(!ec)
+				std::make_shared<session>(self, socket)->read();
+			self->accept();
+		});
+	}
+
+	/** Takes the first space-separated word off in */
+	static
+	boost::string_view
+	next_word(boost::string_view &in)
+	{
+		auto space = in.find(' ');
+		auto word = in.substr(0, space);
+		in = space == boost::string_view::npos ? boost::string_view { } : in.substr(space + 1);
+		return word;
+	}
+
+	static
+	void
+	append(std::string &out, boost::string_view path, const key_store::entry &e)
+	{
+		static const char *types[] = { "c", "g", "ms", "m" };
+		char numbers[64];
+		std::snprintf(numbers, sizeof(numbers), " %.15g %.15g\n", e.value, e.count);
+		out.append(path.data(), path.size());
+		out += ' ';
+		out += types[static_cast<int>(e.type)];
+		out += numbers;
+	}
+
+	boost::asio::io_service &service_;
+	boost::asio::ip::tcp::acceptor acceptor_;
+	std::shared_ptr<server> source_;
+};
+
+};
+};
@@ -0,0 +1,492 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/asio/high_resolution_timer.hpp>
+
+#include <net/asio/statsd/aggregator.h>
+
+namespace net {
+namespace statsd {
+
+/**
+ * Records metrics from any thread into an aggregator that lives on the
+ * io_service thread.
+ *
+ * Each thread that records gets its own shard, created the first time it
+ * touches this recorder. Counters and gauges are slots in that shard,
+ * indexed by key, holding a running total or the latest value: recording
+ * one is a load and a store to memory no other thread writes, with no
+ * locks and no atomic read-modify-write. The io thread reads every
+ * shard once per drain interval and passes on what changed since last
+ * time, so its cost depends on the number of keys rather than the number
+ * of calls. Timings carry a value each, so they go through a
+ * single-producer ring in the shard instead.
+ *
+ * Keys are interned once into small ids. The string overloads look the id
+ * up in a per-thread table; callers in tight loops can get the id from
+ * key() up front and skip even that.
+ *
+ * A full timing ring drops the sample rather than waiting, and counts it
+ * in dropped(): recording must never block the caller. Gauges set from
+ * more than one thread end up with whichever value was drained last.
+ *
+ * Must be held in a std::shared_ptr.
+ */
+class recorder : public std::enable_shared_from_this<recorder> {
+public:
+	/** An interned key, valid for the recorder which issued it */
+	struct key_id {
+		uint32_t id;
+	};
+
+	static
+	std::shared_ptr<recorder>
+	create(
+		boost::asio::io_service &service,
+		std::shared_ptr<aggregator> target,
+		std::chrono::milliseconds drain_interval = std::chrono::milliseconds(10),
+		size_t capacity = 4096
+	)
+	{
+		auto r = std::make_shared<recorder>(service, std::move(target), drain_interval, capacity);
+		r->arm_timer();
+		return r;
+	}
+
+	recorder(
+		boost::asio::io_service &service,
+		std::shared_ptr<aggregator> target,
+		std::chrono::milliseconds drain_interval,
+		size_t capacity
+	):id_{ next_recorder_id() },
+	  aggregator_(std::move(target)),
+	  drain_interval_(drain_interval),
+	  timer_(service),
+	  capacity_{ round_up_power_of_two(capacity) },
+	  retired_dropped_{ 0 }
+	{
+	}
+
+	virtual ~recorder() {
+		drain();
+	}
+
+	/** Most keys a recorder can hold */
+	static size_t max_keys() { return block_size() * max_blocks(); }
+
+	/** Interns a key. Safe from any thread, but takes a lock the first time each key is seen */
+	key_id
+	key(const std::string &k)
+	{
+		std::lock_guard<std::mutex> guard { keys_mutex_ };
+		auto it = key_ids_.find(k);
+		if(it != key_ids_.end())
+			return key_id { it->second };
+		if(key_names_.size() >= max_keys())
+			throw std::runtime_error("Too many keys for one statsd recorder");
+		auto id = static_cast<uint32_t>(key_names_.size());
+		key_names_.push_back(k);
+		key_ids_.emplace(k, id);
+		return key_id { id };
+	}
+
+	/** Records a duration in seconds */
+	void timing(key_id k, float v) { local().time(k.id, v); }
+	void gauge(key_id k, int64_t v) { local().set(k.id, v); }
+	void delta(key_id k, int64_t v) { local().add(k.id, v); }
+	void inc(key_id k) { delta(k, 1); }
+	void dec(key_id k) { delta(k, -1); }
+
+	void timing(const std::string &k, float v) { auto &s = local(); s.time(s.lookup(*this, k), v); }
+	void gauge(const std::string &k, int64_t v) { auto &s = local(); s.set(s.lookup(*this, k), v); }
+	void delta(const std::string &k, int64_t v) { auto &s = local(); s.add(s.lookup(*this, k), v); }
+	void inc(const std::string &k) { delta(k, 1); }
+	void dec(const std::string &k) { delta(k, -1); }
+
+	/**
+	 * Moves everything recorded so far into the aggregator. Called from
+	 * the io thread every drain interval.
+	 */
+	void
+	drain()
+	{
+		std::vector<std::shared_ptr<shard>> shards;
+		{
+			std::lock_guard<std::mutex> guard { shards_mutex_ };
+			shards = shards_;
+		}
+		for(auto &s : shards)
+			drain(*s);
+		shards.clear();
+
+		/* Once a thread has exited its shard is only held here, and after
+		 * one last look it can go
+		 */
+		std::lock_guard<std::mutex> guard { shards_mutex_ };
+		for(auto it = shards_.begin(); it != shards_.end(); ) {
+			if(it->use_count() == 1) {
+				drain(**it);
+				retired_dropped_ += (*it)->dropped();
+				it = shards_.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+
+	/** Stops the periodic drain */
+	void
+	stop()
+	{
+		boost::system::error_code ec;
+		timer_.cancel(ec);
+	}
+
+	/** Total timings lost to full rings */
+	uint64_t
+	dropped() const
+	{
+		std::lock_guard<std::mutex> guard { shards_mutex_ };
+		uint64_t total = retired_dropped_;
+		for(const auto &s : shards_)
+			total += s->dropped();
+		return total;
+	}
+
+	/** Timings each thread can hold between drains */
+	size_t capacity() const { return capacity_; }
+
+private:
+	/** Keys are grouped into fixed blocks, allocated as each thread first uses them */
+	static size_t block_size() { return block::slot_count; }
+	static size_t max_blocks() { return 4096; }
+
+	/** Space between fields written by different threads, so they never share a cache line */
+	enum : size_t { cache_line = 64 };
+
+	/**
+	 * Counter and gauge state for one key in one thread. Only the owning
+	 * thread stores here, so a plain load and store is enough - no
+	 * read-modify-write needed.
+	 */
+	struct slot {
+		slot():total{ 0 }, value{ 0 }, sets{ 0 } { }
+
+		void add(int64_t v) { total.store(total.load(std::memory_order_relaxed) + v, std::memory_order_relaxed); }
+		void
+		set(int64_t v)
+		{
+			value.store(v, std::memory_order_relaxed);
+			sets.store(sets.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		}
+
+		/** Sum of every delta so far */
+		std::atomic<int64_t> total;
+		/** Latest gauge, and how many times one has been set */
+		std::atomic<int64_t> value;
+		std::atomic<uint64_t> sets;
+	};
+
+	struct block {
+		enum : size_t { slot_count = 256 };
+
+		block():dirty{ false } { }
+
+		/** Set by the writer after anything in here changes, cleared by the reader before it looks */
+		std::atomic<bool> dirty;
+		slot slots[slot_count];
+	};
+
+	struct timing_record {
+		uint32_t key;
+		float seconds;
+	};
+
+	/** What the reader had seen of a slot as of the last drain */
+	struct seen {
+		int64_t total;
+		uint64_t sets;
+	};
+
+	/**
+	 * One thread's metrics. The blocks and the timing ring's head_ are
+	 * written only by that thread; the reader owns tail_ and the seen_
+	 * copies. Each side keeps a private copy of the other's ring index
+	 * so it seldom has to touch the shared cache line.
+	 */
+	class shard {
+	public:
+		shard(
+			size_t capacity
+		):blocks_(max_blocks()),
+		  used_blocks_{ 0 },
+		  ring_(capacity),
+		  mask_{ capacity - 1 },
+		  head_{ 0 },
+		  tail_{ 0 },
+		  cached_tail_{ 0 },
+		  dropped_{ 0 }
+		{
+		}
+
+		~shard() {
+			for(auto &b : blocks_)
+				delete b.load(std::memory_order_relaxed);
+		}
+
+		/** Writer side only, as are set() and time() */
+		void
+		add(uint32_t id, int64_t v)
+		{
+			auto &b = block_for(id);
+			b.slots[id % block_size()].add(v);
+			b.dirty.store(true, std::memory_order_release);
+		}
+
+		void
+		set(uint32_t id, int64_t v)
+		{
+			auto &b = block_for(id);
+			b.slots[id % block_size()].set(v);
+			b.dirty.store(true, std::memory_order_release);
+		}
+
+		/** Queues a timing, or counts it as dropped if the ring is full */
+		void
+		time(uint32_t key, float seconds)
+		{
+			auto head = head_.load(std::memory_order_relaxed);
+			if(head - cached_tail_ > mask_) {
+				cached_tail_ = tail_.load(std::memory_order_acquire);
+				if(head - cached_tail_ > mask_) {
+					dropped_.store(dropped_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+					return;
+				}
+			}
+			ring_[head & mask_] = timing_record { key, seconds };
+			head_.store(head + 1, std::memory_order_release);
+		}
+
+		/**
+		 * Calls on_delta(key, change) for each counter that moved,
+		 * on_gauge(key, value) for each gauge set and on_timing(key,
+		 * seconds) for each timing, since the last call. Reader side only.
+		 *
+		 * Every slot of a dirty block is checked, not just the keys known
+		 * when we started: a key interned mid-drain may already have been
+		 * written, and its dirty flag is the one we're about to clear.
+		 */
+		template<typename Delta, typename Gauge, typename Timing>
+		void
+		consume(Delta on_delta, Gauge on_gauge, Timing on_timing)
+		{
+			auto used = used_blocks_.load(std::memory_order_acquire);
+			if(seen_.size() < used * block_size())
+				seen_.resize(used * block_size(), seen { 0, 0 });
+			for(size_t i = 0; i < used; ++i) {
+				auto b = blocks_[i].load(std::memory_order_acquire);
+				if(!b || !b->dirty.load(std::memory_order_relaxed))
+					continue;
+				b->dirty.exchange(false, std::memory_order_acq_rel);
+				auto first = i * block_size();
+				for(auto id = first; id < first + block_size(); ++id) {
+					auto &sl = b->slots[id - first];
+					auto &was = seen_[id];
+					auto sets = sl.sets.load(std::memory_order_acquire);
+					if(sets != was.sets) {
+						was.sets = sets;
+						on_gauge(static_cast<uint32_t>(id), sl.value.load(std::memory_order_relaxed));
+					}
+					auto total = sl.total.load(std::memory_order_relaxed);
+					if(total != was.total) {
+						on_delta(static_cast<uint32_t>(id), total - was.total);
+						was.total = total;
+					}
+				}
+			}
+
+			auto tail = tail_.load(std::memory_order_relaxed);
+			auto head = head_.load(std::memory_order_acquire);
+			for(; tail != head; ++tail) {
+				const auto &r = ring_[tail & mask_];
+				on_timing(r.key, r.seconds);
+			}
+			tail_.store(tail, std::memory_order_release);
+		}
+
+		uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+		/** This thread's copy of the key table. Writer side only */
+		uint32_t
+		lookup(recorder &r, const std::string &k)
+		{
+			auto it = keys_.find(k);
+			if(it != keys_.end())
+				return it->second;
+			auto id = r.key(k).id;
+			keys_.emplace(k, id);
+			return id;
+		}
+
+	private:
+		block &
+		block_for(uint32_t id)
+		{
+			auto index = id / block_size();
+			auto &entry = blocks_[index];
+			auto b = entry.load(std::memory_order_relaxed);
+			if(!b) {
+				b = new block();
+				entry.store(b, std::memory_order_release);
+				if(index >= used_blocks_.load(std::memory_order_relaxed))
+					used_blocks_.store(index + 1, std::memory_order_release);
+			}
+			return *b;
+		}
+
+		std::vector<std::atomic<block *>> blocks_;
+		/** One past the highest block allocated, so the reader needn't look at all of blocks_ */
+		std::atomic<size_t> used_blocks_;
+		std::vector<timing_record> ring_;
+		size_t mask_;
+		/* Padding rather than alignas, which plain new doesn't honour before C++17 */
+		char before_head_[cache_line];
+		std::atomic<size_t> head_;
+		char before_tail_[cache_line];
+		std::atomic<size_t> tail_;
+		char before_cached_tail_[cache_line];
+		size_t cached_tail_;
+		std::atomic<uint64_t> dropped_;
+		std::unordered_map<std::string, uint32_t> keys_;
+		std::vector<seen> seen_;
+	};
+
+	/**
+	 * The calling thread's shard, registering one on first use. Shards for
+	 * recorders which have since gone are let go here too, so a long-lived
+	 * thread doesn't keep one for every recorder it ever touched.
+	 */
+	shard &
+	local()
+	{
+		struct entry {
+			uint64_t id;
+			std::weak_ptr<const recorder> owner;
+			std::shared_ptr<shard> s;
+		};
+		static thread_local uint64_t last_recorder = 0;
+		static thread_local shard *last_shard = nullptr;
+		static thread_local std::vector<entry> entries;
+		if(last_recorder == id_)
+			return *last_shard;
+		shard *found = nullptr;
+		for(auto &e : entries) {
+			if(e.id == id_) {
+				found = e.s.get();
+				break;
+			}
+		}
+		if(!found) {
+			entries.erase(
+				std::remove_if(entries.begin(), entries.end(), [](const entry &e) { return e.owner.expired(); }),
+				entries.end()
+			);
+			auto s = std::make_shared<shard>(capacity_);
+			{
+				std::lock_guard<std::mutex> guard { shards_mutex_ };
+				shards_.push_back(s);
+			}
+			entries.push_back(entry { id_, shared_from_this(), s });
+			found = s.get();
+		}
+		last_recorder = id_;
+		last_shard = found;
+		return *found;
+	}
+
+	void
+	drain(shard &s)
+	{
+		s.consume(
+			[this](uint32_t k, int64_t v) { aggregator_->delta(name(k), v); },
+			[this](uint32_t k, int64_t v) { aggregator_->gauge(name(k), v); },
+			[this](uint32_t k, float v) { aggregator_->timing(name(k), v); }
+		);
+	}
+
+	/** Key name for an id, keeping a copy on the reader side so we only lock for new ones */
+	const std::string &
+	name(uint32_t id)
+	{
+		if(id >= names_.size()) {
+			std::lock_guard<std::mutex> guard { keys_mutex_ };
+			names_.assign(key_names_.begin(), key_names_.end());
+		}
+		return names_[id];
+	}
+
+	void
+	arm_timer()
+	{
+		std::weak_ptr<recorder> weak = shared_from_this();
+		timer_.expires_from_now(drain_interval_);
+		timer_.async_wait([weak](const boost::system::error_code &ec) {
+			if(ec)
+				return;
+			if(auto self = weak.lock()) {
+				self->drain();
+				self->arm_timer();
+			}
+		});
+	}
+
+	static
+	uint64_t
+	next_recorder_id()
+	{
+		static std::atomic<uint64_t> next { 1 };
+		return next++;
+	}
+
+	static
+	size_t
+	round_up_power_of_two(size_t n)
+	{
+		size_t p = 2;
+		while(p < n)
+			p <<= 1;
+		return p;
+	}
+
+	/** Never reused, so a thread's cached shard can't be mistaken for a later recorder's */
+	uint64_t id_;
+	std::shared_ptr<aggregator> aggregator_;
+	std::chrono::milliseconds drain_interval_;
+	boost::asio::high_resolution_timer timer_;
+	size_t capacity_;
+
+	mutable std::mutex keys_mutex_;
+	std::unordered_map<std::string, uint32_t> key_ids_;
+	std::deque<std::string> key_names_;
+	/** Reader-side copy of key_names_ */
+	std::vector<std::string> names_;
+
+	mutable std::mutex shards_mutex_;
+	std::vector<std::shared_ptr<shard>> shards_;
+	/** Drops from shards we've since removed */
+	uint64_t retired_dropped_;
+};
+
+};
+};
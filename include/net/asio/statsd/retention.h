@@ -0,0 +1,289 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include <net/asio/statsd/key_store.h>
+
+namespace net {
+namespace statsd {
+
+/**
+ * Recent history for every key in a key_store, kept in memory at several
+ * resolutions - by default 10 seconds for the last hour, a minute for the
+ * last day and an hour for the last month - so short graphs need nothing
+ * more than the server itself.
+ *
+ * Each resolution is a ring of fixed-size slots. Every update() is
+ * written into the current slot of each resolution at once, combined with
+ * whatever is already there: counters and meters are summed, gauges keep
+ * the latest value and timers keep a mean weighted by their counts. A
+ * slot nobody wrote to holds no value, rather than zero.
+ *
+ * Keys are identified by their key_store::value_id, which never changes
+ * and leaves no gaps for parent nodes with no value, and grouped into
+ * blocks of block_keys. Within a block each slot is a row of
+ * floats, one per key, with a second row for the counts; an update walks
+ * the keys in id order and writes each row front to back, so even with
+ * millions of keys a flush is a handful of sequential streams through
+ * memory. Reading one key's history touches one float per slot.
+ *
+ * Memory is 8 bytes per key per slot - about 20KB per key for the default
+ * resolutions - allocated a block at a time as keys appear. Values are
+ * floats, so counter totals are exact up to 2^24.
+ *
+ * Not thread-safe; statsd::server updates it from the io_service thread.
+ */
+class retention {
+public:
+	using clock = std::chrono::system_clock;
+
+	struct resolution {
+		std::chrono::seconds step;
+		size_t slots;
+	};
+
+	struct point {
+		/** Start of the slot */
+		clock::time_point time;
+		double value;
+		double count;
+	};
+
+	enum : size_t { block_keys = 256 };
+
+	/** 10s for an hour, 1m for a day, 1h for 30 days */
+	static
+	std::vector<resolution>
+	default_resolutions()
+	{
+		return {
+			resolution { std::chrono::seconds(10), 360 },
+			resolution { std::chrono::minutes(1), 1440 },
+			resolution { std::chrono::hours(1), 720 }
+		};
+	}
+
+	/** Resolutions go from finest to coarsest; an empty list keeps nothing */
+	explicit
+	retention(
+		std::vector<resolution> resolutions = default_resolutions()
+	):resolutions_(std::move(resolutions)),
+	  rows_{ 0 },
+	  started_{ false }
+	{
+		for(size_t i = 0; i < resolutions_.size(); ++i) {
+			const auto &r = resolutions_[i];
+			if(r.step.count() <= 0 || r.slots == 0)
+				throw std::invalid_argument("retention resolutions need a positive step and at least one slot");
+			if(i > 0 && r.step <= resolutions_[i - 1].step)
+				throw std::invalid_argument("retention resolutions must go from finest to coarsest");
+			base_.push_back(rows_);
+			rows_ += r.slots;
+			current_.push_back(0);
+		}
+	}
+
+	/**
+	 * Records the values in store as of time now. Counters and meters
+	 * which weren't in the store's latest update count as zero, gauges
+	 * carry their value forward, and timers with no new values are left
+	 * out.
+	 */
+	void
+	update(const key_store &store, clock::time_point now)
+	{
+		if(resolutions_.empty())
+			return;
+		advance(now);
+		while(blocks_.size() * block_keys < store.size())
+			blocks_.emplace_back(new block(rows_));
+		auto nodes = store.nodes() + 1;
+		for(key_store::node_id n = 0; n < nodes; ++n) {
+			const auto &e = store.at(n);
+			if(!e.present)
+				continue;
+			bool fresh = e.updated == store.generation();
+			float value = 0.0f;
+			float count = 0.0f;
+			switch(e.type) {
+			case metric::kind::counter:
+			case metric::kind::meter:
+				value = fresh ? static_cast<float>(e.value) : 0.0f;
+				count = fresh ? static_cast<float>(e.count) : 0.0f;
+				break;
+			case metric::kind::gauge:
+				value = static_cast<float>(e.value);
+				count = 1.0f;
+				break;
+			case metric::kind::timer:
+				if(!fresh)
+					continue;
+				value = static_cast<float>(e.value);
+				count = static_cast<float>(e.count);
+				break;
+			}
+			auto &b = *blocks_[e.id / block_keys];
+			auto lane = e.id % block_keys;
+			for(size_t i = 0; i < resolutions_.size(); ++i) {
+				auto at = (base_[i] + slot(i, current_[i])) * block_keys + lane;
+				combine(e.type, b.values[at], b.counts[at], value, count);
+			}
+		}
+	}
+
+	/**
+	 * History for key k between from and to inclusive, at the finest
+	 * resolution which still reaches back to from. Slots with no value
+	 * are skipped.
+	 */
+	std::vector<point>
+	range(key_store::value_id k, clock::time_point from, clock::time_point to) const
+	{
+		return range(k, from, to, pick(from));
+	}
+
+	/** As above, at resolution r */
+	std::vector<point>
+	range(key_store::value_id k, clock::time_point from, clock::time_point to, size_t r) const
+	{
+		std::vector<point> out;
+		if(!started_ || r >= resolutions_.size() || k / block_keys >= blocks_.size())
+			return out;
+		auto first = std::max(slot_number(r, from), current_[r] - static_cast<int64_t>(resolutions_[r].slots) + 1);
+		auto last = std::min(slot_number(r, to), current_[r]);
+		const auto &b = *blocks_[k / block_keys];
+		auto lane = k % block_keys;
+		for(auto s = first; s <= last; ++s) {
+			auto at = (base_[r] + slot(r, s)) * block_keys + lane;
+			if(std::isnan(b.values[at]))
+				continue;
+			out.push_back(point {
+				clock::time_point { std::chrono::duration_cast<clock::duration>(resolutions_[r].step * s) },
+				b.values[at],
+				b.counts[at]
+			});
+		}
+		return out;
+	}
+
+	/** The finest resolution whose ring still covers from, or the coarsest if none do */
+	size_t
+	pick(clock::time_point from) const
+	{
+		for(size_t i = 0; i < resolutions_.size(); ++i) {
+			if(slot_number(i, from) > current_[i] - static_cast<int64_t>(resolutions_[i].slots))
+				return i;
+		}
+		return resolutions_.empty() ? 0 : resolutions_.size() - 1;
+	}
+
+	const std::vector<resolution> &resolutions() const { return resolutions_; }
+
+	/** Memory held for history */
+	size_t bytes() const { return blocks_.size() * rows_ * block_keys * 2 * sizeof(float); }
+
+private:
+	/** Rows for every resolution, slot-major, for block_keys keys */
+	struct block {
+		explicit
+		block(
+			size_t rows
+		):values(rows * block_keys, std::numeric_limits<float>::quiet_NaN()),
+		  counts(rows * block_keys, 0.0f)
+		{
+		}
+
+		std::vector<float> values;
+		std::vector<float> counts;
+	};
+
+	int64_t
+	slot_number(size_t r, clock::time_point t) const
+	{
+		auto secs = std::chrono::duration_cast<std::chrono::seconds>(t.time_since_epoch()).count();
+		auto step = resolutions_[r].step.count();
+		return secs >= 0 ? secs / step : -((step - 1 - secs) / step);
+	}
+
+	size_t
+	slot(size_t r, int64_t number) const
+	{
+		auto slots = static_cast<int64_t>(resolutions_[r].slots);
+		return static_cast<size_t>(((number % slots) + slots) % slots);
+	}
+
+	/** Moves each ring on to the slot for now, clearing the ones it passes over */
+	void
+	advance(clock::time_point now)
+	{
+		for(size_t r = 0; r < resolutions_.size(); ++r) {
+			auto target = slot_number(r, now);
+			if(!started_) {
+				current_[r] = target;
+				continue;
+			}
+			/* A clock going backwards keeps writing into the current slot */
+			if(target <= current_[r])
+				continue;
+			auto slots = static_cast<int64_t>(resolutions_[r].slots);
+			auto from = std::max(current_[r] + 1, target - slots + 1);
+			for(auto s = from; s <= target; ++s)
+				clear(r, slot(r, s));
+			current_[r] = target;
+		}
+		started_ = true;
+	}
+
+	void
+	clear(size_t r, size_t row)
+	{
+		auto begin = (base_[r] + row) * block_keys;
+		for(auto &b : blocks_) {
+			std::fill_n(b->values.begin() + begin, static_cast<size_t>(block_keys), std::numeric_limits<float>::quiet_NaN());
+			std::fill_n(b->counts.begin() + begin, static_cast<size_t>(block_keys), 0.0f);
+		}
+	}
+
+	static
+	void
+	combine(metric::kind type, float &value, float &count, float v, float c)
+	{
+		if(std::isnan(value)) {
+			value = v;
+			count = c;
+			return;
+		}
+		switch(type) {
+		case metric::kind::counter:
+		case metric::kind::meter:
+			value += v;
+			break;
+		case metric::kind::gauge:
+			value = v;
+			break;
+		case metric::kind::timer:
+			if(count + c > 0.0f)
+				value = (value * count + v * c) / (count + c);
+			break;
+		}
+		count += c;
+	}
+
+	std::vector<resolution> resolutions_;
+	/** First row of each resolution within a block */
+	std::vector<size_t> base_;
+	size_t rows_;
+	/** Slot number - time / step - of each resolution's newest slot */
+	std::vector<int64_t> current_;
+	bool started_;
+	std::vector<std::unique_ptr<block>> blocks_;
+};
+
+};
+};
@@ -0,0 +1,290 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/asio/high_resolution_timer.hpp>
+
+#include <net/asio/udp_batch.h>
+#include <net/asio/statsd/interval.h>
+#include <net/asio/statsd/key_store.h>
+#include <net/asio/statsd/retention.h>
+
+namespace net {
+namespace statsd {
+
+/**
+ * A statsd server: receives metrics over UDP and aggregates them into an
+ * interval, handed out once per flush interval.
+ *
+ * Receiving is spread over a pool of threads, each with its own socket
+ * bound to the same port with SO_REUSEPORT, so the kernel shares incoming
+ * datagrams between them. Each thread drains its socket with recvmmsg(),
+ * parses the packets in place and aggregates into its own interval; at
+ * flush time, on the io_service given to the constructor, the per-thread
+ * intervals are swapped out and merged. The only lock is the one each
+ * thread holds while it works through a batch of datagrams, which the
+ * flush takes once per thread per interval.
+ *
+ * Gauges persist between intervals, as statsd expects; everything else
+ * starts again from zero. See gauges() for the current values,
+ * store() for the latest value of every key, arranged by path, and
+ * history() for each key's recent values.
+ *
+ * Must be held in a std::shared_ptr.
+ */
+class server : public std::enable_shared_from_this<server> {
+public:
+	struct options {
+		options(
+		):host{ "0.0.0.0" },
+		  port{ 8125 },
+		  threads{ std::max(1u, std::thread::hardware_concurrency()) },
+		  flush_interval{ std::chrono::seconds(10) },
+		  batch{ 64 },
+		  max_datagram{ 65536 },
+		  receive_buffer{ 4 * 1024 * 1024 },
+		  retention(retention::default_resolutions())
+		{
+		}
+
+		std::string host;
+		/** 0 picks a free port, which port() will then report */
+		uint16_t port;
+		/** Receiving threads, each with its own socket */
+		unsigned threads;
+		std::chrono::milliseconds flush_interval;
+		/** Datagrams read per recvmmsg() call */
+		size_t batch;
+		size_t max_datagram;
+		/** SO_RCVBUF for each socket, 0 for the system default */
+		int receive_buffer;
+		/** History kept for each key, finest first - empty to keep none */
+		std::vector<statsd::retention::resolution> retention;
+	};
+
+	using flush_handler = std::function<void(const interval &)>;
+
+	static
+	std::shared_ptr<server>
+	create(
+		boost::asio::io_service &service,
+		const options &opts = options { }
+	)
+	{
+		return std::make_shared<server>(service, opts);
+	}
+
+	server(
+		boost::asio::io_service &service,
+		const options &opts
+	):options_(opts),
+	  timer_(service),
+	  port_{ 0 }
+	{
+	}
+
+	virtual ~server() {
+		stop();
+	}
+
+	/**
+	 * Binds the sockets, starts the receiving threads and the flush timer.
+	 * Throws boost::system::system_error if the port can't be bound.
+	 */
+	void
+	start()
+	{
+		using boost::asio::ip::udp;
+		udp::endpoint ep { boost::asio::ip::address::from_string(options_.host), options_.port };
+		unsigned threads = options_.threads;
+#if !defined(SO_REUSEPORT)
+		/* Without it only one socket can have the port */
+		threads = 1;
+#endif
+		for(unsigned i = 0; i < std::max(1u, threads); ++i) {
+			auto w = std::make_shared<worker>(options_);
+			w->socket.open(ep.protocol());
+#if defined(SO_REUSEPORT)
+			w->socket.set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+#endif
+			if(options_.receive_buffer > 0) {
+				boost::system::error_code ignored;
+				w->socket.set_option(udp::socket::receive_buffer_size(options_.receive_buffer), ignored);
+			}
+			w->socket.bind(ep);
+			/* Later sockets need the port the first one actually got */
+			ep = w->socket.local_endpoint();
+			workers_.push_back(w);
+		}
+		port_ = ep.port();
+		for(auto &w : workers_) {
+			w->receive();
+			w->thread = std::thread([w]() { w->service.run(); });
+		}
+		arm_timer();
+	}
+
+	/** Stops receiving and flushing, and waits for the threads to finish */
+	void
+	stop()
+	{
+		boost::system::error_code ec;
+		timer_.cancel(ec);
+		for(auto &w : workers_)
+			w->service.stop();
+		for(auto &w : workers_) {
+			if(w->thread.joinable())
+				w->thread.join();
+			/* Let the pending wait see the socket close, so it lets go of the worker */
+			w->socket.close(ec);
+			w->service.reset();
+			w->service.poll();
+		}
+		workers_.clear();
+	}
+
+	uint16_t port() const { return port_; }
+	size_t threads() const { return workers_.size(); }
+
+	/** Called with each interval after it's merged */
+	void on_flush(flush_handler h) { handlers_.push_back(std::move(h)); }
+
+	/**
+	 * Collects everything received since the last flush, updates the
+	 * gauges and tells the handlers. Called by the timer; can also be
+	 * called directly from the io_service thread.
+	 */
+	interval
+	flush()
+	{
+		interval out;
+		for(auto &w : workers_) {
+			interval mine;
+			{
+				std::lock_guard<std::mutex> guard { w->mutex };
+				std::swap(mine, w->current);
+			}
+			out.merge(std::move(mine));
+		}
+		for(const auto &it : out.gauges) {
+			if(it.second.absolute)
+				gauges_[it.first] = it.second.value;
+			else
+				gauges_[it.first] += it.second.value;
+		}
+		store_.update(out, gauges_);
+		history_.update(store_, retention::clock::now());
+		for(auto &h : handlers_)
+			h(out);
+		return out;
+	}
+
+	/** Latest value for every gauge we've seen */
+	const std::unordered_map<std::string, double> &gauges() const { return gauges_; }
+
+	/** Latest value for every key, by path - see net::statsd::query_server to serve it */
+	const key_store &store() const { return store_; }
+
+	/** Recent values for every key, by store() value_id */
+	const retention &history() const { return history_; }
+
+	/** Metrics received since we started, across all threads */
+	uint64_t
+	received() const
+	{
+		uint64_t total = 0;
+		for(const auto &w : workers_)
+			total += w->received.load(std::memory_order_relaxed);
+		return total;
+	}
+
+private:
+	/** One receiving thread with its socket and its share of the interval */
+	struct worker : std::enable_shared_from_this<worker> {
+		worker(
+			const options &opts
+		):socket(service),
+		  batch(opts.batch, opts.max_datagram),
+		  received{ 0 }
+		{
+		}
+
+		/** Waits for the socket, then reads and parses everything waiting on it */
+		void
+		receive()
+		{
+			auto self = shared_from_this();
+			socket.async_wait(
+				boost::asio::ip::udp::socket::wait_read,
+				[self](const boost::system::error_code &ec) {
+					if(ec)
+						return;
+					self->drain();
+					self->receive();
+				}
+			);
+		}
+
+		void
+		drain()
+		{
+			boost::system::error_code ec;
+			while(batch.receive(socket, ec) > 0) {
+				std::lock_guard<std::mutex> guard { mutex };
+				auto before = current.metrics;
+				for(size_t i = 0; i < batch.received(); ++i) {
+					current.bad_lines += parser::parse_packet(batch.datagram(i), [this](const metric &m) {
+						current.add(m, scratch);
+					});
+				}
+				received.store(received.load(std::memory_order_relaxed) + (current.metrics - before), std::memory_order_relaxed);
+			}
+		}
+
+		boost::asio::io_service service;
+		boost::asio::ip::udp::socket socket;
+		net::asio::udp_batch batch;
+		std::string scratch;
+		std::mutex mutex;
+		interval current;
+		/** Running total, for server::received() */
+		std::atomic<uint64_t> received;
+		std::thread thread;
+	};
+
+	void
+	arm_timer()
+	{
+		std::weak_ptr<server> weak = shared_from_this();
+		timer_.expires_from_now(options_.flush_interval);
+		timer_.async_wait([weak](const boost::system::error_code &ec) {
+			if(ec)
+				return;
+			if(auto self = weak.lock()) {
+				self->flush();
+				self->arm_timer();
+			}
+		});
+	}
+
+	options options_;
+	boost::asio::high_resolution_timer timer_;
+	uint16_t port_;
+	std::vector<std::shared_ptr<worker>> workers_;
+	std::vector<flush_handler> handlers_;
+	std::unordered_map<std::string, double> gauges_;
+	key_store store_;
+	retention history_;
+};
+
+};
+};
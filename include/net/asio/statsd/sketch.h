@@ -0,0 +1,193 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+namespace net {
+namespace statsd {
+
+/**
+ * A mergeable quantile sketch for timer and histogram values, in the
+ * style of DDSketch: values fall into buckets whose bounds grow
+ * geometrically, so any quantile comes back within a fixed relative error
+ * of the true value (1% by default) however many values went in.
+ *
+ * Memory is bounded. Only the span of buckets between the smallest and
+ * largest values seen is allocated, and that span is capped at
+ * max_buckets; past that the lowest buckets are folded together, which
+ * only costs accuracy at the very bottom of the range. At 1% and the
+ * default of 2048 buckets, the full-accuracy range covers about 17 orders
+ * of magnitude.
+ *
+ * Two sketches with the same accuracy merge exactly, which is how values
+ * from several threads, or several intervals, are combined.
+ *
+ * Values at or below zero are counted in a single zero bucket: timers
+ * can't go negative, and a histogram that does gets 0 for those
+ * quantiles. count, sum, min and max are tracked exactly.
+ */
+class sketch {
+public:
+	explicit
+	sketch(
+		double relative_accuracy = 0.01,
+		size_t max_buckets = 2048
+	):accuracy_{ relative_accuracy },
+	  gamma_{ (1.0 + relative_accuracy) / (1.0 - relative_accuracy) },
+	  log_gamma_{ std::log(gamma_) },
+	  max_buckets_{ std::max<size_t>(max_buckets, 1) },
+	  offset_{ 0 },
+	  zero_{ 0.0 },
+	  count_{ 0.0 },
+	  sum_{ 0.0 },
+	  min_{ std::numeric_limits<double>::infinity() },
+	  max_{ -std::numeric_limits<double>::infinity() }
+	{
+		if(!(relative_accuracy > 0.0 && relative_accuracy < 1.0))
+			throw std::invalid_argument("sketch accuracy must be between 0 and 1");
+	}
+
+	/**
+	 * Adds a value, standing for weight events - 1/rate for sampled
+	 * metrics. Infinities and NaNs are ignored, since they have no bucket.
+	 */
+	void
+	add(double v, double weight = 1.0)
+	{
+		if(!std::isfinite(v) || !std::isfinite(weight))
+			return;
+		count_ += weight;
+		sum_ += v * weight;
+		min_ = std::min(min_, v);
+		max_ = std::max(max_, v);
+		if(!(v > min_indexable())) {
+			zero_ += weight;
+			return;
+		}
+		bucket(index(v)) += weight;
+	}
+
+	/** Adds everything from other, which must have the same accuracy */
+	void
+	merge(const sketch &other)
+	{
+		if(other.gamma_ != gamma_)
+			throw std::invalid_argument("can't merge sketches with different accuracy");
+		if(other.count_ == 0.0)
+			return;
+		count_ += other.count_;
+		sum_ += other.sum_;
+		min_ = std::min(min_, other.min_);
+		max_ = std::max(max_, other.max_);
+		zero_ += other.zero_;
+		for(size_t i = 0; i < other.counts_.size(); ++i) {
+			if(other.counts_[i] != 0.0)
+				bucket(other.offset_ + static_cast<int>(i)) += other.counts_[i];
+		}
+	}
+
+	/** The value at quantile q, from 0 to 1 - so the 99th percentile is 0.99 - taking the sample at that rank rather than interpolating */
+	double
+	quantile(double q) const
+	{
+		if(count_ == 0.0)
+			return 0.0;
+		if(q <= 0.0)
+			return min_;
+		if(q >= 1.0)
+			return max_;
+		double rank = q * (count_ - 1.0);
+		double seen = zero_;
+		if(seen > rank)
+			return std::max(0.0, min_);
+		for(size_t i = 0; i < counts_.size(); ++i) {
+			seen += counts_[i];
+			if(seen > rank)
+				return std::min(max_, std::max(min_, value(offset_ + static_cast<int>(i))));
+		}
+		return max_;
+	}
+
+	/** Percentile p, from 0 to 100 */
+	double percentile(double p) const { return quantile(p / 100.0); }
+
+	double count() const { return count_; }
+	double sum() const { return sum_; }
+	double min() const { return count_ > 0.0 ? min_ : 0.0; }
+	double max() const { return count_ > 0.0 ? max_ : 0.0; }
+	double mean() const { return count_ > 0.0 ? sum_ / count_ : 0.0; }
+	bool empty() const { return count_ == 0.0; }
+
+	double relative_accuracy() const { return accuracy_; }
+	/** Buckets currently allocated */
+	size_t buckets() const { return counts_.size(); }
+
+	void
+	clear()
+	{
+		counts_.clear();
+		offset_ = 0;
+		zero_ = count_ = sum_ = 0.0;
+		min_ = std::numeric_limits<double>::infinity();
+		max_ = -std::numeric_limits<double>::infinity();
+	}
+
+private:
+	/** Anything this small counts as zero, which keeps bucket indices in range */
+	static double min_indexable() { return 1e-9; }
+
+	int index(double v) const { return static_cast<int>(std::ceil(std::log(v) / log_gamma_)); }
+
+	/** Representative value for a bucket: the point with equal relative error to both its bounds */
+	double value(int i) const { return 2.0 * std::pow(gamma_, i) / (gamma_ + 1.0); }
+
+	/** The counter for bucket i, growing the span to cover it, or folding the bottom if that would be too wide */
+	double &
+	bucket(int i)
+	{
+		if(counts_.empty()) {
+			offset_ = i;
+			counts_.push_back(0.0);
+			return counts_[0];
+		}
+		int top = offset_ + static_cast<int>(counts_.size()) - 1;
+		if(i < offset_) {
+			if(static_cast<size_t>(top - i) + 1 > max_buckets_)
+				return counts_.front();
+			counts_.insert(counts_.begin(), static_cast<size_t>(offset_ - i), 0.0);
+			offset_ = i;
+		} else if(i > top) {
+			counts_.resize(static_cast<size_t>(i - offset_) + 1, 0.0);
+			if(counts_.size() > max_buckets_) {
+				/* Fold the lowest buckets into the lowest one we keep */
+				auto excess = counts_.size() - max_buckets_;
+				double folded = 0.0;
+				for(size_t k = 0; k <= excess; ++k)
+					folded += counts_[k];
+				counts_.erase(counts_.begin(), counts_.begin() + excess);
+				counts_.front() = folded;
+				offset_ += static_cast<int>(excess);
+			}
+		}
+		return counts_[static_cast<size_t>(i - offset_)];
+	}
+
+	double accuracy_;
+	double gamma_;
+	double log_gamma_;
+	size_t max_buckets_;
+	/** Bucket index of counts_[0] */
+	int offset_;
+	std::vector<double> counts_;
+	/** Weight of values too small to index */
+	double zero_;
+	double count_;
+	double sum_;
+	double min_;
+	double max_;
+};
+
+};
+};
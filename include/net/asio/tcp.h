@@ -7,6 +7,10 @@
 #include <boost/asio/ip/address.hpp>
 #include <cps/future.h>
 
+#include <net/asio/io_backend.h>
+#include <net/asio/happy_eyeballs.h>
+#include <net/asio/socket_options.h>
+
 namespace net {
 namespace asio {
 namespace tcp {
@@ -164,27 +168,30 @@ virtual ~client() { }
 				hostname,
 				std::to_string(port)
 			);
-			auto socket = std::make_shared<tcp::socket>(service_);
 
 			resolver->async_resolve(
 				*query,
-				[query, resolver, f, self, socket](const boost::system::error_code &ec, const tcp::resolver::iterator ei) {
+				[query, resolver, f, self](const boost::system::error_code &ec, tcp::resolver::iterator ei) {
 					if(ec) {
 						f->fail(ec.message());
 					} else {
-						boost::asio::async_connect(
-							*(socket),
-							ei,
-							[self, f, socket](boost::system::error_code ec, tcp::resolver::iterator it) {
-								if(ec) {
-									f->fail(ec.message());
-								} else {
-									tcp::socket::non_blocking_io nb(true);
-									socket->io_control(nb);
-									f->done(std::make_shared<stream>(socket));
-								}
-							}
-						);
+						/* Race the addresses rather than waiting on each in turn */
+						std::vector<tcp::endpoint> eps;
+						for(; ei != tcp::resolver::iterator { }; ++ei)
+							eps.push_back(ei->endpoint());
+						auto opt = self->connect_options_;
+						auto sockopt = self->socket_options_.for_candidates(eps.size());
+						opt.prepare = [sockopt](tcp::socket &sock) {
+							sockopt.apply_or_warn(sock);
+						};
+						auto race = std::make_shared<happy_eyeballs>(self->service_, eps, opt);
+						race->start()->on_done([f](std::shared_ptr<tcp::socket> socket) {
+							tcp::socket::non_blocking_io nb(true);
+							socket->io_control(nb);
+							f->done(std::make_shared<stream>(socket));
+						})->on_fail([f](const std::string &err) {
+							f->fail(err);
+						});
 					}
 				}
 			);
@@ -196,9 +203,16 @@ virtual ~client() { }
 		return f;
 	}
 
+	/** Staggering and per-attempt timeout for {@link connect} */
+	void connect_options(const happy_eyeballs::options &opt) { connect_options_ = opt; }
+	/** Options for the sockets {@link connect} opens */
+	void socket_options(const ::net::asio::socket_options &opt) { socket_options_ = opt; }
+
 private:
 	boost::asio::io_service &service_;
 	std::shared_ptr<stream> stream_;
+	happy_eyeballs::options connect_options_;
+	::net::asio::socket_options socket_options_;
 };
 
 class server : public std::enable_shared_from_this<server> {
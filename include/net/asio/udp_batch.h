@@ -0,0 +1,204 @@
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/utility/string_view.hpp>
+
+#if defined(__linux__)
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+namespace net {
+namespace asio {
+
+/**
+ * Sends and receives several UDP datagrams per system call.
+ *
+ * On Linux this is sendmmsg(2) and recvmmsg(2), which move a whole batch
+ * of datagrams across in one go; elsewhere it falls back to a loop of
+ * single sends and receives with the same interface. Both directions are
+ * non-blocking: they do as much as the socket will take right now, and
+ * report would_block once it won't take any more, so the caller can wait
+ * for the socket with async_wait() and try again.
+ *
+ * Buffers for receiving are allocated once and reused, as is the
+ * per-datagram bookkeeping, so a steady stream costs no allocations.
+ */
+class udp_batch {
+public:
+	using socket = boost::asio::ip::udp::socket;
+	using endpoint = boost::asio::ip::udp::endpoint;
+
+	udp_batch(
+		size_t max_datagrams = 64,
+		size_t max_size = 65536
+	):max_datagrams_{ std::max<size_t>(max_datagrams, 1) },
+	  max_size_{ max_size },
+	  received_{ 0 }
+	{
+	}
+
+	size_t max_datagrams() const { return max_datagrams_; }
+
+	/**
+	 * Sends the first n buffers to target as one datagram each, in order,
+	 * stopping early if the socket would block or fails. Returns how many
+	 * went; ec says why it stopped short.
+	 */
+	size_t
+	send(
+		socket &s,
+		const endpoint &target,
+		const boost::asio::const_buffer *bufs,
+		size_t n,
+		boost::system::error_code &ec
+	)
+	{
+		ec = boost::system::error_code { };
+		size_t sent = 0;
+#if defined(__linux__)
+		while(sent < n) {
+			auto count = std::min(n - sent, max_datagrams_);
+			prepare(count);
+			for(size_t i = 0; i < count; ++i) {
+				const auto &b = bufs[sent + i];
+				iov_[i].iov_base = const_cast<void *>(boost::asio::buffer_cast<const void *>(b));
+				iov_[i].iov_len = boost::asio::buffer_size(b);
+				auto &h = headers_[i].msg_hdr;
+				h = msghdr { };
+				h.msg_name = const_cast<sockaddr *>(target.data());
+				h.msg_namelen = static_cast<socklen_t>(target.size());
+				h.msg_iov = &iov_[i];
+				h.msg_iovlen = 1;
+			}
+			int rv;
+			do {
+				rv = ::sendmmsg(s.native_handle(), headers_.data(), static_cast<unsigned int>(count), MSG_DONTWAIT);
+			} while(rv < 0 && errno == EINTR);
+			if(rv < 0) {
+				ec = boost::system::error_code { errno, boost::asio::error::get_system_category() };
+				return sent;
+			}
+			/* On a partial batch, going round again has the kernel tell us why
+			 * the next one failed
+			 */
+			sent += static_cast<size_t>(rv);
+		}
+#else
+		bool was_blocking = !s.non_blocking();
+		s.non_blocking(true);
+		for(; sent < n; ++sent) {
+			s.send_to(boost::asio::buffer(bufs[sent]), target, 0, ec);
+			if(ec)
+				break;
+		}
+		if(was_blocking)
+			s.non_blocking(false);
+#endif
+		return sent;
+	}
+
+	/**
+	 * Reads whatever datagrams are waiting, up to max_datagrams, each of up
+	 * to max_size bytes. Returns how many, and sets ec to would_block if
+	 * there were none.
+	 */
+	size_t
+	receive(
+		socket &s,
+		boost::system::error_code &ec
+	)
+	{
+		ec = boost::system::error_code { };
+		received_ = 0;
+		if(storage_.empty()) {
+			storage_.resize(max_datagrams_ * max_size_);
+			senders_.resize(max_datagrams_);
+			sizes_.resize(max_datagrams_);
+		}
+#if defined(__linux__)
+		prepare(max_datagrams_);
+		for(size_t i = 0; i < max_datagrams_; ++i) {
+			iov_[i].iov_base = &storage_[i * max_size_];
+			iov_[i].iov_len = max_size_;
+			auto &h = headers_[i].msg_hdr;
+			h = msghdr { };
+			h.msg_name = senders_[i].data();
+			h.msg_namelen = static_cast<socklen_t>(senders_[i].capacity());
+			h.msg_iov = &iov_[i];
+			h.msg_iovlen = 1;
+		}
+		int rv;
+		do {
+			rv = ::recvmmsg(s.native_handle(), headers_.data(), static_cast<unsigned int>(max_datagrams_), MSG_DONTWAIT, nullptr);
+		} while(rv < 0 && errno == EINTR);
+		if(rv < 0) {
+			ec = boost::system::error_code { errno, boost::asio::error::get_system_category() };
+			return 0;
+		}
+		received_ = static_cast<size_t>(rv);
+		for(size_t i = 0; i < received_; ++i) {
+			sizes_[i] = headers_[i].msg_len;
+			senders_[i].resize(headers_[i].msg_hdr.msg_namelen);
+		}
+#else
+		bool was_blocking = !s.non_blocking();
+		s.non_blocking(true);
+		for(; received_ < max_datagrams_; ++received_) {
+			sizes_[received_] = s.receive_from(
+				boost::asio::buffer(&storage_[received_ * max_size_], max_size_),
+				senders_[received_],
+				0,
+				ec
+			);
+			if(ec)
+				break;
+		}
+		if(was_blocking)
+			s.non_blocking(false);
+		if(received_ > 0)
+			ec = boost::system::error_code { };
+#endif
+		return received_;
+	}
+
+	/** Number of datagrams from the last receive() */
+	size_t received() const { return received_; }
+
+	/** Content of datagram i from the last receive(), valid until the next one */
+	boost::string_view
+	datagram(size_t i) const
+	{
+		return boost::string_view { &storage_[i * max_size_], sizes_[i] };
+	}
+
+	const endpoint &sender(size_t i) const { return senders_[i]; }
+
+private:
+#if defined(__linux__)
+	void
+	prepare(size_t count)
+	{
+		if(headers_.size() < count) {
+			headers_.resize(count);
+			iov_.resize(count);
+		}
+	}
+
+	std::vector<mmsghdr> headers_;
+	std::vector<iovec> iov_;
+#endif
+
+	size_t max_datagrams_;
+	size_t max_size_;
+	std::vector<char> storage_;
+	std::vector<endpoint> senders_;
+	std::vector<size_t> sizes_;
+	size_t received_;
+};
+
+};
+};
@@ -1,11 +1,27 @@
 #include "catch.hpp"
+#include <algorithm>
+#include <cmath>
+#include <limits>
 #include <map>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
 #include <iostream>
 #include <functional>
+#include <vector>
 
 #include <boost/asio.hpp>
 
-// #include <net/asio/statsd.h>
+#include <net/asio/statsd.h>
+#include <net/asio/udp_batch.h>
+#include <net/asio/statsd/aggregator.h>
+#include <net/asio/statsd/recorder.h>
+#include <net/asio/statsd/sketch.h>
+#include <net/asio/statsd/server.h>
+#include <net/asio/statsd/key_store.h>
+#include <net/asio/statsd/query.h>
+#include <net/asio/statsd/retention.h>
 
 namespace net {
 namespace protocol {
@@ -97,7 +113,8 @@ public:
 		boost::asio::io_service &service
 	):endpoint_{ boost::asio::ip::udp::v4(), 0 },
 	  socket_{ service, endpoint_ },
-	  max_length_{1024}
+	  max_length_{1024},
+	  batch_{ 64, max_length_ }
 	{
 	}
 
@@ -108,28 +125,24 @@ public:
 	}
 
 	/**
-	 * statsd server - continuously accepts incoming message packets
+	 * statsd server - continuously accepts incoming message packets,
+	 * reading everything that's waiting each time the socket is ready
 	 */
 	void
 	accept_next()
 	{
 		auto self = shared_from_this();
-		/** Incoming data storage */
-		auto storage = std::make_shared<std::vector<char>>(max_length_);
-		socket_.async_receive_from(
-			boost::asio::buffer(&((*storage)[0]), storage->size()),
-			endpoint_,
-			/* We want to transfer std::unique_ptr ownership to our lambda, but
-			 * might not have C++14 semantics available
-			 */
-			[self, storage](
-				const boost::system::error_code &ec,
-				size_t bytes
-			) {
+		socket_.async_wait(
+			boost::asio::ip::udp::socket::wait_read,
+			[self](const boost::system::error_code &ec) {
 				if(ec) {
 					std::cerr << "Had an error while waiting for next packet: " << ec.message() << std::endl;
-				} else if(bytes > 0) {
-					self->on_packet(std::string { storage->cbegin(), storage->cend() });
+					return;
+				}
+				boost::system::error_code read_ec;
+				while(self->batch_.receive(self->socket_, read_ec) > 0) {
+					for(size_t i = 0; i < self->batch_.received(); ++i)
+						self->on_packet(self->batch_.datagram(i).to_string());
 				}
 				self->accept_next();
 			}
@@ -140,6 +153,7 @@ private:
 	boost::asio::ip::udp::endpoint endpoint_;
 	boost::asio::ip::udp::socket socket_;
 	size_t max_length_;
+	net::asio::udp_batch batch_;
 };
 
 /**
@@ -182,6 +196,819 @@ private:
 	size_t max_length_;
 };
 
+/** Collects whatever datagrams have arrived on a local UDP socket */
+class datagram_sink {
+public:
+	datagram_sink(
+		boost::asio::io_service &service
+	):socket_{ service, { boost::asio::ip::address_v4::loopback(), 0 } }
+	{
+		socket_.non_blocking(true);
+	}
+
+	net::statsd::connection_details details() const {
+		return net::statsd::connection_details { "127.0.0.1", socket_.local_endpoint().port() };
+	}
+
+	std::vector<std::string> received() {
+		std::vector<std::string> out;
+		std::vector<char> data(65536);
+		boost::system::error_code ec;
+		for(;;) {
+			auto n = socket_.receive(boost::asio::buffer(data), 0, ec);
+			if(ec)
+				break;
+			out.emplace_back(data.data(), n);
+		}
+		return out;
+	}
+
+private:
+	boost::asio::ip::udp::socket socket_;
+};
+
+/** The exact value at percentile p of sorted samples, interpolating between neighbours, to check sketches against */
+static
+double
+exact_percentile(const std::vector<double> &sorted, double p)
+{
+	if(sorted.empty())
+		return 0.0;
+	double rank = p / 100.0 * (sorted.size() - 1);
+	auto lower = static_cast<size_t>(std::floor(rank));
+	auto upper = std::min(lower + 1, sorted.size() - 1);
+	return sorted[lower] + (rank - lower) * (sorted[upper] - sorted[lower]);
+}
+
+SCENARIO("statsd batching", "[statsd]") {
+	boost::asio::io_service service;
+	datagram_sink sink { service };
+	auto stats = net::statsd::client::create(service);
+	stats->connect(sink.details());
+	service.run();
+	service.reset();
+	GIVEN("a client without batching") {
+		stats->inc("a");
+		stats->gauge("b", 7);
+		service.run();
+		THEN("each metric is its own datagram") {
+			auto got = sink.received();
+			REQUIRE(got.size() == 2);
+			CHECK(got[0] == "a:1|c");
+			CHECK(got[1] == "b:7|g");
+		}
+	}
+	GIVEN("a client batching into small datagrams") {
+		stats->batching(26, std::chrono::milliseconds(20));
+		WHEN("we send more than fits in one") {
+			std::vector<std::shared_ptr<cps::future<int>>> sent;
+			for(int i = 0; i < 5; ++i)
+				sent.push_back(stats->delta("key" + std::to_string(i), i));
+			service.run();
+			THEN("they are packed up to the limit") {
+				auto got = sink.received();
+				REQUIRE(got.size() == 2);
+				CHECK(got[0] == "key0:0|c\nkey1:1|c\nkey2:2|c");
+				CHECK(got[1] == "key3:3|c\nkey4:4|c");
+				for(const auto &d : got)
+					CHECK(d.size() <= 26);
+				AND_THEN("metrics in the same datagram share a future") {
+					CHECK(sent[0] == sent[2]);
+					CHECK(sent[2] != sent[3]);
+					REQUIRE(sent[0]->is_done());
+					CHECK(sent[0]->value() == 3);
+					REQUIRE(sent[4]->is_done());
+					CHECK(sent[4]->value() == 2);
+				}
+			}
+		}
+		WHEN("we flush by hand") {
+			stats->inc("x");
+			auto f = stats->flush();
+			service.run();
+			THEN("the partial batch goes out") {
+				auto got = sink.received();
+				REQUIRE(got.size() == 1);
+				CHECK(got[0] == "x:1|c");
+				CHECK(f->value() == 1);
+				CHECK(stats->flush()->value() == 0);
+			}
+		}
+	}
+}
+
+SCENARIO("statsd client-side aggregation", "[statsd]") {
+	boost::asio::io_service service;
+	datagram_sink sink { service };
+	auto stats = net::statsd::client::create(service);
+	stats->connect(sink.details());
+	service.run();
+	service.reset();
+	GIVEN("an aggregator in front of the client") {
+		auto agg = net::statsd::aggregator::create(service, stats, std::chrono::milliseconds(20));
+		agg->percentiles({ 50, 99.9 });
+		WHEN("we record several values per key") {
+			agg->inc("hits");
+			agg->inc("hits");
+			agg->delta("hits", 5);
+			agg->dec("hits");
+			agg->gauge("temp", 3);
+			agg->gauge("temp", 4);
+			for(int i = 1; i <= 100; ++i)
+				agg->timing("latency", i / 1000.0f);
+			auto timer = std::make_shared<boost::asio::high_resolution_timer>(service);
+			timer->expires_from_now(std::chrono::milliseconds(50));
+			timer->async_wait([agg](const boost::system::error_code &) { agg->stop(); });
+			service.run();
+			THEN("one summary per key is sent after the interval") {
+				auto got = sink.received();
+				std::set<std::string> lines { got.begin(), got.end() };
+				CHECK(got.size() == lines.size());
+				CHECK(lines.count("hits:6|c"));
+				CHECK(lines.count("temp:4|g"));
+				CHECK(lines.count("latency.count:100|c"));
+				CHECK(lines.count("latency.min:1|g"));
+				CHECK(lines.count("latency.max:100|g"));
+				CHECK(lines.count("latency.mean:50.5|g"));
+				/* Percentiles come from a sketch: within 1% of the sample at that rank, without interpolating */
+				auto gauge = [&](const std::string &name) {
+					for(const auto &line : lines) {
+						if(line.compare(0, name.size() + 1, name + ":") == 0)
+							return std::stod(line.substr(name.size() + 1));
+					}
+					return -1.0;
+				};
+				CHECK(gauge("latency.p50") == Approx(50).epsilon(0.01));
+				CHECK(gauge("latency.p999") == Approx(99).epsilon(0.01));
+				CHECK(got.size() == 8);
+			}
+		}
+	}
+	GIVEN("the percentile helpers") {
+		std::vector<double> v { 1, 2, 3, 4 };
+		CHECK(exact_percentile(v, 0) == 1);
+		CHECK(exact_percentile(v, 50) == 2.5);
+		CHECK(exact_percentile(v, 100) == 4);
+		CHECK(net::statsd::aggregator::format_ms(0.25) == "0.25");
+		CHECK(net::statsd::aggregator::percentile_suffix(99.9) == ".p999");
+	}
+}
+
+SCENARIO("statsd recording from other threads", "[statsd]") {
+	boost::asio::io_service service;
+	datagram_sink sink { service };
+	auto stats = net::statsd::client::create(service);
+	stats->connect(sink.details());
+	service.run();
+	service.reset();
+	/* We drain and flush by hand here */
+	auto agg = net::statsd::aggregator::create(service, stats, std::chrono::hours(1));
+	agg->stop();
+	GIVEN("a recorder with room for everything") {
+		auto rec = net::statsd::recorder::create(service, agg, std::chrono::hours(1), 16384);
+		rec->stop();
+		auto hits = rec->key("hits");
+		WHEN("several threads record at once") {
+			std::vector<std::thread> threads;
+			for(int t = 0; t < 4; ++t) {
+				threads.emplace_back([rec, hits, t]() {
+					for(int i = 0; i < 5000; ++i) {
+						rec->inc(hits);
+						rec->delta("by.name", 2);
+					}
+					rec->gauge("thread." + std::to_string(t), t);
+				});
+			}
+			for(auto &t : threads)
+				t.join();
+			rec->drain();
+			agg->flush();
+			service.run();
+			THEN("nothing is lost") {
+				auto got = sink.received();
+				std::set<std::string> lines { got.begin(), got.end() };
+				CHECK(lines.count("hits:20000|c"));
+				CHECK(lines.count("by.name:40000|c"));
+				CHECK(lines.count("thread.3:3|g"));
+				CHECK(rec->dropped() == 0);
+			}
+		}
+	}
+	GIVEN("a recorder with a tiny ring") {
+		auto rec = net::statsd::recorder::create(service, agg, std::chrono::hours(1), 16);
+		rec->stop();
+		CHECK(rec->capacity() == 16);
+		WHEN("we record more than it holds before a drain") {
+			for(int i = 0; i < 100; ++i) {
+				rec->inc("counted");
+				rec->timing("timed", 0.001f);
+			}
+			rec->drain();
+			agg->flush();
+			service.run();
+			THEN("counters are all kept, and excess timings dropped and counted") {
+				auto got = sink.received();
+				std::set<std::string> lines { got.begin(), got.end() };
+				CHECK(lines.count("counted:100|c"));
+				CHECK(lines.count("timed.count:16|c"));
+				CHECK(rec->dropped() == 84);
+			}
+		}
+	}
+}
+
+SCENARIO("statsd metric handles", "[statsd]") {
+	using net::statsd::metric_type;
+	boost::asio::io_service service;
+	datagram_sink sink { service };
+	auto stats = net::statsd::client::create(service);
+	stats->connect(sink.details());
+	service.run();
+	service.reset();
+	GIVEN("handles for each type") {
+		net::statsd::key hits { stats, "hits" };
+		net::statsd::key temp { stats, "temp", metric_type::gauge };
+		net::statsd::key latency { stats, "latency", metric_type::timer };
+		WHEN("we use them") {
+			++hits;
+			hits += 12;
+			--hits;
+			temp = -42;
+			latency.timing(0.25f);
+			service.run();
+			THEN("each sends a well-formed line") {
+				auto got = sink.received();
+				REQUIRE(got.size() == 5);
+				CHECK(got[0] == "hits:1|c");
+				CHECK(got[1] == "hits:12|c");
+				CHECK(got[2] == "hits:-1|c");
+				CHECK(got[3] == "temp:-42|g");
+				CHECK(got[4] == "latency:250|ms");
+				CHECK(hits.name() == "hits");
+			}
+		}
+	}
+	GIVEN("sampled handles") {
+		stats->batching(net::statsd::client::jumbo_payload(), std::chrono::milliseconds(10));
+		net::statsd::key half { stats, "half", metric_type::counter, 0.5 };
+		net::statsd::key none { stats, "none", metric_type::counter, 0.0 };
+		WHEN("we send many values") {
+			for(int i = 0; i < 10000; ++i) {
+				++half;
+				++none;
+			}
+			service.run();
+			THEN("about the right fraction are sent, marked with the rate") {
+				size_t lines = 0, wrong = 0;
+				for(const auto &d : sink.received()) {
+					std::istringstream in { d };
+					std::string line;
+					while(std::getline(in, line)) {
+						if(line != "half:1|c|@0.5")
+							++wrong;
+						++lines;
+					}
+				}
+				CHECK(wrong == 0);
+				CHECK(lines > 4500);
+				CHECK(lines < 5500);
+			}
+		}
+	}
+	GIVEN("the number formatter") {
+		char buf[24];
+		auto end = buf + sizeof(buf);
+		CHECK(std::string(net::statsd::detail::format_int(0, end), end) == "0");
+		CHECK(std::string(net::statsd::detail::format_int(1234567890123, end), end) == "1234567890123");
+		CHECK(std::string(net::statsd::detail::format_int(INT64_MIN, end), end) == "-9223372036854775808");
+	}
+}
+
+SCENARIO("statsd tags", "[statsd]") {
+	using net::statsd::tag_set;
+	GIVEN("some tag sets") {
+		tag_set none;
+		tag_set a { { "endpoint", "/users" }, { "status", "200" } };
+		tag_set b { { "endpoint", "/users" }, { "status", "200" } };
+		tag_set c = tag_set { { "endpoint", "/users" } }.with("status", "200");
+		tag_set messy { { "na,me", "va|l#ue\n" }, { "bare", "" } };
+		THEN("they serialise to the DogStatsD block") {
+			CHECK(none.wire() == "");
+			CHECK(none.empty());
+			CHECK(a.wire() == "|#endpoint:/users,status:200");
+			CHECK(messy.wire() == "|#na_me:va_l_ue_,bare");
+		}
+		THEN("equal sets are interned") {
+			CHECK(a == b);
+			CHECK(&a.wire() == &b.wire());
+			CHECK(a == c);
+			CHECK(a != none);
+		}
+	}
+	GIVEN("a client") {
+		boost::asio::io_service service;
+		datagram_sink sink { service };
+		auto stats = net::statsd::client::create(service);
+		stats->connect(sink.details());
+		service.run();
+		service.reset();
+		tag_set tags { { "status", "500" } };
+		WHEN("we send tagged metrics") {
+			stats->inc("requests", tags);
+			stats->gauge("queue", 3, tags);
+			net::statsd::key handle { stats, "errors", net::statsd::metric_type::counter, 1.0, tags };
+			handle += 2;
+			service.run();
+			THEN("the tags follow the type") {
+				auto got = sink.received();
+				REQUIRE(got.size() == 3);
+				CHECK(got[0] == "requests:1|c|#status:500");
+				CHECK(got[1] == "queue:3|g|#status:500");
+				CHECK(got[2] == "errors:2|c|#status:500");
+			}
+		}
+	}
+}
+
+SCENARIO("batched UDP I/O", "[statsd][udp]") {
+	boost::asio::io_service service;
+	boost::asio::ip::udp::socket rx { service, { boost::asio::ip::address_v4::loopback(), 0 } };
+	boost::asio::ip::udp::socket tx { service, { boost::asio::ip::address_v4::loopback(), 0 } };
+	GIVEN("a batch of datagrams") {
+		std::vector<std::string> data;
+		std::vector<boost::asio::const_buffer> bufs;
+		for(int i = 0; i < 100; ++i)
+			data.push_back("datagram " + std::to_string(i));
+		for(const auto &d : data)
+			bufs.push_back(boost::asio::buffer(d));
+		WHEN("we send them all at once") {
+			net::asio::udp_batch out { 32 };
+			boost::system::error_code ec;
+			auto sent = out.send(tx, rx.local_endpoint(), bufs.data(), bufs.size(), ec);
+			THEN("they all go, in order") {
+				CHECK(!ec);
+				CHECK(sent == 100);
+				net::asio::udp_batch in { 64, 1500 };
+				std::vector<std::string> got;
+				size_t calls = 0, strangers = 0;
+				while(in.receive(rx, ec) > 0) {
+					++calls;
+					for(size_t i = 0; i < in.received(); ++i) {
+						got.push_back(in.datagram(i).to_string());
+						if(in.sender(i) != tx.local_endpoint())
+							++strangers;
+					}
+				}
+				CHECK(strangers == 0);
+				CHECK(ec == boost::asio::error::would_block);
+				CHECK(got == data);
+				CHECK(calls == 2);
+			}
+		}
+	}
+	GIVEN("a statsd client batching many lines") {
+		datagram_sink sink { service };
+		auto stats = net::statsd::client::create(service);
+		stats->connect(sink.details());
+		service.run();
+		service.reset();
+		stats->batching(64, std::chrono::seconds(10));
+		std::vector<std::shared_ptr<cps::future<int>>> sent;
+		for(int i = 0; i < 200; ++i)
+			sent.push_back(stats->inc("key." + std::to_string(i)));
+		sent.push_back(stats->flush());
+		service.run();
+		THEN("every datagram is sent and accounted for") {
+			size_t lines = 0;
+			for(const auto &d : sink.received())
+				lines += std::count(d.begin(), d.end(), '\n') + 1;
+			CHECK(lines == 200);
+			CHECK(std::all_of(sent.begin(), sent.end(), [](const std::shared_ptr<cps::future<int>> &f) { return f->is_done(); }));
+		}
+	}
+}
+
+SCENARIO("statsd line parsing", "[statsd][server]") {
+	using net::statsd::metric;
+	using net::statsd::parser;
+	metric m;
+	GIVEN("each type") {
+		REQUIRE(parser::parse_line("hits:3|c", m));
+		CHECK(m.key == "hits");
+		CHECK(m.value == 3);
+		CHECK(m.type == metric::kind::counter);
+		CHECK(m.rate == 1.0);
+		REQUIRE(parser::parse_line("temp:-2.5|g", m));
+		CHECK(m.type == metric::kind::gauge);
+		CHECK(m.relative);
+		CHECK(m.value == -2.5);
+		REQUIRE(parser::parse_line("temp:7|g", m));
+		CHECK(!m.relative);
+		REQUIRE(parser::parse_line("lat:320|ms", m));
+		CHECK(m.type == metric::kind::timer);
+		REQUIRE(parser::parse_line("size:1e3|h", m));
+		CHECK(m.type == metric::kind::timer);
+		CHECK(m.value == 1000);
+		REQUIRE(parser::parse_line("reqs:2|m", m));
+		CHECK(m.type == metric::kind::meter);
+		REQUIRE(parser::parse_line("bare.key", m));
+		CHECK(m.type == metric::kind::meter);
+		CHECK(m.value == 1);
+	}
+	GIVEN("sample rates and tags") {
+		REQUIRE(parser::parse_line("hits:1|c|@0.25|#status:200,env:prod", m));
+		CHECK(m.rate == 0.25);
+		CHECK(m.tags == "status:200,env:prod");
+		REQUIRE(parser::parse_line("hits:1|c|#a|@0.5|T123", m));
+		CHECK(m.rate == 0.5);
+		CHECK(m.tags == "a");
+	}
+	GIVEN("malformed lines") {
+		CHECK(!parser::parse_line(":1|c", m));
+		CHECK(!parser::parse_line("k:1", m));
+		CHECK(!parser::parse_line("k:abc|c", m));
+		CHECK(!parser::parse_line("k:1|x", m));
+		CHECK(!parser::parse_line("k:1|c|@0", m));
+		CHECK(!parser::parse_line("k:1|c|@2", m));
+		CHECK(!parser::parse_line("k:|c", m));
+		CHECK(!parser::parse_line("k:1e400|ms", m));
+		CHECK(!parser::parse_line("k:-1e400|g", m));
+		CHECK(!parser::parse_line("k:1|c|@1e-400", m));
+	}
+	GIVEN("a packet of several lines") {
+		std::vector<std::string> keys;
+		auto bad = parser::parse_packet("a:1|c\nb:2|g\r\n\nbroken:|c\nhuge:1e400|ms\nc:3|ms", [&](const metric &m) {
+			keys.push_back(m.key.to_string());
+		});
+		CHECK(bad == 2);
+		CHECK(keys == (std::vector<std::string> { "a", "b", "c" }));
+	}
+}
+
+SCENARIO("quantile sketches", "[statsd][sketch]") {
+	GIVEN("values spread over several orders of magnitude") {
+		std::vector<double> values;
+		for(int i = 1; i <= 100000; ++i)
+			values.push_back(0.01 * i * (i % 7 + 1));
+		net::statsd::sketch all;
+		for(auto v : values)
+			all.add(v);
+		std::sort(values.begin(), values.end());
+		THEN("every percentile is within 1% of the exact one") {
+			size_t wrong = 0;
+			for(auto p : { 1.0, 10.0, 25.0, 50.0, 75.0, 90.0, 99.0, 99.9, 99.99 }) {
+				auto exact = exact_percentile(values, p);
+				if(std::abs(all.percentile(p) - exact) > 0.01 * exact)
+					++wrong;
+			}
+			CHECK(wrong == 0);
+			CHECK(all.count() == 100000);
+			CHECK(all.min() == values.front());
+			CHECK(all.max() == values.back());
+			CHECK(all.buckets() < 1000);
+		}
+		AND_WHEN("they are split between sketches and merged") {
+			std::vector<net::statsd::sketch> parts(4);
+			for(size_t i = 0; i < values.size(); ++i)
+				parts[i % parts.size()].add(values[i]);
+			net::statsd::sketch merged;
+			for(const auto &part : parts)
+				merged.merge(part);
+			THEN("the result is the same as one sketch seeing everything") {
+				CHECK(merged.count() == all.count());
+				CHECK(merged.percentile(50) == all.percentile(50));
+				CHECK(merged.percentile(99) == all.percentile(99));
+				CHECK(merged.percentile(99.9) == all.percentile(99.9));
+			}
+		}
+	}
+	GIVEN("a sketch with few buckets") {
+		net::statsd::sketch small { 0.01, 64 };
+		for(int i = 0; i < 1000; ++i)
+			small.add(std::pow(1.05, i));
+		THEN("memory stays bounded and the top of the range stays accurate") {
+			CHECK(small.buckets() == 64);
+			CHECK(small.count() == 1000);
+			CHECK(small.percentile(99.9) == Approx(std::pow(1.05, 998)).epsilon(0.02));
+		}
+	}
+	GIVEN("weights, zeros and mismatched sketches") {
+		net::statsd::sketch s;
+		s.add(0.0, 3);
+		s.add(10.0, 1);
+		CHECK(s.count() == 4);
+		CHECK(s.percentile(50) == 0.0);
+		CHECK(s.quantile(1.0) == 10.0);
+		CHECK(s.mean() == 2.5);
+		s.add(std::numeric_limits<double>::infinity());
+		s.add(-std::numeric_limits<double>::infinity());
+		s.add(std::numeric_limits<double>::quiet_NaN());
+		CHECK(s.count() == 4);
+		CHECK(s.max() == 10.0);
+		CHECK_THROWS_AS(s.merge(net::statsd::sketch { 0.05 }), std::invalid_argument);
+		s.clear();
+		CHECK(s.empty());
+		CHECK(s.percentile(50) == 0.0);
+	}
+}
+
+SCENARIO("statsd server", "[statsd][server]") {
+	boost::asio::io_service service;
+	GIVEN("a server with several receiving threads") {
+		net::statsd::server::options opts;
+		opts.host = "127.0.0.1";
+		opts.port = 0;
+		opts.threads = 3;
+		opts.flush_interval = std::chrono::hours(1);
+		/* Never run, so the flush timer doesn't fire and we flush by hand */
+		boost::asio::io_service flush_service;
+		auto srv = net::statsd::server::create(flush_service, opts);
+		srv->start();
+		REQUIRE(srv->port() > 0);
+		CHECK(srv->threads() == 3);
+		WHEN("clients send metrics") {
+			std::vector<std::shared_ptr<net::statsd::client>> clients;
+			for(int i = 0; i < 6; ++i) {
+				auto c = net::statsd::client::create(service);
+				c->connect(net::statsd::connection_details { "127.0.0.1", srv->port() });
+				c->batching(net::statsd::client::standard_payload(), std::chrono::milliseconds(1));
+				clients.push_back(c);
+			}
+			service.run();
+			service.reset();
+			for(auto &c : clients) {
+				for(int i = 0; i < 500; ++i) {
+					c->inc("hits");
+					c->timing("latency", i / 1000.0f);
+				}
+				c->delta("sampled", 1);
+				c->send("sampled", "1|c|@0.5");
+				c->gauge("temp", 10);
+				c->send("temp", "+1|g");
+				c->send("junk", "1|zz");
+			}
+			service.run();
+			service.reset();
+			auto expected = 6u * (500 * 2 + 4);
+			for(int i = 0; i < 200 && srv->received() < expected; ++i)
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			size_t flushed = 0;
+			srv->on_flush([&](const net::statsd::interval &) { ++flushed; });
+			auto out = srv->flush();
+			THEN("the threads' intervals are merged") {
+				CHECK(flushed == 1);
+				CHECK(out.metrics == expected);
+				CHECK(out.bad_lines == 6);
+				CHECK(out.counters.at("hits") == 3000);
+				CHECK(out.counters.at("sampled") == 18);
+				CHECK(out.timers.at("latency").count() == 3000);
+				CHECK(out.timers.at("latency").percentile(50) == Approx(249.5).epsilon(0.01));
+				CHECK(srv->gauges().count("temp"));
+				AND_THEN("the next interval starts empty, but gauges persist") {
+					auto next = srv->flush();
+					CHECK(next.empty());
+					CHECK(srv->gauges().count("temp"));
+				}
+			}
+		}
+		srv->stop();
+	}
+}
+
+SCENARIO("hierarchical key store", "[statsd][server]") {
+	using net::statsd::key_store;
+	using net::statsd::metric;
+	key_store store;
+	GIVEN("some keys") {
+		store.set("api.users.get", metric::kind::counter, 3, 3);
+		store.set("api.users.put", metric::kind::counter, 1, 1);
+		store.set("api.orders", metric::kind::gauge, 7, 1);
+		store.set("api.users.get|#status:500", metric::kind::counter, 2, 2);
+		store.set("db.latency", metric::kind::timer, 1.5, 10);
+		THEN("point lookups find them") {
+			REQUIRE(store.get("api.users.get"));
+			CHECK(store.get("api.users.get")->value == 3);
+			CHECK(store.get("api.users.get|#status:500")->value == 2);
+			CHECK(store.get("db.latency")->type == metric::kind::timer);
+			CHECK(!store.get("api.users"));
+			CHECK(!store.get("api.nothing"));
+			CHECK(store.find("api.users") != key_store::none());
+			CHECK(store.path(store.find("api.users.put")) == "api.users.put");
+		}
+		THEN("segments are shared and counted once") {
+			CHECK(store.size() == 5);
+			/* api, users, get, put, orders, get|#status:500, db, latency */
+			CHECK(store.nodes() == 8);
+			CHECK(store.segments() == 8);
+		}
+		THEN("a subtree lists only what's under it") {
+			std::set<std::string> seen;
+			store.for_each("api.users", [&](const std::string &path, const key_store::entry &) {
+				seen.insert(path);
+			});
+			CHECK(seen == (std::set<std::string> { "api.users.get", "api.users.put", "api.users.get|#status:500" }));
+			seen.clear();
+			store.for_each("", [&](const std::string &path, const key_store::entry &) {
+				seen.insert(path);
+			});
+			CHECK(seen.size() == 5);
+			seen.clear();
+			store.for_each_child("api", [&](const std::string &name, key_store::node_id) {
+				seen.insert(name);
+			});
+			CHECK(seen == (std::set<std::string> { "users", "orders" }));
+		}
+	}
+}
+
+SCENARIO("statsd retention", "[statsd][server]") {
+	using net::statsd::retention;
+	using net::statsd::key_store;
+	key_store store;
+	std::string scratch;
+	auto flush = [&](const std::string &packet) {
+		net::statsd::interval iv;
+		net::statsd::parser::parse_packet(packet, [&](const net::statsd::metric &m) { iv.add(m, scratch); });
+		std::unordered_map<std::string, double> gauges;
+		for(const auto &it : iv.gauges)
+			gauges[it.first] = it.second.value;
+		store.update(iv, gauges);
+	};
+	auto at = [](int64_t secs) { return retention::clock::time_point { std::chrono::seconds(secs) }; };
+	/* Six 10s slots and four 1m slots; t0 is the start of a minute */
+	retention history { { { std::chrono::seconds(10), 6 }, { std::chrono::minutes(1), 4 } } };
+	const int64_t t0 = 1800000000;
+	GIVEN("a few flushes") {
+		flush("hits:5|c\ntemp:20|g\nlat:10|ms\nlat:20|ms");
+		history.update(store, at(t0));
+		flush("hits:3|c\nlat:40|ms");
+		history.update(store, at(t0 + 10));
+		flush("");
+		history.update(store, at(t0 + 20));
+		auto hits = store.get("hits")->id;
+		auto temp = store.get("temp")->id;
+		auto lat = store.get("lat")->id;
+		THEN("the fine resolution has a slot per flush") {
+			auto points = history.range(hits, at(t0), at(t0 + 20), 0);
+			REQUIRE(points.size() == 3);
+			CHECK(points[0].time == at(t0));
+			CHECK(points[0].value == 5);
+			CHECK(points[1].value == 3);
+			/* A counter nobody sent is zero for the interval */
+			CHECK(points[2].value == 0);
+			/* Gauges carry forward; timers with nothing new have no value */
+			CHECK(history.range(temp, at(t0), at(t0 + 20), 0).size() == 3);
+			CHECK(history.range(lat, at(t0), at(t0 + 20), 0).size() == 2);
+		}
+		THEN("the coarse resolution rolls them up") {
+			auto points = history.range(hits, at(t0), at(t0 + 20), 1);
+			REQUIRE(points.size() == 1);
+			CHECK(points[0].value == 8);
+			auto latency = history.range(lat, at(t0), at(t0 + 20), 1);
+			REQUIRE(latency.size() == 1);
+			/* The mean of 10, 20 and 40, weighted by how many each slot saw */
+			CHECK(latency[0].value == Approx(70.0 / 3));
+			CHECK(latency[0].count == 3);
+			CHECK(history.range(temp, at(t0), at(t0 + 20), 1)[0].value == 20);
+		}
+		AND_WHEN("time moves past the fine ring") {
+			flush("hits:1|c");
+			history.update(store, at(t0 + 70));
+			THEN("old slots are cleared, and older ranges come from the coarse ring") {
+				/* t0 + 20 is the oldest slot left, and the empty ones after it have no value */
+				auto fine = history.range(hits, at(t0), at(t0 + 70), 0);
+				REQUIRE(fine.size() == 2);
+				CHECK(fine[0].time == at(t0 + 20));
+				CHECK(fine[1].value == 1);
+				CHECK(history.pick(at(t0)) == 1);
+				CHECK(history.pick(at(t0 + 30)) == 0);
+				auto points = history.range(hits, at(t0), at(t0 + 70));
+				REQUIRE(points.size() == 2);
+				CHECK(points[0].value == 8);
+				CHECK(points[1].time == at(t0 + 60));
+				CHECK(points[1].value == 1);
+			}
+		}
+	}
+	GIVEN("more keys than fit in one block") {
+		for(int i = 0; i < 1000; ++i)
+			store.set("k" + std::to_string(i), net::statsd::metric::kind::gauge, i, 1);
+		history.update(store, at(t0));
+		THEN("each key has its own history") {
+			size_t wrong = 0;
+			for(int i = 0; i < 1000; ++i) {
+				auto points = history.range(store.get("k" + std::to_string(i))->id, at(t0), at(t0));
+				if(points.size() != 1 || points[0].value != i)
+					++wrong;
+			}
+			CHECK(wrong == 0);
+			CHECK(history.bytes() == 4 * retention::block_keys * 10 * 2 * sizeof(float));
+		}
+	}
+	GIVEN("keys deep in the tree") {
+		for(size_t i = 0; i < retention::block_keys; ++i)
+			store.set("a.deep.path.k" + std::to_string(i), net::statsd::metric::kind::gauge, 1, 1);
+		history.update(store, at(t0));
+		THEN("parents with no value of their own take no history") {
+			CHECK(store.nodes() > retention::block_keys);
+			CHECK(history.bytes() == retention::block_keys * 10 * 2 * sizeof(float));
+			CHECK(history.range(store.get("a.deep.path.k0")->id, at(t0), at(t0)).size() == 1);
+		}
+	}
+	GIVEN("resolutions in the wrong order") {
+		CHECK_THROWS_AS(retention({ { std::chrono::minutes(1), 4 }, { std::chrono::seconds(10), 6 } }), std::invalid_argument);
+	}
+}
+
+SCENARIO("statsd query interface", "[statsd][server]") {
+	boost::asio::io_service service;
+	net::statsd::server::options opts;
+	opts.host = "127.0.0.1";
+	opts.port = 0;
+	opts.threads = 1;
+	opts.flush_interval = std::chrono::hours(1);
+	boost::asio::io_service flush_service;
+	auto srv = net::statsd::server::create(flush_service, opts);
+	srv->start();
+	auto stats = net::statsd::client::create(service);
+	stats->connect(net::statsd::connection_details { "127.0.0.1", srv->port() });
+	service.run();
+	service.reset();
+	stats->delta("web.requests.home", 5);
+	stats->delta("web.requests.about", 2);
+	stats->gauge("web.sessions", 12);
+	stats->timing("web.render", 0.004f);
+	service.run();
+	service.reset();
+	for(int i = 0; i < 200 && srv->received() < 4; ++i)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	srv->flush();
+	auto q = net::statsd::query_server::create(service, srv);
+	GIVEN("direct queries") {
+		CHECK(q->answer("get web.requests.home") == "web.requests.home c 5 5\nEND\n");
+		CHECK(q->answer("get web.nothing") == "END\n");
+		CHECK(q->answer("get web.render") == "web.render ms 4 1\nEND\n");
+		CHECK(q->answer("percentiles web.render 0 100") == "web.render p0 4\nweb.render p100 4\nEND\n");
+		CHECK(q->answer("percentiles web.requests.home") == "END\n");
+		CHECK(q->answer("percentiles web.render 101") == "ERROR bad percentile\n");
+		auto history = q->answer("range web.requests.home 60");
+		CHECK(history.compare(0, 18, "web.requests.home ") == 0);
+		REQUIRE(history.size() > 18 + 9);
+		CHECK(history.substr(history.size() - 9) == " 5 5\nEND\n");
+		CHECK(q->answer("range web.requests.home 0 1") == "END\n");
+		CHECK(q->answer("range web.requests.home") == "ERROR bad range\n");
+		/* Order within a level depends on the order keys first arrived */
+		auto lines = [&](const std::string &request) {
+			std::istringstream in { q->answer(request) };
+			std::set<std::string> out;
+			for(std::string line; std::getline(in, line); )
+				out.insert(line);
+			return out;
+		};
+		CHECK(lines("children web") == (std::set<std::string> { "sessions", "render", "requests", "END" }));
+		CHECK(lines("list web.requests") == (std::set<std::string> { "web.requests.home c 5 5", "web.requests.about c 2 2", "END" }));
+		CHECK(q->answer("stats") == "keys 4\nnodes 6\nsegments 6\nEND\n");
+		CHECK(q->answer("frobnicate") == "ERROR unknown command\n");
+	}
+	GIVEN("a TCP connection") {
+		q->listen();
+		std::thread io([&]() { service.run(); });
+		boost::asio::io_service client_service;
+		boost::asio::ip::tcp::socket sock { client_service };
+		sock.connect({ boost::asio::ip::address_v4::loopback(), q->port() });
+		std::string request = "list web.sessions\r\nget web.requests.about\n";
+		boost::asio::write(sock, boost::asio::buffer(request));
+		boost::asio::streambuf buf;
+		std::istream in { &buf };
+		auto reply = [&]() {
+			auto n = boost::asio::read_until(sock, buf, "END\n");
+			std::string out(n, '\0');
+			in.read(&out[0], n);
+			return out;
+		};
+		auto first = reply();
+		auto second = reply();
+		/* A line that never ends shouldn't be buffered forever */
+		boost::asio::ip::tcp::socket flood { client_service };
+		flood.connect({ boost::asio::ip::address_v4::loopback(), q->port() });
+		boost::asio::write(flood, boost::asio::buffer(std::string(2 * net::statsd::query_server::max_line(), 'x')));
+		boost::system::error_code flood_ec;
+		char byte;
+		boost::asio::read(flood, boost::asio::buffer(&byte, 1), flood_ec);
+		sock.close();
+		service.post([q]() { q->stop(); });
+		io.join();
+		THEN("we get the same answers, one per line sent") {
+			CHECK(first == "web.sessions g 12 1\nEND\n");
+			CHECK(second == "web.requests.about c 2 2\nEND\n");
+			/* Closing with the rest of the flood unread usually means a reset rather than a clean EOF */
+			bool dropped = flood_ec == boost::asio::error::eof || flood_ec == boost::asio::error::connection_reset;
+			CHECK(dropped);
+		}
+	}
+	srv->stop();
+}
+
 #if 0
 SCENARIO("statsd server") {
 	using namespace net::protocol;